@@ -0,0 +1,3 @@
+-- COPY of a small file. pgbench can't feed COPY FROM STDIN, so this reads a
+-- server-side file, whose quoted path run_bench.sh passes in as :copyfile.
+COPY bench_copy FROM :copyfile;
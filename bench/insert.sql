@@ -0,0 +1,3 @@
+-- Single-row INSERTs. Each one goes through the ExecutorCheckPerms hook.
+\set id random(1, 1000000)
+INSERT INTO bench_insert VALUES (:id, repeat('x', 100));
@@ -0,0 +1,188 @@
+#!/bin/bash
+#
+# run_bench.sh
+#		Benchmark the pg_quota worker's refresh, and the quota check overhead.
+#
+# Usage: run_bench.sh <bindir>
+#
+# Creates a scratch cluster in $BENCH_DIR, with pg_quota preloaded, and fills
+# it with a synthetic data directory: $BENCH_DATABASES databases, and in each
+# of them $BENCH_RELATIONS tables spread over the default tablespace and
+# $BENCH_TABLESPACES extra ones. Each table is padded out to $BENCH_SEGMENTS
+# sparse 1GB segments, so the files take no disk space, but the worker has to
+# stat() every one of them.
+#
+# It then restarts the cluster without a snapshot, and reports how long the
+# workers' first (cold) and subsequent (warm) full refreshes took, split into
+# the data directory scan, refresh_fs_model(), and the catalog lookups,
+# UpdateOrphans() and loading the quotas. Finally, it runs the pgbench scripts
+# in this directory with pg_quota.enforce on and off, for each client count in
+# $BENCH_CLIENTS, to measure what the ExecutorCheckPerms hook costs.
+#
+# Run "make install" first. "make bench" runs this with the right bindir.
+#
+# Copyright (c) 2013-2018, PostgreSQL Global Development Group
+
+set -e
+
+BINDIR=${1:?usage: run_bench.sh <bindir>}
+SCRIPTDIR=$(cd "$(dirname "$0")" && pwd)
+
+BENCH_DIR=${BENCH_DIR:-$SCRIPTDIR/tmp_bench}
+BENCH_PORT=${BENCH_PORT:-5499}
+BENCH_DATABASES=${BENCH_DATABASES:-4}
+BENCH_TABLESPACES=${BENCH_TABLESPACES:-2}
+BENCH_RELATIONS=${BENCH_RELATIONS:-1000}
+BENCH_SEGMENTS=${BENCH_SEGMENTS:-4}
+BENCH_REFRESHES=${BENCH_REFRESHES:-5}
+BENCH_CLIENTS=${BENCH_CLIENTS:-"1 4 16"}
+BENCH_DURATION=${BENCH_DURATION:-30}
+
+PGDATA=$BENCH_DIR/data
+LOGFILE=$BENCH_DIR/server.log
+export PGPORT=$BENCH_PORT
+export PGHOST=$BENCH_DIR
+
+psql()
+{
+	"$BINDIR/psql" -X -q -v ON_ERROR_STOP=1 "$@"
+}
+
+start_server()
+{
+	"$BINDIR/pg_ctl" -D "$PGDATA" -l "$LOGFILE" -w start >/dev/null
+}
+
+stop_server()
+{
+	"$BINDIR/pg_ctl" -D "$PGDATA" -w stop >/dev/null
+}
+
+# Wait until every worker has logged at least $1 full refreshes.
+wait_for_refreshes()
+{
+	local want=$1
+	local db n
+
+	for db in $(seq 1 "$BENCH_DATABASES"); do
+		while :; do
+			n=$(grep -c "\[bench$db\] LOG:  pg_quota refresh: full" "$LOGFILE" || true)
+			[ "$n" -ge "$want" ] && break
+			sleep 1
+		done
+	done
+}
+
+echo "creating cluster in $BENCH_DIR"
+if [ -f "$PGDATA/postmaster.pid" ]; then
+	stop_server || true
+fi
+rm -rf "$BENCH_DIR"
+mkdir -p "$BENCH_DIR"
+"$BINDIR/initdb" -D "$PGDATA" --no-sync >/dev/null
+
+cat >> "$PGDATA/postgresql.conf" <<EOF
+listen_addresses = ''
+unix_socket_directories = '$BENCH_DIR'
+log_line_prefix = '[%d] '
+max_worker_processes = $((BENCH_DATABASES + 8))
+shared_preload_libraries = 'pg_quota'
+pg_quota.max_workers = $BENCH_DATABASES
+pg_quota.launcher_naptime = '1 s'
+pg_quota.refresh_naptime = '1 s'
+pg_quota.log_refresh_stats = on
+# Make every refresh a full scan, without backing off, and don't let a
+# snapshot warm up the first one.
+pg_quota.use_inotify = off
+pg_quota.full_scan_interval = '1 s'
+pg_quota.snapshot_interval = 0
+EOF
+
+start_server
+
+echo "creating $BENCH_DATABASES databases with $BENCH_RELATIONS relations of $BENCH_SEGMENTS segments each"
+for spc in $(seq 1 "$BENCH_TABLESPACES"); do
+	mkdir -p "$BENCH_DIR/spc$spc"
+	psql -d postgres -c "CREATE TABLESPACE bench_spc$spc LOCATION '$BENCH_DIR/spc$spc'"
+done
+
+: > "$BENCH_DIR/segments"
+for db in $(seq 1 "$BENCH_DATABASES"); do
+	psql -d postgres -c "CREATE DATABASE bench$db"
+	psql -d "bench$db" <<EOF
+CREATE EXTENSION pg_quota;
+DO \$\$
+BEGIN
+  FOR i IN 1..$BENCH_RELATIONS LOOP
+    IF i % ($BENCH_TABLESPACES + 1) = 0 THEN
+      EXECUTE format('CREATE TABLE r_%s (a int)', i);
+    ELSE
+      EXECUTE format('CREATE TABLE r_%s (a int) TABLESPACE bench_spc%s',
+                     i, i % ($BENCH_TABLESPACES + 1));
+    END IF;
+  END LOOP;
+END
+\$\$;
+EOF
+	psql -d "bench$db" -At -c "SELECT pg_relation_filepath(oid) FROM pg_class WHERE relname LIKE 'r\\_%'" >> "$BENCH_DIR/segments"
+done
+
+# Tables for the pgbench runs, with a quota that is never reached, so that
+# every check goes all the way through CheckQuota().
+seq 1 100 | sed 's/$/\tbench copy row/' > "$BENCH_DIR/copy.data"
+psql -d bench1 <<EOF
+CREATE TABLE bench_insert (id int, payload text);
+CREATE TABLE bench_copy (id int, payload text);
+INSERT INTO quota.config VALUES (current_user::regrole, 1000000000000000);
+EOF
+
+stop_server
+
+# Pad every table out to full-sized, sparse, segments.
+while read -r path; do
+	truncate -s 1G "$PGDATA/$path"
+	for seg in $(seq 1 $((BENCH_SEGMENTS - 1))); do
+		truncate -s 1G "$PGDATA/$path.$seg"
+	done
+done < "$BENCH_DIR/segments"
+rm -f "$PGDATA"/pg_stat/pg_quota.*.snap
+
+echo "measuring $BENCH_REFRESHES refreshes"
+: > "$LOGFILE"
+start_server
+wait_for_refreshes "$BENCH_REFRESHES"
+
+echo
+echo "refresh times, ms (cold is the first full scan after startup)"
+printf "%-12s %12s %12s %12s %12s\n" database cold_scan cold_catalog warm_scan warm_catalog
+for db in $(seq 1 "$BENCH_DATABASES"); do
+	grep "\[bench$db\] LOG:  pg_quota refresh: full" "$LOGFILE" |
+		head -n "$BENCH_REFRESHES" |
+		awk -v db="bench$db" '
+			{ scan = $7; cat = $10 }
+			NR == 1 { cold_scan = scan; cold_cat = cat; next }
+			{ warm_scan += scan; warm_cat += cat; n++ }
+			END {
+				if (n > 0) { warm_scan /= n; warm_cat /= n }
+				printf "%-12s %12.3f %12.3f %12.3f %12.3f\n",
+					db, cold_scan, cold_cat, warm_scan, warm_cat
+			}'
+done
+
+echo
+echo "pgbench, $BENCH_DURATION s per run"
+printf "%-8s %-8s %8s %12s\n" script enforce clients tps
+for script in insert copy; do
+	for enforce in on off; do
+		for clients in $BENCH_CLIENTS; do
+			tps=$(PGOPTIONS="-c pg_quota.enforce=$enforce" \
+				"$BINDIR/pgbench" -n -M simple -f "$SCRIPTDIR/$script.sql" \
+				-D copyfile="'$BENCH_DIR/copy.data'" \
+				-c "$clients" -j "$clients" -T "$BENCH_DURATION" bench1 |
+				awk '/^tps = .*excluding/ { print $3 }')
+			printf "%-8s %-8s %8s %12s\n" "$script" "$enforce" "$clients" "$tps"
+		done
+	done
+done
+
+stop_server
@@ -3,8 +3,11 @@
  * enforcement.c
  *		Hooks to enforce the disk space quotas.
  *
- * This file contains functions for enforcing quotas. Currently, they are
- * only enforced for INSERTS and COPY, by using the ExecCheckRTPerms hook.
+ * This file contains functions for enforcing quotas. They are enforced for
+ * INSERTS and COPY at the beginning of the statement, by using the
+ * ExecCheckRTPerms hook, and for the utility commands that build new
+ * relation files, CREATE INDEX and REFRESH MATERIALIZED VIEW, by using the
+ * ProcessUtility hook. (CREATE TABLE AS goes through ExecCheckRTPerms.)
  *
  * Copyright (c) 2013-2018, PostgreSQL Global Development Group
  * -------------------------------------------------------------------------
@@ -12,19 +15,112 @@
 #include "postgres.h"
 
 #include "access/htup_details.h"
+#include "catalog/namespace.h"
 #include "catalog/pg_class.h"
+#include "catalog/pg_inherits.h"
 #include "executor/executor.h"
+#include "miscadmin.h"
+#include "tcop/utility.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
 
 #include "pg_quota.h"
 
+/* GUC variables */
+bool		pg_quota_enforce = true;
+bool		pg_quota_check_all_partitions = true;
+
 static bool quota_check_ExecCheckRTPerms(List *rangeTable, bool ereport_on_violation);
 
+static void quota_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+					 ProcessUtilityContext context, ParamListInfo params,
+					 QueryEnvironment *queryEnv, DestReceiver *dest,
+					 char *completionTag);
+
 static ExecutorCheckPerms_hook_type prev_ExecutorCheckPerms_hook;
+static ProcessUtility_hook_type prev_ProcessUtility_hook;
 static bool ExecutorCheckPerms_hook_installed = false;
 
 /*
- * Initialize enforcement, by installing the executor permission hook.
+ * Backend-local cache of relation owners, and the result of the last quota
+ * check for each relation.
+ *
+ * The owner is invalidated by relcache and syscache invalidation callbacks.
+ * The quota verdict is valid as long as the quota generation, see
+ * GetQuotaGeneration(), hasn't changed, and until 'recheck_at', if the owner
+ * is projected to exceed its quota soon.
+ */
+typedef struct
+{
+	Oid			relid;			/* hash key */
+	uint32		hashvalue;		/* RELOID syscache hash value of relid */
+	Oid			owner;
+	Oid			spcid;			/* tablespace of the relation */
+	uint64		generation;		/* quota generation of 'within_quota' */
+	bool		within_quota;	/* result of CheckQuota(owner, spcid) */
+	TimestampTz recheck_at;		/* recheck after this time, if nonzero */
+} RelQuotaCacheEntry;
+
+static HTAB *rel_quota_cache = NULL;
+
+/*
+ * An INSERT or COPY into a partitioned table only has the partitioned table
+ * in its range table, but the rows are routed into its partitions, which can
+ * be owned by other roles. So we also check the quota of every distinct
+ * owner (and tablespace) of the partitions in the tree, at the start of the
+ * statement, and cache the set of owners of each partitioned table. We don't
+ * know which partitions the rows will go to, so the statement is rejected if
+ * any of them is over quota. With pg_quota.check_all_partitions off, only
+ * the partitions owned by the partitioned table's owner, or by the
+ * inserting role, count, so that one role over quota doesn't block
+ * everyone's inserts into the whole tree.
+ *
+ * A partition tree is invalidated by a relcache invalidation of any of its
+ * members, which covers attaching and detaching partitions, and changes to
+ * their owner or tablespace. partition_member_map maps each member to the
+ * partitioned table whose tree it is in, or to InvalidOid, if it's in more
+ * than one cached tree, e.g. both a sub-partitioned table's and its
+ * parent's. Invalidating such a member flushes all the trees. The map is
+ * not cleaned up when a tree is dropped from the cache.
+ */
+typedef struct
+{
+	Oid			owner;
+	Oid			spcid;
+	uint64		generation;		/* quota generation of 'within_quota' */
+	bool		within_quota;	/* result of CheckQuota(owner, spcid) */
+	TimestampTz recheck_at;		/* recheck after this time, if nonzero */
+} PartitionOwner;
+
+typedef struct
+{
+	Oid			relid;			/* hash key: the partitioned table */
+	uint64		build_id;		/* identifies this build of the tree */
+	Oid			root_owner;		/* owner of the partitioned table */
+	int			nowners;
+	PartitionOwner *owners;		/* distinct owners of the leaf partitions */
+} PartitionTreeCacheEntry;
+
+typedef struct
+{
+	Oid			relid;			/* hash key: a member of a cached tree */
+	Oid			root;			/* the tree, or InvalidOid if in several */
+} PartitionMemberEntry;
+
+static HTAB *partition_tree_cache = NULL;
+static HTAB *partition_member_map = NULL;
+
+/* Bumped by every relcache invalidation, to notice them during a build */
+static uint64 partition_inval_count = 0;
+static uint64 partition_build_count = 0;
+
+/*
+ * Initialize enforcement, by installing the executor permission and utility
+ * hooks.
  */
 void
 init_quota_enforcement(void)
@@ -34,12 +130,20 @@ init_quota_enforcement(void)
 		prev_ExecutorCheckPerms_hook = ExecutorCheckPerms_hook;
 		ExecutorCheckPerms_hook = quota_check_ExecCheckRTPerms;
 
-		elog(DEBUG1, "disk quota permissions hook installed");
+		prev_ProcessUtility_hook = ProcessUtility_hook;
+		ProcessUtility_hook = quota_ProcessUtility;
+
+		ExecutorCheckPerms_hook_installed = true;
+
+		elog(DEBUG1, "disk quota permissions and utility hooks installed");
 	}
 }
 
+/*
+ * Look up the owner of a relation. Also returns the tablespace it's in.
+ */
 static Oid
-get_rel_owner(Oid relid)
+get_rel_owner(Oid relid, Oid *spcid)
 {
 	HeapTuple	tp;
 
@@ -50,6 +154,8 @@ get_rel_owner(Oid relid)
 		Oid			result;
 
 		result = reltup->relowner;
+		*spcid = OidIsValid(reltup->reltablespace) ?
+			reltup->reltablespace : MyDatabaseTableSpace;
 		ReleaseSysCache(tp);
 		return result;
 	}
@@ -60,6 +166,442 @@ get_rel_owner(Oid relid)
 	}
 }
 
+/*
+ * Drop a partition tree from the cache.
+ */
+static void
+remove_partition_tree(Oid root)
+{
+	PartitionTreeCacheEntry *tree;
+
+	tree = (PartitionTreeCacheEntry *) hash_search(partition_tree_cache,
+												   (void *) &root,
+												   HASH_FIND, NULL);
+	if (tree)
+	{
+		pfree(tree->owners);
+		(void) hash_search(partition_tree_cache, (void *) &root,
+						   HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Drop the partition trees that 'relid' is a member of, or all of them, if
+ * 'relid' is InvalidOid.
+ */
+static void
+invalidate_partition_trees(Oid relid)
+{
+	HASH_SEQ_STATUS iter;
+	PartitionTreeCacheEntry *tree;
+	PartitionMemberEntry *member;
+
+	if (OidIsValid(relid))
+	{
+		member = (PartitionMemberEntry *) hash_search(partition_member_map,
+													  (void *) &relid,
+													  HASH_FIND, NULL);
+		if (!member)
+			return;
+		if (OidIsValid(member->root))
+		{
+			remove_partition_tree(member->root);
+			return;
+		}
+	}
+
+	hash_seq_init(&iter, partition_tree_cache);
+	while ((tree = hash_seq_search(&iter)) != NULL)
+	{
+		pfree(tree->owners);
+		(void) hash_search(partition_tree_cache, (void *) &tree->relid,
+						   HASH_REMOVE, NULL);
+	}
+	hash_seq_init(&iter, partition_member_map);
+	while ((member = hash_seq_search(&iter)) != NULL)
+		(void) hash_search(partition_member_map, (void *) &member->relid,
+						   HASH_REMOVE, NULL);
+}
+
+/*
+ * Invalidation callbacks for the relation quota cache.
+ */
+static void
+rel_quota_cache_relcache_callback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS iter;
+	RelQuotaCacheEntry *entry;
+
+	partition_inval_count++;
+	invalidate_partition_trees(relid);
+
+	if (OidIsValid(relid))
+	{
+		(void) hash_search(rel_quota_cache, (void *) &relid,
+						   HASH_REMOVE, NULL);
+		return;
+	}
+
+	/* Invalidate everything */
+	hash_seq_init(&iter, rel_quota_cache);
+	while ((entry = hash_seq_search(&iter)) != NULL)
+		(void) hash_search(rel_quota_cache, (void *) &entry->relid,
+						   HASH_REMOVE, NULL);
+}
+
+static void
+rel_quota_cache_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS iter;
+	RelQuotaCacheEntry *entry;
+
+	hash_seq_init(&iter, rel_quota_cache);
+	while ((entry = hash_seq_search(&iter)) != NULL)
+	{
+		if (hashvalue == 0 || entry->hashvalue == hashvalue)
+			(void) hash_search(rel_quota_cache, (void *) &entry->relid,
+							   HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * A change in pg_auth_members can change which group quotas apply to an
+ * owner, so forget all the verdicts, but keep the owners.
+ */
+static void
+rel_quota_cache_authmem_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS iter;
+	RelQuotaCacheEntry *entry;
+	PartitionTreeCacheEntry *tree;
+	int			i;
+
+	hash_seq_init(&iter, rel_quota_cache);
+	while ((entry = hash_seq_search(&iter)) != NULL)
+		entry->generation = 1;	/* an odd generation never matches */
+
+	hash_seq_init(&iter, partition_tree_cache);
+	while ((tree = hash_seq_search(&iter)) != NULL)
+	{
+		for (i = 0; i < tree->nowners; i++)
+			tree->owners[i].generation = 1;
+	}
+}
+
+static void
+init_rel_quota_cache(void)
+{
+	HASHCTL		hash_ctl;
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(RelQuotaCacheEntry);
+
+	rel_quota_cache = hash_create("pg_quota relation cache",
+								  64,
+								  &hash_ctl,
+								  HASH_ELEM | HASH_BLOBS);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(PartitionTreeCacheEntry);
+
+	partition_tree_cache = hash_create("pg_quota partition tree cache",
+									   16,
+									   &hash_ctl,
+									   HASH_ELEM | HASH_BLOBS);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(PartitionMemberEntry);
+
+	partition_member_map = hash_create("pg_quota partition member map",
+									   256,
+									   &hash_ctl,
+									   HASH_ELEM | HASH_BLOBS);
+
+	CacheRegisterRelcacheCallback(rel_quota_cache_relcache_callback,
+								  (Datum) 0);
+	CacheRegisterSyscacheCallback(RELOID,
+								  rel_quota_cache_syscache_callback,
+								  (Datum) 0);
+	CacheRegisterSyscacheCallback(AUTHMEMMEMROLE,
+								  rel_quota_cache_authmem_callback,
+								  (Datum) 0);
+}
+
+/*
+ * Check the quota of a relation's owner, using the cache if possible.
+ *
+ * Returns false if the owner is over quota.
+ */
+static bool
+CheckRelQuota(Oid relid)
+{
+	RelQuotaCacheEntry *entry;
+	uint64		generation;
+	Oid			owner;
+	Oid			spcid;
+	bool		within_quota;
+	TimestampTz recheck_at;
+
+	if (rel_quota_cache == NULL)
+		init_rel_quota_cache();
+
+	/*
+	 * Read the generation before checking the quota. If it changes while we
+	 * compute the result, the cached result will be simply recomputed the
+	 * next time.
+	 */
+	generation = GetQuotaGeneration();
+
+	entry = (RelQuotaCacheEntry *) hash_search(rel_quota_cache,
+											   (void *) &relid,
+											   HASH_FIND, NULL);
+	if (entry)
+	{
+		if (entry->generation == generation && (generation & 1) == 0 &&
+			(entry->recheck_at == 0 ||
+			 GetCurrentTimestamp() < entry->recheck_at))
+			return entry->within_quota;
+
+		owner = entry->owner;
+		spcid = entry->spcid;
+	}
+	else
+	{
+		/*
+		 * Look up the owner. Note that the syscache lookup can process
+		 * invalidation messages, so we mustn't hold a pointer to a cache
+		 * entry across it.
+		 */
+		owner = get_rel_owner(relid, &spcid);
+		if (owner == InvalidOid)
+			return true; /* no owner, huh? */
+	}
+
+	within_quota = CheckQuota(owner, spcid, &recheck_at);
+
+	entry = (RelQuotaCacheEntry *) hash_search(rel_quota_cache,
+											   (void *) &relid,
+											   HASH_ENTER, NULL);
+	entry->hashvalue = GetSysCacheHashValue1(RELOID, ObjectIdGetDatum(relid));
+	entry->owner = owner;
+	entry->spcid = spcid;
+	entry->generation = generation;
+	entry->within_quota = within_quota;
+	entry->recheck_at = recheck_at;
+
+	return within_quota;
+}
+
+/*
+ * Collect the distinct owners and tablespaces of the partitions in the tree
+ * of a partitioned table, into an array allocated in TopMemoryContext.
+ * Partitioned tables and foreign tables have no storage of their own, so
+ * only their partitions count. Also returns the members of the tree.
+ *
+ * The partitions are not locked. One that is concurrently dropped is just
+ * left out.
+ */
+static PartitionOwner *
+get_partition_owners(Oid relid, int *nowners, List **members)
+{
+	HTAB	   *owners_map;
+	HASHCTL		hash_ctl;
+	HASH_SEQ_STATUS iter;
+	PartitionOwner *owners;
+	PartitionOwner *po;
+	ListCell   *lc;
+	int			n = 0;
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = 2 * sizeof(Oid);
+	hash_ctl.entrysize = sizeof(PartitionOwner);
+	hash_ctl.hcxt = CurrentMemoryContext;
+
+	owners_map = hash_create("pg_quota partition owners",
+							 16,
+							 &hash_ctl,
+							 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	*members = find_all_inheritors(relid, NoLock, NULL);
+	foreach(lc, *members)
+	{
+		Oid			partid = lfirst_oid(lc);
+		HeapTuple	tp;
+		Form_pg_class reltup;
+		Oid			key[2];
+
+		tp = SearchSysCache1(RELOID, ObjectIdGetDatum(partid));
+		if (!HeapTupleIsValid(tp))
+			continue;
+		reltup = (Form_pg_class) GETSTRUCT(tp);
+		if (reltup->relkind != RELKIND_PARTITIONED_TABLE &&
+			reltup->relkind != RELKIND_FOREIGN_TABLE)
+		{
+			key[0] = reltup->relowner;
+			key[1] = OidIsValid(reltup->reltablespace) ?
+				reltup->reltablespace : MyDatabaseTableSpace;
+			(void) hash_search(owners_map, (void *) key, HASH_ENTER, NULL);
+		}
+		ReleaseSysCache(tp);
+	}
+
+	owners = MemoryContextAlloc(TopMemoryContext,
+								Max(hash_get_num_entries(owners_map), 1) *
+								sizeof(PartitionOwner));
+	hash_seq_init(&iter, owners_map);
+	while ((po = hash_seq_search(&iter)) != NULL)
+	{
+		owners[n].owner = po->owner;
+		owners[n].spcid = po->spcid;
+		/* an odd generation never matches, so there's no verdict yet */
+		owners[n].generation = 1;
+		owners[n].within_quota = true;
+		owners[n].recheck_at = 0;
+		n++;
+	}
+	hash_destroy(owners_map);
+
+	*nowners = n;
+	return owners;
+}
+
+/*
+ * Check the quotas of the owners of the partitions of a partitioned table,
+ * using the cache if possible. With pg_quota.check_all_partitions off, only
+ * the partitioned table's owner and the current user are checked.
+ *
+ * Returns false if any of them is over quota.
+ */
+static bool
+CheckPartitionTreeQuota(Oid relid)
+{
+	PartitionTreeCacheEntry *tree;
+	PartitionOwner *owners;
+	int			nowners;
+	Oid			root_owner;
+	uint64		generation;
+	uint64		build_id;
+	bool		cached;
+	bool		within_quota = true;
+	TimestampTz now = GetCurrentTimestamp();
+	int			i;
+
+	if (rel_quota_cache == NULL)
+		init_rel_quota_cache();
+
+	generation = GetQuotaGeneration();
+
+	tree = (PartitionTreeCacheEntry *) hash_search(partition_tree_cache,
+												   (void *) &relid,
+												   HASH_FIND, NULL);
+	if (tree)
+	{
+		cached = true;
+		build_id = tree->build_id;
+		root_owner = tree->root_owner;
+		nowners = tree->nowners;
+		owners = tree->owners;
+	}
+	else
+	{
+		uint64		inval_count = partition_inval_count;
+		List	   *members;
+		ListCell   *lc;
+		Oid			root_spcid;
+
+		root_owner = get_rel_owner(relid, &root_spcid);
+		owners = get_partition_owners(relid, &nowners, &members);
+		build_id = ++partition_build_count;
+
+		/*
+		 * If any relcache invalidations arrived while we were reading the
+		 * catalogs, the result might already be stale. Use it for this
+		 * statement, but don't cache it.
+		 */
+		cached = (partition_inval_count == inval_count);
+		if (cached)
+		{
+			tree = (PartitionTreeCacheEntry *) hash_search(partition_tree_cache,
+														   (void *) &relid,
+														   HASH_ENTER, NULL);
+			tree->build_id = build_id;
+			tree->root_owner = root_owner;
+			tree->nowners = nowners;
+			tree->owners = owners;
+
+			foreach(lc, members)
+			{
+				Oid			member_relid = lfirst_oid(lc);
+				PartitionMemberEntry *member;
+				bool		found;
+
+				member = (PartitionMemberEntry *) hash_search(partition_member_map,
+															  (void *) &member_relid,
+															  HASH_ENTER, &found);
+				if (!found)
+					member->root = relid;
+				else if (!OidIsValid(member->root) || member->root == relid)
+					continue;
+				else if (hash_search(partition_tree_cache,
+									 (void *) &member->root,
+									 HASH_FIND, NULL) != NULL)
+					member->root = InvalidOid;	/* in two cached trees */
+				else
+					member->root = relid;	/* the old tree is gone */
+			}
+		}
+		list_free(members);
+	}
+
+	/*
+	 * Checking a quota can look up the role's groups in the catalogs, which
+	 * can process invalidations and free the cached tree, so work on a copy
+	 * of the owners, and store the verdicts back afterwards, if the tree is
+	 * still there.
+	 */
+	if (cached)
+	{
+		PartitionOwner *copy = palloc(Max(nowners, 1) * sizeof(PartitionOwner));
+
+		memcpy(copy, owners, nowners * sizeof(PartitionOwner));
+		owners = copy;
+	}
+
+	for (i = 0; i < nowners; i++)
+	{
+		PartitionOwner *po = &owners[i];
+
+		if (!pg_quota_check_all_partitions &&
+			po->owner != root_owner && po->owner != GetUserId())
+			continue;
+
+		if (po->generation != generation || (generation & 1) != 0 ||
+			(po->recheck_at != 0 && now >= po->recheck_at))
+		{
+			po->within_quota = CheckQuota(po->owner, po->spcid,
+										  &po->recheck_at);
+			po->generation = generation;
+		}
+		if (!po->within_quota)
+			within_quota = false;
+	}
+
+	if (cached)
+	{
+		tree = (PartitionTreeCacheEntry *) hash_search(partition_tree_cache,
+													   (void *) &relid,
+													   HASH_FIND, NULL);
+		if (tree && tree->build_id == build_id)
+			memcpy(tree->owners, owners, nowners * sizeof(PartitionOwner));
+	}
+	pfree(owners);
+
+	return within_quota;
+}
+
 /*
  * Permission check hook function. Throws an error if you try to INSERT
  * (or COPY) into a table, and the quota has been exceeded.
@@ -68,11 +610,14 @@ static bool
 quota_check_ExecCheckRTPerms(List *rangeTable, bool ereport_on_violation)
 {
 	ListCell   *l;
+	bool		within_quota;
+
+	if (!pg_quota_enforce)
+		return true;
 
 	foreach(l, rangeTable)
 	{
 		RangeTblEntry *rte = (RangeTblEntry *) lfirst(l);
-		Oid			owner;
 
 		/* see ExecCheckRTEPerms() */
 		if (rte->rtekind != RTE_RELATION)
@@ -89,11 +634,13 @@ quota_check_ExecCheckRTPerms(List *rangeTable, bool ereport_on_violation)
 		 * Perform the check as the relation's owner, rather than the current
 		 * user.
 		 */
-		owner = get_rel_owner(rte->relid);
-		if (owner == InvalidOid)
-			return true; /* no owner, huh? */
+		within_quota = CheckRelQuota(rte->relid);
 
-		if (!CheckQuota(owner))
+		/* Also check the owners of the partitions the rows are routed to */
+		if (within_quota && rte->relkind == RELKIND_PARTITIONED_TABLE)
+			within_quota = CheckPartitionTreeQuota(rte->relid);
+		CountQuotaCheck(!within_quota);
+		if (!within_quota)
 		{
 			/*
 			 * The owner is out of quota. Report error.
@@ -110,3 +657,68 @@ quota_check_ExecCheckRTPerms(List *rangeTable, bool ereport_on_violation)
 
 	return true;
 }
+
+/*
+ * ProcessUtility hook function. Throws an error if you try to CREATE INDEX on
+ * a table, or REFRESH a materialized view, whose owner is over quota. Both
+ * write a whole new relation file, owned by the table's owner.
+ *
+ * Other commands that rewrite a table, like CLUSTER and VACUUM FULL, are
+ * allowed, because they usually give space back in the end.
+ */
+static void
+quota_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+					 ProcessUtilityContext context, ParamListInfo params,
+					 QueryEnvironment *queryEnv, DestReceiver *dest,
+					 char *completionTag)
+{
+	Node	   *parsetree = pstmt->utilityStmt;
+	RangeVar   *relation = NULL;
+
+	if (pg_quota_enforce)
+	{
+		switch (nodeTag(parsetree))
+		{
+			case T_IndexStmt:
+				relation = ((IndexStmt *) parsetree)->relation;
+				break;
+			case T_RefreshMatViewStmt:
+				relation = ((RefreshMatViewStmt *) parsetree)->relation;
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (relation)
+	{
+		Oid			relid;
+
+		/*
+		 * The command itself locks the relation, and complains if it doesn't
+		 * exist, so don't bother with either here.
+		 */
+		relid = RangeVarGetRelid(relation, NoLock, true);
+		if (OidIsValid(relid))
+		{
+			bool		within_quota = CheckRelQuota(relid);
+
+			/* it builds an index on every partition, too */
+			if (within_quota &&
+				get_rel_relkind(relid) == RELKIND_PARTITIONED_TABLE)
+				within_quota = CheckPartitionTreeQuota(relid);
+			CountQuotaCheck(!within_quota);
+			if (!within_quota)
+				ereport(ERROR,
+						(errcode(ERRCODE_DISK_FULL),
+						 errmsg("user's disk space quota exceeded")));
+		}
+	}
+
+	if (prev_ProcessUtility_hook)
+		prev_ProcessUtility_hook(pstmt, queryString, context, params,
+								 queryEnv, dest, completionTag);
+	else
+		standard_ProcessUtility(pstmt, queryString, context, params,
+								queryEnv, dest, completionTag);
+}
@@ -10,93 +10,371 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "access/hash.h"
+#include "access/htup_details.h"
 #include "access/transam.h"
+#include "access/xact.h"
 #include "catalog/pg_tablespace_d.h"
+#include "common/relpath.h"
 #include "fmgr.h"
 #include "funcapi.h"
 #include "lib/ilist.h"
 #include "miscadmin.h"
 #include "nodes/execnodes.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "port/pg_crc32c.h"
+#include "portability/instr_time.h"
 #include "storage/fd.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/procarray.h"
 #include "storage/relfilenode.h"
 #include "storage/shmem.h"
+#include "storage/sinvaladt.h"
+#include "storage/spin.h"
+#include "utils/dsa.h"
 #include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/memutils.h"
+#include "utils/relfilenodemap.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
 
 #include "pg_quota.h"
 
-#define MAX_DB_ROLE_ENTRIES 1024
+/*
+ * Number of partitions of the shared role_totals_map hash table, each with
+ * its own lock. Must be a power of 2.
+ */
+#define ROLE_TOTALS_PARTITIONS 16
+
+/* Max number of roles in the lock-free "exceeded" set, see below */
+#define MAX_EXCEEDED_ROLES 256
+
+/* Time constant of the roles' growth rate averages, in seconds */
+#define GROWTH_RATE_TIME_CONSTANT 30.0
+
+/* Max number of databases with a worker */
+#define MAX_QUOTA_DATABASES 1024
+
+/* Add quota check counts to shared memory at least every this many checks */
+#define CHECK_COUNT_FLUSH_INTERVAL 1024
 
 PG_FUNCTION_INFO_V1(get_quota_status);
+PG_FUNCTION_INFO_V1(get_quota_usage);
+PG_FUNCTION_INFO_V1(get_shmem_usage);
+PG_FUNCTION_INFO_V1(get_worker_stats);
+PG_FUNCTION_INFO_V1(get_relation_sizes);
+
+/* GUC variables */
+int			pg_quota_max_entries = 8192;
+int			pg_quota_growth_projection = 30;
+bool		pg_quota_publish_relation_sizes = true;
+bool		pg_quota_track_temp = false;
+bool		pg_quota_temp_counts_toward_quota = false;
+int			pg_quota_scan_cost_limit = 200;
+int			pg_quota_scan_cost_delay = 0;
+bool		pg_quota_skip_static_segments = true;
+
+/* Cost accumulated since the last nap, see scan_delay_point() */
+static int	scan_cost_balance = 0;
+
+/* Set, if the current full scan was cut short because we're shutting down */
+static bool scan_interrupted = false;
 
 typedef struct FileSizeEntry FileSizeEntry;
+typedef struct FileSizeEntryKey FileSizeEntryKey;
 typedef struct RelSizeEntry RelSizeEntry;
+typedef struct ScanDirEntry ScanDirEntry;
 typedef struct RoleSizeEntry RoleSizeEntry;
 typedef struct RoleSizeEntryKey RoleSizeEntryKey;
+typedef struct RoleUsageEntry RoleUsageEntry;
+typedef struct RoleUsageEntryKey RoleUsageEntryKey;
 
 /*
  * Shared memory structure.
  *
  * In shared memory, we keep a hash table of RoleSizeEntrys. It's keyed by
- * role and database OID, and protected by shared->lock. It holds the
- * current total disk space usage, and quota, for each role and database.
+ * role, database and tablespace OID. It holds the current total disk space
+ * usage, and quota, for each role and database, and for each tablespace the
+ * role uses in the database. The database-wide entry of a role has spcid ==
+ * InvalidOid, and covers all tablespaces.
+ *
+ * The hash table is partitioned, so that the workers and backends of
+ * different databases, or updating different roles, don't need to contend
+ * on a single lock. Each partition is protected by one of the
+ * shared->partition_locks, chosen by the hash code of the key, like in the
+ * lock manager. Scanning the whole table requires all the partition locks,
+ * acquired in order.
  */
 struct RoleSizeEntryKey
 {
-	/* hash key consists of role and database OID */
+	/* hash key consists of role, database and tablespace OID */
 	Oid			rolid;
 	Oid			dbid;
+	Oid			spcid;			/* InvalidOid for the database-wide total */
 };
 
 struct RoleSizeEntry
 {
 	RoleSizeEntryKey key;
 
-	off_t		totalsize;	/* current total space usage */
+	off_t		totalsize;	/* current total space usage, including members' */
+	int64		ownsize;	/* space used by the role's own relations */
+	int64		tempsize;	/* temporary files and relations, see UpdateTempUsage() */
 	int64		quota;		/* quota from config table, or -1 for no quota */
+
+	/*
+	 * Recent growth, in bytes per second, as an exponentially weighted moving
+	 * average over the worker's passes; see UpdateGrowthRate(). 'growing' is
+	 * set if the total grew in the latest pass.
+	 */
+	double		growth_rate;
+	TimestampTz rate_updated;	/* time of the latest pass, or 0 */
+	bool		growing;
+
+	bool		exceeded;	/* is this role in the "exceeded" set? */
+	TimestampTz exceed_at;	/* projected time of exceeding, or 0 if it has */
 };
 
 static HTAB *role_totals_map;
 
+/*
+ * A second shared hash table breaks down each role's usage by tablespace and
+ * fork, for the quota.usage view. Quotas are enforced from the totals above
+ * alone, so this is only updated by the workers at the end of each pass, and
+ * read by get_quota_usage(). It's protected by shared->usage_lock.
+ *
+ * Entries whose sizes all drop to zero are removed. If the table is full,
+ * the breakdown of some roles is incomplete, but their totals are still
+ * correct.
+ */
+struct RoleUsageEntryKey
+{
+	Oid			rolid;
+	Oid			dbid;
+	Oid			spcid;
+};
+
+struct RoleUsageEntry
+{
+	RoleUsageEntryKey key;
+
+	int64		forksize[MAX_FORKNUM + 1];	/* space used by each fork */
+};
+
+static HTAB *role_usage_map;
+
+/*
+ * Besides the hash table, we keep a small array of the roles that have
+ * exceeded their quota. CheckQuota() consults it without taking any locks,
+ * so that the common case of an INSERT into a table whose owner is within
+ * quota doesn't need to take any locks at all.
+ *
+ * The array is protected by a sequence counter. Writers increment
+ * exceeded_seq to an odd value before modifying the array, and back to an
+ * even value after. Readers read the counter before and after reading the
+ * array, and retry if it was odd or changed in between. Writers, who hold the
+ * partition lock of the role they're updating, serialize among themselves
+ * with exceeded_mutex. Alternatively, holding all the partition locks in
+ * exclusive mode is enough to modify the array.
+ *
+ * If more than MAX_EXCEEDED_ROLES roles are over their quota,
+ * exceeded_overflow is set, and readers fall back to looking up the role in
+ * role_totals_map.
+ *
+ * Roles that are growing fast enough to exceed their quota before the next
+ * pass are included too, with the projected time in exceed_at. Readers treat
+ * them as exceeded once that time has passed. See CheckRoleExceeded().
+ */
+typedef struct
+{
+	RoleSizeEntryKey key;
+	TimestampTz exceed_at;		/* 0, if the quota has been exceeded already */
+} ExceededRole;
+
 typedef struct
 {
-	LWLock	   *lock;		/* protects role_totals_map */
+	LWLock	   *lock;		/* protects db_state_map */
+	LWLockPadded *partition_locks;	/* protect role_totals_map partitions */
+	LWLock	   *usage_lock;		/* protects role_usage_map */
+	LWLock	   *relsizes_lock;	/* protects the relsizes_* fields of QuotaDbStates */
+	int			relsizes_tranche;	/* tranche ID for the relation sizes' areas */
+
+	slock_t		exceeded_mutex;
+	pg_atomic_uint64 exceeded_seq;
+	bool		exceeded_overflow;	/* some exceeded roles are not in the array */
+	int			num_exceeded;	/* number of valid entries in the array */
+	int			total_exceeded; /* number of entries with 'exceeded' set */
+	ExceededRole exceeded[MAX_EXCEEDED_ROLES];
+
+	/* number of times a role total could not be tracked, for lack of space */
+	pg_atomic_uint64 overflow_count;
 } pg_quota_shared_state;
 
 static pg_quota_shared_state *shared;
 
+#define RoleTotalsPartitionLock(hashcode) \
+	(&shared->partition_locks[(hashcode) % ROLE_TOTALS_PARTITIONS].lock)
+
+/*
+ * Statistics about the worker of a database, for quota.worker_stats. The
+ * worker accumulates them locally, in worker_stats, and copies them to shared
+ * memory at the end of every refresh. The times are in milliseconds.
+ */
+typedef struct
+{
+	TimestampTz last_refresh;	/* end of the last refresh, or 0 */
+	uint64		num_refreshes;
+	uint64		num_full_scans;
+	uint64		phase_count[QUOTA_NUM_PHASES];	/* times each phase was run */
+	double		phase_last[QUOTA_NUM_PHASES];	/* duration of the last run */
+	double		phase_total[QUOTA_NUM_PHASES];	/* sum over all runs */
+	uint64		files_stated;	/* files stat()ed, by us or a scanner */
+	uint64		files_added;	/* files added to the model */
+	uint64		files_removed;	/* files removed from the model */
+	int64		num_orphans;	/* relations whose owner is unknown */
+	int64		model_memory;	/* bytes allocated in FsModelContext */
+	double		lock_wait;		/* time spent waiting for shared locks */
+} QuotaWorkerStats;
+
+/*
+ * Per-database state in shared memory. The hash table is protected by
+ * shared->lock. Entries are created by the worker for the database on
+ * startup, and removed by the launcher once the database has been dropped,
+ * or turns out not to have the extension, see ForgetDbState(). A backend
+ * that has remembered the address of its database's entry checks that the
+ * dbid still matches, as removal clears it.
+ *
+ * worker_pid identifies the worker currently serving the database, so that
+ * there's never more than one. extension_missing is set by a worker that
+ * found that the extension is not installed in its database, to tell the
+ * launcher not to retry too soon.
+ *
+ * The statistics are overwritten by each new worker, but the check counters
+ * accumulate over the life of the server.
+ *
+ * The sizes of all the relations in the model are published in a DSA area
+ * created by the worker, for quota.relation_sizes, see
+ * PublishRelationSizes(). relsizes_area is DSM_HANDLE_INVALID if there is
+ * no worker, or it hasn't published anything yet. The relsizes_* fields are
+ * protected by shared->relsizes_lock, which readers must hold while they
+ * copy the array, because the worker frees the old array after replacing
+ * it. Readers also hold shared->lock, taken first, so that the entry stays
+ * put.
+ */
+typedef struct
+{
+	Oid			dbid;			/* hash key */
+
+	/* bumped by a trigger, whenever quota.config is modified */
+	pg_atomic_uint64 config_version;
+
+	int			worker_pid;		/* PID of the worker, or 0 if none */
+	Latch	   *worker_latch;	/* latch of the worker, to wake it up */
+	bool		extension_missing;
+
+	/* worker statistics, protected by stats_mutex */
+	slock_t		stats_mutex;
+	QuotaWorkerStats stats;
+
+	/* quota checks done by backends in this database, and how many failed */
+	pg_atomic_uint64 num_checks;
+	pg_atomic_uint64 num_rejections;
+
+	/* sizes of all relations, see PublishRelationSizes() */
+	dsa_handle	relsizes_area;
+	dsa_pointer relsizes;		/* array of RelationSizeRecords */
+	int64		num_relsizes;
+	TimestampTz relsizes_time;	/* time when the array was built */
+} QuotaDbState;
+
+/* A relation in the array published by PublishRelationSizes() */
+typedef struct
+{
+	Oid			spcid;			/* tablespace, as seen in the data directory */
+	Oid			relfilenode;
+	Oid			owner;
+	int64		forksize[MAX_FORKNUM + 1];
+} RelationSizeRecord;
+
+static HTAB *db_state_map;
+
+/* The entry for our own database */
+static QuotaDbState *MyDbState;
+
+/* The worker's statistics, not yet copied to MyDbState */
+static QuotaWorkerStats worker_stats;
+
 /*
  * Local memory structures, in the background worker process.
  *
  * There are two hash tables, to track every relation and the files belonging
  * to them.
  *
- * The first hash table, path_to_fsentry_map, contains one FileSizeEntry for
+ * The first hash table, file_to_fsentry_map, contains one FileSizeEntry for
  * every relation file in the data directory. It holds the current size of each
- * file.
+ * file. It's keyed by the tablespace, relfilenode, fork and segment number,
+ * which identify the file uniquely within the database.
  *
  * The second hash table contains one RelSizeEntry for each relation. It holds
  * the owner of each relation.
  *
  * Each background worker only tracks files belonging to the database the worker
  * is assigned to.
+ *
+ * A large database can have hundreds of thousands of files, and they come and
+ * go in waves, e.g. when a big partitioned table is dropped. So the tables
+ * are simplehash tables rather than dynahash: the FileSizeEntrys are stored
+ * inline in one open-addressing array, which is fast to iterate through in
+ * the removed-files sweep, and can be rebuilt smaller after a wave of removals
+ * (see CompactFsModel()). dynahash would keep the memory of removed entries
+ * on its freelist forever. The RelSizeEntrys are pointed to by their files,
+ * so they can't move around; they are allocated from a slab context, which
+ * returns the memory of empty blocks as relations are removed.
  */
+struct FileSizeEntryKey
+{
+	Oid			spcNode;		/* tablespace */
+	Oid			relNode;		/* relfilenode */
+	ForkNumber	forknum;
+	uint32		segno;			/* segment number, 0 for the first segment */
+};
+
 struct FileSizeEntry
 {
-	char		path[MAXPGPATH]; /* XXX: this is overly large for a hash key */
+	FileSizeEntryKey key;
 
 	off_t		filesize;		/* current size of the file. */
 
 	RelSizeEntry *parent;		/* relation this file belongs to. */
 
 	int			generation;		/* generation stamp, to detect removed files */
+
+	char		status;			/* hash table entry status, for simplehash */
 };
 
-static HTAB *path_to_fsentry_map;
+#define SH_PREFIX fsentry
+#define SH_ELEMENT_TYPE FileSizeEntry
+#define SH_KEY_TYPE FileSizeEntryKey
+#define SH_KEY key
+#define SH_HASH_KEY(tb, key) \
+	DatumGetUInt32(hash_any((const unsigned char *) &(key), sizeof(FileSizeEntryKey)))
+#define SH_EQUAL(tb, a, b) (memcmp(&(a), &(b), sizeof(FileSizeEntryKey)) == 0)
+#define SH_SCOPE static inline
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+static fsentry_hash *file_to_fsentry_map;
 
 struct RelSizeEntry
 {
@@ -106,14 +384,302 @@ struct RelSizeEntry
 
 	int			numfiles;		/* ref count of FileSizeEntrys for this rel */
 	off_t		totalsize;
+	off_t		forksize[MAX_FORKNUM + 1];	/* totalsize, by fork */
+
+	/* highest segment number of each fork, that we have seen */
+	uint32		maxseg[MAX_FORKNUM + 1];
+
+	/* number of files seen during scan 'seen_generation' */
+	int			seen_generation;
+	int			numseen;
+
+	ScanDirEntry *dir;			/* directory containing the relation */
+	dlist_node	dir_node;		/* link in dir->rels */
 
 	dlist_node	orphan_node;	/* link in orphanRels, if owner == InvalidOid */
+	bool		stale_orphan;	/* orphan not found in pg_class already? */
+
+	bool		recheck;		/* is this in recheckRels? */
+	dlist_node	recheck_node;	/* link in recheckRels */
+
+	bool		hot;			/* is this in hotRels? */
+	int			hot_idle;		/* hot refreshes since it last grew */
+	dlist_node	hot_node;		/* link in hotRels */
 };
 
-static HTAB *relfilenode_to_relentry_map;
+/* Entry in relfilenode_to_relentry_map, pointing to the slab-allocated entry */
+typedef struct
+{
+	RelFileNode key;
+	char		status;			/* hash table entry status, for simplehash */
+	RelSizeEntry *entry;
+} RelMapEntry;
+
+#define SH_PREFIX relentry
+#define SH_ELEMENT_TYPE RelMapEntry
+#define SH_KEY_TYPE RelFileNode
+#define SH_KEY key
+#define SH_HASH_KEY(tb, key) \
+	DatumGetUInt32(hash_any((const unsigned char *) &(key), sizeof(RelFileNode)))
+#define SH_EQUAL(tb, a, b) RelFileNodeEquals(a, b)
+#define SH_SCOPE static inline
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+static relentry_hash *relfilenode_to_relentry_map;
+
+/* Slab context holding the RelSizeEntrys */
+static MemoryContext RelEntryContext;
+
+/*
+ * Don't bother shrinking the tables until they have at least this many
+ * buckets, and are filled less than 1 / FS_MODEL_COMPACT_RATIO.
+ */
+#define FS_MODEL_COMPACT_MIN_SIZE 1024
+#define FS_MODEL_COMPACT_RATIO 8
 
-/* List of RelSizeEntrys without owner. */
+/*
+ * List of RelSizeEntrys without owner.
+ *
+ * Some files never get an owner, e.g. the files of dropped relations that
+ * stay around until the next checkpoint. Looking those up on every pass is a
+ * waste, so an orphan that UpdateOrphans() didn't find in pg_class is marked
+ * stale, and counted in num_stale_orphans. The stale ones are only looked up
+ * again every STALE_ORPHAN_RETRY_PASSES passes, or when we've lost track of
+ * the invalidations. In the meantime, a relation that gets committed is
+ * noticed through its relcache invalidation.
+ */
 static dlist_head orphanRels;
+static int	num_orphans;
+static int	num_stale_orphans;
+static int	orphan_passes;		/* UpdateOrphans() passes since the last retry */
+
+#define STALE_ORPHAN_RETRY_PASSES 30
+
+/*
+ * List of RelSizeEntrys whose owner was loaded from a snapshot, and hasn't
+ * been verified against pg_class yet. See load_fs_model_snapshot().
+ */
+static dlist_head recheckRels;
+static int	num_recheck;
+
+/* Max number of relations in recheckRels to verify on each UpdateOrphans() */
+#define RECHECK_BATCH_SIZE 1000
+
+/*
+ * List of "hot" RelSizeEntrys: relations that have grown recently, and whose
+ * owner has a quota. refresh_fs_model_hot() checks just these between the
+ * full scans. A relation drops off the list after HOT_RELATION_COOLDOWN hot
+ * refreshes without growth, unless its owner is near its quota.
+ */
+static dlist_head hotRels;
+static int	num_hot;
+
+#define MAX_HOT_RELATIONS 1024
+#define HOT_RELATION_COOLDOWN 16
+
+/*
+ * The roles that have a quota in this database, and whether they are near
+ * it, i.e. use at least NEAR_QUOTA_PERCENT of any of their quotas. Rebuilt
+ * from role_totals_map by RebuildRoleTiers(), whenever the totals or the
+ * quotas have changed.
+ */
+typedef struct
+{
+	Oid			owner;			/* hash key */
+	bool		near_quota;
+} RoleTierEntry;
+
+#define NEAR_QUOTA_PERCENT 90
+
+static HTAB *role_tiers_map;
+static bool role_tiers_stale;
+static int	num_near_quota;
+
+/*
+ * Has the model been populated by a full scan or a snapshot yet? Until it is,
+ * every file looks like it has grown, so nothing is considered hot.
+ */
+static bool model_populated;
+
+/* Bumped on every change to the model, to tell if a full scan found any */
+static uint64 model_changes;
+
+/*
+ * If there are more than this many relations in orphanRels and recheckRels,
+ * UpdateOrphans() reads all of pg_class with one sequential scan, instead of
+ * looking them up one at a time.
+ */
+#define BULK_OWNER_THRESHOLD 1000
+
+/*
+ * OIDs of relations whose pg_class entry has changed since the last
+ * UpdateOrphans(), as reported by relcache invalidations. Their owner is
+ * re-resolved, to notice ALTER TABLE ... OWNER TO. If there are too many, or
+ * we receive a reset, all_relids_changed is set instead, and all owners are
+ * re-resolved with a scan of pg_class.
+ */
+static HTAB *changed_relids_map;
+static bool all_relids_changed = false;
+
+#define MAX_CHANGED_RELIDS 10000
+
+/*
+ * The model is saved to a snapshot file at shutdown, and periodically, so
+ * that after a restart, the worker can start enforcing quotas right away,
+ * without waiting for the first full scan of the data directory.
+ *
+ * The file consists of a SnapshotHeader, followed by a SnapshotFileRecord
+ * for each file in the model, and a CRC over both.
+ */
+#define PG_QUOTA_SNAPSHOT_MAGIC		0x50475153
+#define PG_QUOTA_SNAPSHOT_VERSION	1
+
+typedef struct
+{
+	uint32		magic;
+	uint32		version;
+	Oid			dbid;
+	uint32		nfiles;
+} SnapshotHeader;
+
+typedef struct
+{
+	FileSizeEntryKey key;
+	Oid			owner;
+	off_t		filesize;
+} SnapshotFileRecord;
+
+/*
+ * Changes to the per-role totals, that have not been published to the shared
+ * memory hash table yet.
+ *
+ * To avoid hammering the shared locks as we scan through the files, changes to
+ * the role totals are first accumulated here, and published to
+ * role_totals_map in one go, at the end of each refresh_fs_model() and
+ * UpdateOrphans() pass.
+ */
+typedef struct
+{
+	RoleSizeEntryKey key;		/* hash key */
+	int64		delta;			/* change in total space usage */
+	int64		owndelta;		/* part of 'delta' in the role's own relations */
+	int64		tempdelta;		/* change in temporary space usage */
+	uint32		hashcode;		/* hash code of the role's key in role_totals_map */
+	bool		published;
+	bool		keep;			/* keep for the next pass, even if zero */
+} RoleDeltaEntry;
+
+static HTAB *role_deltas_map;
+
+/*
+ * The roles that each role is a member of, directly or indirectly, i.e. the
+ * groups that its space usage is rolled up to. Used by the worker to
+ * propagate each owner's changes to its groups' totals, and by backends in
+ * CheckQuota(), to check the groups' quotas too. See GetRoleAncestors().
+ *
+ * The whole cache is discarded on any change to pg_auth_members. In the
+ * worker, that also sets role_rollups_stale, so that the groups' totals are
+ * recomputed from their members' by the next UpdateRoleRollups() call.
+ */
+typedef struct
+{
+	Oid			roleid;			/* hash key */
+	int			nancestors;
+	Oid		   *ancestors;
+} RoleAncestorsEntry;
+
+/* A role's totals, while UpdateRoleRollups() recomputes the groups' totals */
+typedef struct
+{
+	RoleSizeEntryKey key;		/* hash key */
+	int64		ownsize;
+	int64		totalsize;
+	int64		target;			/* new total, including members' */
+} RoleRollupEntry;
+
+/*
+ * Temporary space usage, see UpdateTempUsage().
+ *
+ * temp_rel_files_map holds the files of temporary relations in our database
+ * that the scans have come across. temp_totals_map holds the temporary
+ * space usage of each role, by tablespace, as last published to
+ * role_totals_map; group roles include their members' usage.
+ */
+typedef struct
+{
+	char		path[MAXPGPATH];	/* hash key */
+	Oid			spcid;
+	int			backend;		/* backend ID from the file name */
+} TempRelFileEntry;
+
+typedef struct
+{
+	RoleSizeEntryKey key;		/* hash key */
+	int64		size;			/* as published */
+	int64		newsize;		/* as seen by this UpdateTempUsage() pass */
+} TempTotalEntry;
+
+static HTAB *temp_rel_files_map;
+static HTAB *temp_totals_map;
+
+static MemoryContext RoleAncestorsContext = NULL;
+static HTAB *role_ancestors_map = NULL;
+static bool authmem_callback_registered = false;
+static bool role_rollups_stale = false;
+
+/*
+ * Likewise, changes to role_usage_map, by role, tablespace and fork.
+ */
+typedef struct
+{
+	RoleUsageEntryKey key;		/* hash key */
+	int64		delta[MAX_FORKNUM + 1];
+	bool		published;
+} RoleUsageDeltaEntry;
+
+static HTAB *usage_deltas_map;
+
+/*
+ * State of each directory scanned by refresh_fs_model(), keyed by tablespace.
+ * (Each tablespace has exactly one directory for our database.)
+ *
+ * A directory's mtime changes whenever a file is created, removed or renamed
+ * in it, but not when a file is written to. If the mtime hasn't changed since
+ * the last scan, the set of files in it is the same as in the model, and we
+ * don't need to read the directory at all. Furthermore, a full segment that
+ * is followed by another segment of the same fork cannot change size, except
+ * by truncation, which also shrinks the last segment. So in an unchanged
+ * directory, we only need to stat() the last and partial segments of each
+ * fork, see RefreshUnchangedDirs().
+ *
+ * To avoid missing changes that happen within the timestamp granularity of
+ * the last listing, the mtime is only trusted if it's older than the time we
+ * last listed the directory, like git's "racy" index entries.
+ *
+ * Each directory also has a list of the relations in it, and counts of the
+ * files in the model and the files seen during the current scan. After the
+ * scan, only the directories where fewer files were seen than there are in
+ * the model need to be searched for removed files, see RemoveUnseenFiles().
+ */
+struct ScanDirEntry
+{
+	Oid			spcNode;		/* hash key */
+	time_t		mtime;			/* mtime of the directory, when last listed */
+	time_t		listed_at;		/* when we last listed the directory */
+	int			fd;				/* open during RefreshUnchangedDirs(), or -1 */
+	char		path[MAXPGPATH];
+
+	dlist_head	rels;			/* RelSizeEntrys in this directory */
+	int			numfiles;		/* number of FileSizeEntrys in this directory */
+
+	/* number of files seen during scan 'seen_generation' */
+	int			seen_generation;
+	int			numseen;
+};
+
+static HTAB *scan_dirs_map;
 
 /* Memory context to hold the in-memory model. */
 static MemoryContext FsModelContext;
@@ -128,23 +694,51 @@ static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 
 static Size pg_quota_memsize(void);
 static void pg_quota_shmem_startup(void);
-
-static bool isRelDataFile(const char *path, RelFileNode *rnode);
+static void LockRoleTotals(LWLockMode mode);
+static void UnlockRoleTotals(void);
+static RoleSizeEntry *EnterRoleSizeEntry(RoleSizeEntryKey *key, uint32 hashcode);
+static void EvictUnusedRoleEntries(void);
+static void SetRoleExceeded(RoleSizeEntry *rolentry, bool exceeded,
+				TimestampTz exceed_at);
+static void UpdateGrowthRate(RoleSizeEntry *rolentry, int64 delta,
+				 TimestampTz now);
+static void RebuildExceededSet(void);
+static void CheckRoleExceeded(RoleSizeEntry *rolentry);
+
+static bool isTrackedRelFile(const char *path, RelFileNode *rnode,
+				 ForkNumber *forknum, uint32 *segno);
+static bool isRelDataFile(const char *path, RelFileNode *rnode,
+			  ForkNumber *forknum, uint32 *segno);
+static void AddRoleDelta(Oid owner, Oid spcid, ForkNumber forknum,
+			 int64 delta);
+static void PublishRoleDeltas(bool sample);
 static void RemoveFileSize(FileSizeEntry *fsentry);
-static void UpdateFileSize(RelFileNode *rnode, char *filename, off_t newsize);
+static void NoteTempRelFile(const char *path);
+static ScanDirEntry *GetScanDir(Oid spcNode);
+static void MarkFileSeen(FileSizeEntry *fsentry);
+static void MarkRelHot(RelSizeEntry *relentry);
+static void RefreshFilePath(const char *path);
+static void UnmarkRelHot(RelSizeEntry *relentry);
+static RoleTierEntry *GetRoleTier(Oid owner);
+static void RebuildRoleTiers(void);
+static void UpdateFileSize(RelFileNode *rnode, ForkNumber forknum,
+			   uint32 segno, off_t newsize);
 
 /*
  * Does it look like a relation data file?
  *
- * Returns the relfilenode in *rnode, if so.
+ * Returns the relfilenode in *rnode, and the fork and segment number in
+ * *forknum and *segno, if so.
  *
  * Adapted from pg_rewind's similar function.
  */
 static bool
-isRelDataFile(const char *path, RelFileNode *rnode)
+isRelDataFile(const char *path, RelFileNode *rnode,
+			  ForkNumber *forknum, uint32 *segno)
 {
 	int			nmatch;
-	bool		matched;
+	int			len = 0;
+	const char *p;
 
 	/*----
 	 * Relation data files can be in one of the following directories:
@@ -161,60 +755,204 @@ isRelDataFile(const char *path, RelFileNode *rnode)
 	 *
 	 * And the relation data files themselves have a filename like:
 	 *
-	 * <oid>.<segment number>
-	 *
-	 * We don't care about the segment number here.
+	 * <oid>[_<fork name>][.<segment number>]
 	 *
 	 *----
 	 */
 	rnode->spcNode = InvalidOid;
 	rnode->dbNode = InvalidOid;
 	rnode->relNode = InvalidOid;
-	matched = false;
 
-	nmatch = sscanf(path, "global/%u", &rnode->relNode);
+	nmatch = sscanf(path, "global/%u%n", &rnode->relNode, &len);
 	if (nmatch == 1)
 	{
 		rnode->spcNode = GLOBALTABLESPACE_OID;
 		rnode->dbNode = InvalidOid;
-		matched = true;
 	}
 	else
 	{
-		nmatch = sscanf(path, "base/%u/%u",
-						&rnode->dbNode, &rnode->relNode);
+		nmatch = sscanf(path, "base/%u/%u%n",
+						&rnode->dbNode, &rnode->relNode, &len);
 		if (nmatch == 2)
-		{
 			rnode->spcNode = DEFAULTTABLESPACE_OID;
-			matched = true;
-		}
 		else
 		{
-			nmatch = sscanf(path, "pg_tblspc/%u/" TABLESPACE_VERSION_DIRECTORY "/%u/%u",
-							&rnode->spcNode, &rnode->dbNode, &rnode->relNode);
-			if (nmatch == 3)
-				matched = true;
+			nmatch = sscanf(path, "pg_tblspc/%u/" TABLESPACE_VERSION_DIRECTORY "/%u/%u%n",
+							&rnode->spcNode, &rnode->dbNode, &rnode->relNode,
+							&len);
+			if (nmatch != 3)
+				return false;
 		}
 	}
 
+	/* Parse the fork name and segment number, after the relfilenode */
+	p = path + len;
+
+	*forknum = MAIN_FORKNUM;
+	if (*p == '_')
+	{
+		int			forkchars;
+
+		forkchars = forkname_chars(p + 1, forknum);
+		if (forkchars <= 0)
+			return false;
+		p += forkchars + 1;
+	}
+
+	*segno = 0;
+	if (*p == '.')
+	{
+		if (sscanf(p + 1, "%u%n", segno, &len) != 1)
+			return false;
+		p += len + 1;
+	}
+
+	/* Anything else after that means it's not a relation file after all. */
+	if (*p != '\0')
+		return false;
+
+	return true;
+}
+
+/*
+ * Relcache invalidation callback, to notice changes to relations' owners.
+ *
+ * We cannot access the catalogs here, so just remember the relation, for
+ * UpdateOrphans() to look at.
+ */
+static bool relcache_callback_registered = false;
+
+static void
+owner_relcache_callback(Datum arg, Oid relid)
+{
+	if (all_relids_changed)
+		return;
+
+	if (!OidIsValid(relid) ||
+		hash_get_num_entries(changed_relids_map) >= MAX_CHANGED_RELIDS)
+	{
+		all_relids_changed = true;
+		return;
+	}
+
+	(void) hash_search(changed_relids_map, (void *) &relid, HASH_ENTER, NULL);
+}
+
+/*
+ * Find or create the shared state entry for a database.
+ *
+ * Caller must hold shared->lock in exclusive mode. Returns NULL if the table
+ * is full.
+ */
+static QuotaDbState *
+EnterDbState(Oid dbid)
+{
+	QuotaDbState *dbstate;
+	bool		found;
+
+	dbstate = (QuotaDbState *) hash_search(db_state_map, (void *) &dbid,
+										   HASH_ENTER_NULL, &found);
+	if (dbstate && !found)
+	{
+		pg_atomic_init_u64(&dbstate->config_version, 0);
+		dbstate->worker_pid = 0;
+		dbstate->worker_latch = NULL;
+		dbstate->extension_missing = false;
+		SpinLockInit(&dbstate->stats_mutex);
+		memset(&dbstate->stats, 0, sizeof(QuotaWorkerStats));
+		pg_atomic_init_u64(&dbstate->num_checks, 0);
+		pg_atomic_init_u64(&dbstate->num_rejections, 0);
+		dbstate->relsizes_area = DSM_HANDLE_INVALID;
+		dbstate->relsizes = InvalidDsaPointer;
+		dbstate->num_relsizes = 0;
+		dbstate->relsizes_time = 0;
+	}
+	return dbstate;
+}
+
+/*
+ * Unregister as the worker of our database, at process exit.
+ */
+static void
+release_db_state(int code, Datum arg)
+{
 	/*
-	 * Note: The sscanf tests above can match files that have extra
-	 * characters at the end. Non-main forks, and non-0 segments in
-	 * particular. We'll count them all as part of the relation.
+	 * Unpublish the relation sizes, before the area goes away with our
+	 * process.
 	 */
+	LWLockAcquire(shared->relsizes_lock, LW_EXCLUSIVE);
+	if (MyDbState->worker_pid == MyProcPid)
+	{
+		MyDbState->relsizes_area = DSM_HANDLE_INVALID;
+		MyDbState->relsizes = InvalidDsaPointer;
+		MyDbState->num_relsizes = 0;
+	}
+	LWLockRelease(shared->relsizes_lock);
 
-	return matched;
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	if (MyDbState->worker_pid == MyProcPid)
+	{
+		MyDbState->worker_pid = 0;
+		MyDbState->worker_latch = NULL;
+	}
+	LWLockRelease(shared->lock);
 }
 
 /*
  * Per-worker initialization. Create local hashes.
+ *
+ * Returns false, if there's already another worker for this database. The
+ * caller should exit, in that case.
  */
-void
+bool
 init_fs_model(void)
 {
+	static bool release_registered = false;
 	HASHCTL		hash_ctl;
 	HASH_SEQ_STATUS iter;
 	RoleSizeEntry *rolentry;
+	RoleUsageEntry *usage;
+	int			other_pid = 0;
+
+	/*
+	 * Register as the worker of this database. The launcher never starts two
+	 * workers for the same database, and a restarted launcher finds the
+	 * workers its predecessor started through worker_pid, but check anyway,
+	 * in case one of them registers only after the launcher has looked.
+	 */
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	MyDbState = EnterDbState(MyDatabaseId);
+	if (!MyDbState)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("too many databases with pg_quota workers")));
+	if (MyDbState->worker_pid != 0 && MyDbState->worker_pid != MyProcPid &&
+		BackendPidGetProc(MyDbState->worker_pid) != NULL)
+		other_pid = MyDbState->worker_pid;
+	else
+	{
+		MyDbState->worker_pid = MyProcPid;
+		MyDbState->worker_latch = MyLatch;
+		MyDbState->extension_missing = false;
+
+		SpinLockAcquire(&MyDbState->stats_mutex);
+		memset(&MyDbState->stats, 0, sizeof(QuotaWorkerStats));
+		SpinLockRelease(&MyDbState->stats_mutex);
+	}
+	LWLockRelease(shared->lock);
+	memset(&worker_stats, 0, sizeof(QuotaWorkerStats));
+
+	if (other_pid != 0)
+	{
+		elog(LOG, "pg_quota worker for database %u is already running with PID %d",
+			 MyDatabaseId, other_pid);
+		return false;
+	}
+	if (!release_registered)
+	{
+		before_shmem_exit(release_db_state, (Datum) 0);
+		release_registered = true;
+	}
 
 	if (FsModelContext)
 		MemoryContextDelete(FsModelContext);
@@ -223,34 +961,107 @@ init_fs_model(void)
 										   "Disk quotas FS model context",
 										   ALLOCSET_DEFAULT_SIZES);
 
+	file_to_fsentry_map = fsentry_create(FsModelContext, 1024, NULL);
+	relfilenode_to_relentry_map = relentry_create(FsModelContext, 1024, NULL);
+	RelEntryContext = SlabContextCreate(FsModelContext,
+										"Disk quotas relation entries",
+										SLAB_DEFAULT_BLOCK_SIZE,
+										sizeof(RelSizeEntry));
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(RoleSizeEntryKey);
+	hash_ctl.entrysize = sizeof(RoleDeltaEntry);
+	hash_ctl.hcxt = FsModelContext;
+
+	role_deltas_map = hash_create("role to RoleDeltaEntry map",
+								  64,
+								  &hash_ctl,
+								  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(RoleUsageEntryKey);
+	hash_ctl.entrysize = sizeof(RoleUsageDeltaEntry);
+	hash_ctl.hcxt = FsModelContext;
+
+	usage_deltas_map = hash_create("role usage delta map",
+								   64,
+								   &hash_ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(ScanDirEntry);
+	hash_ctl.hcxt = FsModelContext;
+
+	scan_dirs_map = hash_create("scanned directories map",
+								16,
+								&hash_ctl,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(Oid);
+	hash_ctl.hcxt = FsModelContext;
+
+	changed_relids_map = hash_create("changed relids map",
+									 64,
+									 &hash_ctl,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	all_relids_changed = false;
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(RoleTierEntry);
+	hash_ctl.hcxt = FsModelContext;
+
+	role_tiers_map = hash_create("role tiers map",
+								 64,
+								 &hash_ctl,
+								 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	role_tiers_stale = true;
+	num_near_quota = 0;
+
 	memset(&hash_ctl, 0, sizeof(hash_ctl));
 	hash_ctl.keysize = MAXPGPATH;
-	hash_ctl.entrysize = sizeof(FileSizeEntry);
+	hash_ctl.entrysize = sizeof(TempRelFileEntry);
 	hash_ctl.hcxt = FsModelContext;
 
-	path_to_fsentry_map = hash_create("path to FileSizeEntry map",
-									  1024,
-									  &hash_ctl,
-									  HASH_ELEM | HASH_CONTEXT);
+	temp_rel_files_map = hash_create("temp relation files map",
+									 64,
+									 &hash_ctl,
+									 HASH_ELEM | HASH_CONTEXT);
 
 	memset(&hash_ctl, 0, sizeof(hash_ctl));
-	hash_ctl.keysize = sizeof(RelFileNode);
-	hash_ctl.entrysize = sizeof(RelSizeEntry);
+	hash_ctl.keysize = sizeof(RoleSizeEntryKey);
+	hash_ctl.entrysize = sizeof(TempTotalEntry);
 	hash_ctl.hcxt = FsModelContext;
 
-	relfilenode_to_relentry_map =
-	  hash_create("relfilenode to RelSizeEntry map",
-				  1024,
-				  &hash_ctl,
-				  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	temp_totals_map = hash_create("temp totals map",
+								  64,
+								  &hash_ctl,
+								  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	if (!relcache_callback_registered)
+	{
+		CacheRegisterRelcacheCallback(owner_relcache_callback, (Datum) 0);
+		relcache_callback_registered = true;
+	}
 
 	memset(&orphanRels, 0, sizeof(orphanRels));
+	num_orphans = 0;
+	num_stale_orphans = 0;
+	orphan_passes = 0;
+	memset(&recheckRels, 0, sizeof(recheckRels));
+	num_recheck = 0;
+	memset(&hotRels, 0, sizeof(hotRels));
+	num_hot = 0;
+	model_populated = false;
 
 	/*
 	 * Remove any old entries for this database from the shared memory hash
 	 * table, in case an old worker died and left them behind.
 	 */
-	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	LockRoleTotals(LW_EXCLUSIVE);
 
 	hash_seq_init(&iter, role_totals_map);
 
@@ -259,12 +1070,188 @@ init_fs_model(void)
 		/* only reset entries for current db */
 		if (rolentry->key.dbid == MyDatabaseId)
 		{
+			SetRoleExceeded(rolentry, false, 0);
 			(void) hash_search(role_totals_map,
 							   (void *) rolentry,
 							   HASH_REMOVE, NULL);
 		}
 	}
+
+	UnlockRoleTotals();
+	RebuildExceededSet();
+
+	/* Likewise for the usage breakdown. */
+	LWLockAcquire(shared->usage_lock, LW_EXCLUSIVE);
+	hash_seq_init(&iter, role_usage_map);
+	while ((usage = hash_seq_search(&iter)) != NULL)
+	{
+		if (usage->key.dbid == MyDatabaseId)
+			(void) hash_search(role_usage_map, (void *) &usage->key,
+							   HASH_REMOVE, NULL);
+	}
+	LWLockRelease(shared->usage_lock);
+
+	return true;
+}
+
+/*
+ * Remember that the extension is not installed in our database. Called by a
+ * worker, before exiting.
+ */
+void
+ReportMissingExtension(void)
+{
+	QuotaDbState *dbstate;
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	dbstate = EnterDbState(MyDatabaseId);
+	if (dbstate)
+		dbstate->extension_missing = true;
+	LWLockRelease(shared->lock);
+}
+
+/*
+ * Did the last worker for the given database find that the extension is not
+ * installed in it? Used by the launcher.
+ */
+bool
+IsExtensionMissing(Oid dbid)
+{
+	QuotaDbState *dbstate;
+	bool		result = false;
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+	dbstate = (QuotaDbState *) hash_search(db_state_map, (void *) &dbid,
+										   HASH_FIND, NULL);
+	if (dbstate)
+		result = dbstate->extension_missing;
+	LWLockRelease(shared->lock);
+
+	return result;
+}
+
+/*
+ * Is a worker running for the given database? Used by the launcher, to find
+ * the workers started by a previous launcher.
+ */
+bool
+IsWorkerRunning(Oid dbid)
+{
+	QuotaDbState *dbstate;
+	bool		result = false;
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+	dbstate = (QuotaDbState *) hash_search(db_state_map, (void *) &dbid,
+										   HASH_FIND, NULL);
+	if (dbstate && dbstate->worker_pid != 0 &&
+		BackendPidGetProc(dbstate->worker_pid) != NULL)
+		result = true;
+	LWLockRelease(shared->lock);
+
+	return result;
+}
+
+/*
+ * Remove the shared state of the given databases, and their roles' totals
+ * and usage. Skips databases that have a worker.
+ */
+static void
+RemoveDbStates(List *dbids)
+{
+	List	   *removed = NIL;
+	ListCell   *lc;
+	HASH_SEQ_STATUS iter;
+	RoleSizeEntry *rolentry;
+	RoleUsageEntry *usage;
+
+	if (dbids == NIL)
+		return;
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	foreach(lc, dbids)
+	{
+		Oid			dbid = lfirst_oid(lc);
+		QuotaDbState *dbstate;
+
+		dbstate = (QuotaDbState *) hash_search(db_state_map, (void *) &dbid,
+											   HASH_FIND, NULL);
+		if (dbstate == NULL || dbstate->worker_pid != 0)
+			continue;
+		dbstate = (QuotaDbState *) hash_search(db_state_map, (void *) &dbid,
+											   HASH_REMOVE, NULL);
+		/* for backends that remember the entry, see LookupMyDbState() */
+		dbstate->dbid = InvalidOid;
+		removed = lappend_oid(removed, dbid);
+	}
+	LWLockRelease(shared->lock);
+
+	if (removed == NIL)
+		return;
+
+	LockRoleTotals(LW_EXCLUSIVE);
+	hash_seq_init(&iter, role_totals_map);
+	while ((rolentry = hash_seq_search(&iter)) != NULL)
+	{
+		if (list_member_oid(removed, rolentry->key.dbid))
+		{
+			SetRoleExceeded(rolentry, false, 0);
+			(void) hash_search(role_totals_map,
+							   (void *) rolentry,
+							   HASH_REMOVE, NULL);
+		}
+	}
+	UnlockRoleTotals();
+	RebuildExceededSet();
+
+	LWLockAcquire(shared->usage_lock, LW_EXCLUSIVE);
+	hash_seq_init(&iter, role_usage_map);
+	while ((usage = hash_seq_search(&iter)) != NULL)
+	{
+		if (list_member_oid(removed, usage->key.dbid))
+			(void) hash_search(role_usage_map, (void *) &usage->key,
+							   HASH_REMOVE, NULL);
+	}
+	LWLockRelease(shared->usage_lock);
+
+	list_free(removed);
+}
+
+/*
+ * Forget everything about a database that has no worker: its shared state,
+ * and its roles' totals and usage. Used by the launcher, once a worker has
+ * found that the extension isn't installed, so that databases that don't use
+ * quotas don't fill up the table, and the totals of a database that has
+ * dropped the extension aren't enforced anymore.
+ */
+void
+ForgetDbState(Oid dbid)
+{
+	RemoveDbStates(list_make1_oid(dbid));
+}
+
+/*
+ * Like ForgetDbState(), for all the databases without a worker and for which
+ * keep() returns false. Used by the launcher, to forget the databases that
+ * have been dropped, or are no longer listed in pg_quota.databases.
+ */
+void
+ForgetOtherDbStates(bool (*keep) (Oid dbid))
+{
+	List	   *dbids = NIL;
+	HASH_SEQ_STATUS iter;
+	QuotaDbState *dbstate;
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+	hash_seq_init(&iter, db_state_map);
+	while ((dbstate = (QuotaDbState *) hash_seq_search(&iter)) != NULL)
+	{
+		if (dbstate->worker_pid == 0 && !keep(dbstate->dbid))
+			dbids = lappend_oid(dbids, dbstate->dbid);
+	}
 	LWLockRelease(shared->lock);
+
+	RemoveDbStates(dbids);
+	list_free(dbids);
 }
 
 void
@@ -276,7 +1263,7 @@ init_fs_model_shmem(void)
 	 * resources in pgss_shmem_startup().
 	 */
 	RequestAddinShmemSpace(pg_quota_memsize());
-	RequestNamedLWLockTranche("pg_quota", 1);
+	RequestNamedLWLockTranche("pg_quota", 3 + ROLE_TOTALS_PARTITIONS);
 
 	/*
 	 * Install startup hook to initialize our shared memory.
@@ -292,8 +1279,12 @@ pg_quota_memsize(void)
 	Size		size;
 
 	size = MAXALIGN(sizeof(pg_quota_shared_state));
-	size = add_size(size, hash_estimate_size(MAX_DB_ROLE_ENTRIES,
+	size = add_size(size, hash_estimate_size(pg_quota_max_entries,
 											 sizeof(RoleSizeEntry)));
+	size = add_size(size, hash_estimate_size(pg_quota_max_entries,
+											 sizeof(RoleUsageEntry)));
+	size = add_size(size, hash_estimate_size(MAX_QUOTA_DATABASES,
+											 sizeof(QuotaDbState)));
 	return size;
 }
 
@@ -312,6 +1303,8 @@ pg_quota_shmem_startup(void)
 	/* reset in case this is a restart within the postmaster */
 	shared = NULL;
 	role_totals_map = NULL;
+	role_usage_map = NULL;
+	db_state_map = NULL;
 
 	/*
 	 * The RoleSizeEntry hash table is kept in shared memory, so that backends
@@ -324,442 +1317,3501 @@ pg_quota_shmem_startup(void)
 							 &found);
 	if (!found)
 	{
-		shared->lock = &(GetNamedLWLockTranche("pg_quota"))->lock;
+		LWLockPadded *locks = GetNamedLWLockTranche("pg_quota");
+
+		shared->lock = &locks[0].lock;
+		shared->partition_locks = &locks[1];
+		shared->usage_lock = &locks[1 + ROLE_TOTALS_PARTITIONS].lock;
+		shared->relsizes_lock = &locks[2 + ROLE_TOTALS_PARTITIONS].lock;
+		shared->relsizes_tranche = LWLockNewTrancheId();
+		SpinLockInit(&shared->exceeded_mutex);
+		pg_atomic_init_u64(&shared->exceeded_seq, 0);
+		shared->exceeded_overflow = false;
+		shared->num_exceeded = 0;
+		shared->total_exceeded = 0;
+		pg_atomic_init_u64(&shared->overflow_count, 0);
 	}
 
 	memset(&hash_ctl, 0, sizeof(hash_ctl));
 	hash_ctl.keysize = sizeof(RoleSizeEntryKey);
 	hash_ctl.entrysize = sizeof(RoleSizeEntry);
+	hash_ctl.num_partitions = ROLE_TOTALS_PARTITIONS;
 	role_totals_map = ShmemInitHash("role OID to RoleSizeEntry map",
-									MAX_DB_ROLE_ENTRIES,
-									MAX_DB_ROLE_ENTRIES,
+									pg_quota_max_entries,
+									pg_quota_max_entries,
 									&hash_ctl,
-									HASH_ELEM | HASH_BLOBS);
+									HASH_ELEM | HASH_BLOBS | HASH_PARTITION);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(RoleUsageEntryKey);
+	hash_ctl.entrysize = sizeof(RoleUsageEntry);
+	role_usage_map = ShmemInitHash("role usage map",
+								   pg_quota_max_entries,
+								   pg_quota_max_entries,
+								   &hash_ctl,
+								   HASH_ELEM | HASH_BLOBS);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(QuotaDbState);
+	db_state_map = ShmemInitHash("database OID to QuotaDbState map",
+								 MAX_QUOTA_DATABASES,
+								 MAX_QUOTA_DATABASES,
+								 &hash_ctl,
+								 HASH_ELEM | HASH_BLOBS);
 
 	LWLockRelease(AddinShmemInitLock);
 }
 
+/*
+ * LWLockAcquire(), keeping track of the time spent waiting for the lock, for
+ * the worker's statistics.
+ */
 static void
-RemoveFileSize(FileSizeEntry *fsentry)
+AcquireLockTimed(LWLock *lock, LWLockMode mode)
 {
-	RelSizeEntry *relentry = fsentry->parent;
-	int64		filesize = fsentry->filesize;
-	Oid			owner = relentry->owner;
-	bool		found;
+	instr_time	start;
+	instr_time	duration;
 
-	/* Remove the FileSizeEntry. */
-	(void) hash_search(path_to_fsentry_map,
-					   (void *) fsentry->path,
-					   HASH_REMOVE, &found);
-	Assert(found);
+	if (LWLockConditionalAcquire(lock, mode))
+		return;
 
-	/*
-	 * Update the parent relation. If this was the last file of this relation,
-	 * remove the entry for the relation altogether.
-	 */
-	relentry->totalsize -= filesize;
-	relentry->numfiles--;
-	if (relentry->numfiles == 0)
-	{
-		Assert(relentry->totalsize == 0);
-		if (relentry->owner == InvalidOid)
-			dlist_delete(&relentry->orphan_node);
-		(void) hash_search(relfilenode_to_relentry_map,
-						   (void *) relentry,
-						   HASH_REMOVE, &found);
-		Assert(found);
-	}
+	INSTR_TIME_SET_CURRENT(start);
+	LWLockAcquire(lock, mode);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	worker_stats.lock_wait += INSTR_TIME_GET_MILLISEC(duration);
+}
 
-	/*
-	 * If we know the owner of this file, update its totals too.
-	 */
-	if (OidIsValid(owner) && filesize != 0)
-	{
-		RoleSizeEntry *rolentry;
-		RoleSizeEntryKey key;
+/*
+ * Acquire or release all the role_totals_map partition locks, for scanning
+ * the whole table.
+ */
+static void
+LockRoleTotals(LWLockMode mode)
+{
+	int			i;
 
-		LWLockAcquire(shared->lock, LW_SHARED);
+	for (i = 0; i < ROLE_TOTALS_PARTITIONS; i++)
+		AcquireLockTimed(&shared->partition_locks[i].lock, mode);
+}
 
-		key.rolid = owner;
-		key.dbid = MyDatabaseId;
-		rolentry = (RoleSizeEntry *) hash_search(role_totals_map,
-												 (void *) &key,
-												 HASH_FIND, NULL);
-		if (rolentry)
-			rolentry->totalsize -= filesize;
-		else
+static void
+UnlockRoleTotals(void)
+{
+	int			i;
+
+	for (i = ROLE_TOTALS_PARTITIONS - 1; i >= 0; i--)
+		LWLockRelease(&shared->partition_locks[i].lock);
+}
+
+/* Set when role_totals_map is full, to request EvictUnusedRoleEntries() */
+static bool eviction_needed = false;
+
+/*
+ * Find or create the entry for a role in role_totals_map.
+ *
+ * The table can hold at most pg_quota.max_entries entries. If it's full,
+ * returns NULL, and bumps the overflow counter. It's up to the caller to
+ * call EvictUnusedRoleEntries() after releasing the partition lock, and to
+ * retry later.
+ *
+ * Caller must hold the partition lock for 'hashcode' in exclusive mode.
+ */
+static RoleSizeEntry *
+EnterRoleSizeEntry(RoleSizeEntryKey *key, uint32 hashcode)
+{
+	static bool overflow_reported = false;
+	RoleSizeEntry *rolentry;
+	bool		found;
+
+	rolentry = (RoleSizeEntry *) hash_search_with_hash_value(role_totals_map,
+															 (void *) key,
+															 hashcode,
+															 HASH_FIND, NULL);
+	if (rolentry)
+		return rolentry;
+
+	if (hash_get_num_entries(role_totals_map) < pg_quota_max_entries)
+		rolentry = (RoleSizeEntry *) hash_search_with_hash_value(role_totals_map,
+																 (void *) key,
+																 hashcode,
+																 HASH_ENTER_NULL,
+																 &found);
+	if (!rolentry)
+	{
+		pg_atomic_fetch_add_u64(&shared->overflow_count, 1);
+		eviction_needed = true;
+		if (!overflow_reported)
 		{
-			/* shouldn't happen */
-			elog(DEBUG1, "role total not found, corrupt map?");
+			ereport(WARNING,
+					(errmsg("pg_quota shared memory table is full, disk space usage of some roles is not tracked"),
+					 errhint("Consider increasing the configuration parameter \"pg_quota.max_entries\".")));
+			overflow_reported = true;
 		}
-
-		LWLockRelease(shared->lock);
+		return NULL;
 	}
+
+	rolentry->totalsize = 0;
+	rolentry->ownsize = 0;
+	rolentry->tempsize = 0;
+	rolentry->quota = -1;	/* -1 means no quota */
+	rolentry->growth_rate = 0;
+	rolentry->rate_updated = 0;
+	rolentry->growing = false;
+	rolentry->exceeded = false;
+	rolentry->exceed_at = 0;
+
+	return rolentry;
 }
 
 /*
- * Update the model with the size of one file.
+ * Make room in role_totals_map, by evicting entries of our database that don't
+ * hold any information, i.e. roles with no quota and no space usage.
  */
 static void
-UpdateFileSize(RelFileNode *rnode, char *path, off_t newsize)
+EvictUnusedRoleEntries(void)
 {
-	RelSizeEntry *relentry;
-	FileSizeEntry *fsentry;
-	bool		found;
-	off_t		oldsize;
+	HASH_SEQ_STATUS iter;
+	RoleSizeEntry *rolentry;
 
-	/* Find or create entry for this relation */
-	relentry = (RelSizeEntry *) hash_search(relfilenode_to_relentry_map,
-											(void *) rnode,
-											HASH_ENTER, &found);
-	if (!found)
-	{
-		relentry->owner = InvalidOid;
-		dlist_push_head(&orphanRels, &relentry->orphan_node);
+	eviction_needed = false;
 
-		relentry->numfiles = 0;
-		relentry->totalsize = 0;
-	}
+	LockRoleTotals(LW_EXCLUSIVE);
 
-	/* Find or create entry for this file */
-	fsentry = (FileSizeEntry *) hash_search(path_to_fsentry_map,
-											(void *) path,
-											HASH_ENTER, &found);
-	if (!found)
+	hash_seq_init(&iter, role_totals_map);
+	while ((rolentry = hash_seq_search(&iter)) != NULL)
 	{
-		fsentry->parent = relentry;
-		relentry->numfiles++;
-		fsentry->filesize = 0;
+		if (rolentry->key.dbid == MyDatabaseId &&
+			rolentry->totalsize == 0 && rolentry->tempsize == 0 &&
+			rolentry->quota < 0 && !rolentry->exceeded)
+			(void) hash_search(role_totals_map, (void *) &rolentry->key,
+							   HASH_REMOVE, NULL);
 	}
-	Assert(relentry->numfiles > 0);
-	Assert(fsentry->parent == relentry);
-
-	/* Update file size */
-	oldsize = fsentry->filesize;
-	fsentry->filesize = newsize;
 
-	/* also touch 'generation', to remember that we saw this file to exist */
-	fsentry->generation = generation;
+	UnlockRoleTotals();
+}
 
-	/*
-	 * If the file size changed, must also update the totals for the relation
-	 * and the owner.
-	 */
-	if (newsize != oldsize)
-	{
-		relentry->totalsize += (newsize - oldsize);
+/*
+ * Add or remove a role from the "exceeded" set, or update its projected
+ * time of exceeding the quota.
+ *
+ * Caller must hold the partition lock of the role in exclusive mode.
+ */
+static void
+SetRoleExceeded(RoleSizeEntry *rolentry, bool exceeded, TimestampTz exceed_at)
+{
+	int			i;
 
-		if (relentry->owner)
-		{
-			RoleSizeEntry *rolentry;
-			RoleSizeEntryKey key;
+	if (!exceeded)
+		exceed_at = 0;
+	if (rolentry->exceeded == exceeded && rolentry->exceed_at == exceed_at)
+		return;
 
-			LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	SpinLockAcquire(&shared->exceeded_mutex);
 
-			key.rolid = relentry->owner;
-			key.dbid = MyDatabaseId;
-			rolentry = (RoleSizeEntry *) hash_search(role_totals_map,
-													 (void *) &key,
-													 HASH_ENTER, &found);
-			if (!found)
-			{
-				rolentry->totalsize = 0;
-				rolentry->quota = -1;
-			}
+	/* Let readers know that we're about to modify the array */
+	pg_atomic_fetch_add_u64(&shared->exceeded_seq, 1);
 
-			rolentry->totalsize += (newsize - oldsize);
+	/* Find the role's current entry in the array, if any */
+	for (i = 0; i < shared->num_exceeded; i++)
+	{
+		if (shared->exceeded[i].key.rolid == rolentry->key.rolid &&
+			shared->exceeded[i].key.dbid == rolentry->key.dbid &&
+			shared->exceeded[i].key.spcid == rolentry->key.spcid)
+			break;
+	}
 
-			LWLockRelease(shared->lock);
+	if (exceeded)
+	{
+		if (!rolentry->exceeded)
+			shared->total_exceeded++;
+		if (i < shared->num_exceeded)
+			shared->exceeded[i].exceed_at = exceed_at;
+		else if (shared->num_exceeded < MAX_EXCEEDED_ROLES)
+		{
+			shared->exceeded[shared->num_exceeded].key = rolentry->key;
+			shared->exceeded[shared->num_exceeded].exceed_at = exceed_at;
+			shared->num_exceeded++;
 		}
+		else
+			shared->exceeded_overflow = true;
+	}
+	else
+	{
+		shared->total_exceeded--;
+		if (i < shared->num_exceeded)
+			shared->exceeded[i] = shared->exceeded[--shared->num_exceeded];
 	}
+	rolentry->exceeded = exceeded;
+	rolentry->exceed_at = exceed_at;
+
+	/* Done modifying. (The atomic op acts as a full memory barrier.) */
+	pg_atomic_fetch_add_u64(&shared->exceeded_seq, 1);
+
+	SpinLockRelease(&shared->exceeded_mutex);
 }
 
 /*
- * helper function for refresh_fs_model(), to scan one directory.
+ * If the "exceeded" array had overflowed, and everything fits in it again,
+ * rebuild it from the hash table.
+ *
+ * Caller must not hold any partition locks.
  */
 static void
-RebuildRelSizeMapDir(char *dirpath)
+RebuildExceededSet(void)
 {
-	DIR		   *dirdesc;
-	struct dirent *dirent;
-	char		path[MAXPGPATH];
-
-	dirdesc = AllocateDir(dirpath);
-
-	while((dirent = ReadDirExtended(dirdesc, dirpath, DEBUG1)) != NULL)
-	{
-		struct stat statbuf;
-		RelFileNode rnode;
-
-		if (strcmp(dirent->d_name, ".") == 0 ||
-			strcmp(dirent->d_name, "..") == 0)
-			continue;
+	HASH_SEQ_STATUS iter;
+	RoleSizeEntry *rolentry;
 
-		snprintf(path, MAXPGPATH, "%s/%s", dirpath, dirent->d_name);
+	/* Quick check without locks, to avoid the work in the common case */
+	if (!shared->exceeded_overflow ||
+		shared->total_exceeded > MAX_EXCEEDED_ROLES)
+		return;
 
-		/*
-		 * Only count relation files. (Or perhaps we should count other files
-		 * towards the database owner?)
-		 */
-		if (!isRelDataFile(path, &rnode))
-			continue;
+	/*
+	 * Holding all the partition locks in exclusive mode prevents anyone else
+	 * from modifying the array. That's slow, but this is rare.
+	 */
+	LockRoleTotals(LW_EXCLUSIVE);
 
-		/* Also ignore system relations */
-		if (rnode.relNode < FirstNormalObjectId)
-			continue;
+	if (shared->exceeded_overflow &&
+		shared->total_exceeded <= MAX_EXCEEDED_ROLES)
+	{
+		pg_atomic_fetch_add_u64(&shared->exceeded_seq, 1);
 
-		if (stat(path, &statbuf) != 0)
+		shared->num_exceeded = 0;
+		hash_seq_init(&iter, role_totals_map);
+		while ((rolentry = hash_seq_search(&iter)) != NULL)
 		{
-			ereport(DEBUG1,
-					(errcode_for_file_access(),
-					 errmsg("could not stat file \"%s\": %m", path)));
-			continue;
+			if (rolentry->exceeded)
+			{
+				shared->exceeded[shared->num_exceeded].key = rolentry->key;
+				shared->exceeded[shared->num_exceeded].exceed_at = rolentry->exceed_at;
+				shared->num_exceeded++;
+			}
 		}
+		shared->exceeded_overflow = false;
 
-		UpdateFileSize(&rnode, dirent->d_name, statbuf.st_size);
+		pg_atomic_fetch_add_u64(&shared->exceeded_seq, 1);
 	}
 
-	FreeDir(dirdesc);
+	UnlockRoleTotals();
 }
 
-
 /*
- * Scan file system, to update the model with all files.
+ * The space used by a role that counts toward its quotas.
  */
-void
-refresh_fs_model(void)
+static inline int64
+RoleUsedSpace(RoleSizeEntry *rolentry)
+{
+	int64		used = rolentry->totalsize;
+
+	if (pg_quota_temp_counts_toward_quota)
+		used += rolentry->tempsize;
+	return used;
+}
+
+/*
+ * Recompute whether a role has exceeded its quota, after its total or quota
+ * has changed.
+ *
+ * A role that is still within its quota, but grew in the latest pass, is
+ * also put in the "exceeded" set, if it will reach the quota within
+ * pg_quota.growth_projection seconds at its current growth rate. The
+ * projection starts from the time of the pass, so it's only extrapolated
+ * that far even if the next pass is late. A role that stops growing drops
+ * out at the next pass.
+ *
+ * Caller must hold the partition lock of the role in exclusive mode.
+ */
+static void
+CheckRoleExceeded(RoleSizeEntry *rolentry)
+{
+	bool		exceeded = false;
+	TimestampTz exceed_at = 0;
+	int64		used = RoleUsedSpace(rolentry);
+
+	if (rolentry->quota >= 0)
+	{
+		if (used > rolentry->quota)
+			exceeded = true;
+		else if (pg_quota_growth_projection > 0 && rolentry->growing &&
+				 rolentry->growth_rate > 0)
+		{
+			double		secs;
+
+			secs = (rolentry->quota - used) / rolentry->growth_rate;
+			if (secs < pg_quota_growth_projection)
+			{
+				exceeded = true;
+				exceed_at = TimestampTzPlusMilliseconds(rolentry->rate_updated,
+														(int64) (secs * 1000));
+			}
+		}
+	}
+	SetRoleExceeded(rolentry, exceeded, exceed_at);
+}
+
+/*
+ * Fold the change in a role's total since the previous pass into its growth
+ * rate.
+ *
+ * The rate is an exponentially weighted moving average of the bytes per
+ * second between passes, where the weight of each sample depends on how
+ * long it covers, so that irregular passes are weighted fairly. A shrinking
+ * total, e.g. after a TRUNCATE, resets the rate: whatever was growing
+ * before has stopped. The first pass just sets the baseline, so that the
+ * initial scan doesn't look like growth.
+ *
+ * Caller must hold the partition lock of the role in exclusive mode.
+ */
+static void
+UpdateGrowthRate(RoleSizeEntry *rolentry, int64 delta, TimestampTz now)
+{
+	rolentry->growing = false;
+
+	if (delta < 0)
+		rolentry->growth_rate = 0;
+	else if (model_populated && rolentry->rate_updated != 0 &&
+			 now > rolentry->rate_updated)
+	{
+		double		secs = (now - rolentry->rate_updated) / 1000000.0;
+		double		weight = 1.0 - exp(-secs / GROWTH_RATE_TIME_CONSTANT);
+
+		rolentry->growth_rate += weight * (delta / secs - rolentry->growth_rate);
+		rolentry->growing = (delta > 0);
+	}
+	rolentry->rate_updated = now;
+}
+
+/*
+ * Syscache invalidation callback for pg_auth_members.
+ */
+static void
+role_ancestors_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	if (role_ancestors_map)
+	{
+		MemoryContextReset(RoleAncestorsContext);
+		role_ancestors_map = NULL;
+	}
+	role_rollups_stale = true;
+}
+
+/*
+ * Returns the roles that 'roleid' is a member of, directly or indirectly.
+ * The array is valid until the next catalog access.
+ *
+ * Computing the set needs catalog access. If it's not cached, and we're
+ * not in a transaction, pretend that the role is not a member of anything,
+ * and have the worker fix up the totals with UpdateRoleRollups() later.
+ */
+static Oid *
+GetRoleAncestors(Oid roleid, int *nancestors)
+{
+	RoleAncestorsEntry *entry;
+	List	   *ancestors;
+	ListCell   *lc;
+	bool		found;
+	int			i;
+
+	if (role_ancestors_map)
+	{
+		entry = (RoleAncestorsEntry *) hash_search(role_ancestors_map,
+												   (void *) &roleid,
+												   HASH_FIND, NULL);
+		if (entry)
+		{
+			*nancestors = entry->nancestors;
+			return entry->ancestors;
+		}
+	}
+
+	if (!IsTransactionState())
+	{
+		role_rollups_stale = true;
+		*nancestors = 0;
+		return NULL;
+	}
+
+	if (!authmem_callback_registered)
+	{
+		CacheRegisterSyscacheCallback(AUTHMEMMEMROLE,
+									  role_ancestors_syscache_callback,
+									  (Datum) 0);
+		authmem_callback_registered = true;
+	}
+
+	/* Note: this can process invalidations, which reset the cache */
+	ancestors = get_role_ancestors(roleid);
+
+	if (role_ancestors_map == NULL)
+	{
+		HASHCTL		hash_ctl;
+
+		if (RoleAncestorsContext == NULL)
+			RoleAncestorsContext = AllocSetContextCreate(TopMemoryContext,
+														 "pg_quota role ancestors",
+														 ALLOCSET_SMALL_SIZES);
+
+		memset(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(Oid);
+		hash_ctl.entrysize = sizeof(RoleAncestorsEntry);
+		hash_ctl.hcxt = RoleAncestorsContext;
+
+		role_ancestors_map = hash_create("pg_quota role ancestors map",
+										 64,
+										 &hash_ctl,
+										 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	entry = (RoleAncestorsEntry *) hash_search(role_ancestors_map,
+											   (void *) &roleid,
+											   HASH_ENTER, &found);
+	entry->nancestors = list_length(ancestors);
+	entry->ancestors = NULL;
+	if (entry->nancestors > 0)
+	{
+		entry->ancestors = (Oid *)
+			MemoryContextAlloc(RoleAncestorsContext,
+							   entry->nancestors * sizeof(Oid));
+		i = 0;
+		foreach(lc, ancestors)
+			entry->ancestors[i++] = lfirst_oid(lc);
+	}
+	list_free(ancestors);
+
+	*nancestors = entry->nancestors;
+	return entry->ancestors;
+}
+
+/*
+ * Find or create the entry in role_deltas_map for one total of a role.
+ */
+static RoleDeltaEntry *
+GetRoleDeltaEntry(Oid owner, Oid spcid)
+{
+	RoleDeltaEntry *delentry;
+	RoleSizeEntryKey key;
+	bool		found;
+
+	key.rolid = owner;
+	key.dbid = MyDatabaseId;
+	key.spcid = spcid;
+	delentry = (RoleDeltaEntry *) hash_search(role_deltas_map,
+											  (void *) &key,
+											  HASH_ENTER, &found);
+	if (!found)
+	{
+		delentry->hashcode = get_hash_value(role_totals_map, (void *) &key);
+		delentry->delta = 0;
+		delentry->owndelta = 0;
+		delentry->tempdelta = 0;
+		delentry->published = false;
+		delentry->keep = false;
+	}
+	return delentry;
+}
+
+/*
+ * Remember a change to one total of a role, see AddRoleDelta(). 'own' is
+ * true if the change is in the role's own relations, and false if it's
+ * rolled up from a member.
+ */
+static void
+AddRoleTotalDelta(Oid owner, Oid spcid, int64 delta, bool own)
+{
+	RoleDeltaEntry *delentry;
+
+	delentry = GetRoleDeltaEntry(owner, spcid);
+	delentry->delta += delta;
+	if (own)
+		delentry->owndelta += delta;
+}
+
+/*
+ * Remember a change to the space usage of a role, in a tablespace, to be
+ * published to shared memory by the next PublishRoleDeltas() call. The
+ * change applies to the role's database-wide total, its total in the
+ * tablespace, and the breakdown by fork. The totals of the groups that the
+ * role is a member of are changed too.
+ *
+ * A zero delta is remembered, too, so that the role gets an entry in the
+ * shared hash table even if it doesn't own any non-empty files.
+ */
+static void
+AddRoleDelta(Oid owner, Oid spcid, ForkNumber forknum, int64 delta)
+{
+	RoleUsageDeltaEntry *usagedelta;
+	RoleUsageEntryKey usagekey;
+	bool		found;
+	Oid		   *ancestors;
+	int			nancestors;
+	int			i;
+
+	Assert(OidIsValid(owner));
+
+	AddRoleTotalDelta(owner, InvalidOid, delta, true);
+	AddRoleTotalDelta(owner, spcid, delta, true);
+
+	ancestors = GetRoleAncestors(owner, &nancestors);
+	for (i = 0; i < nancestors; i++)
+	{
+		AddRoleTotalDelta(ancestors[i], InvalidOid, delta, false);
+		AddRoleTotalDelta(ancestors[i], spcid, delta, false);
+	}
+
+	if (delta == 0)
+		return;
+
+	usagekey.rolid = owner;
+	usagekey.dbid = MyDatabaseId;
+	usagekey.spcid = spcid;
+	usagedelta = (RoleUsageDeltaEntry *) hash_search(usage_deltas_map,
+													 (void *) &usagekey,
+													 HASH_ENTER, &found);
+	if (!found)
+	{
+		memset(usagedelta->delta, 0, sizeof(usagedelta->delta));
+		usagedelta->published = false;
+	}
+	usagedelta->delta[forknum] += delta;
+}
+
+/*
+ * Apply the accumulated changes to role_usage_map.
+ */
+static void
+PublishUsageDeltas(void)
 {
-	DIR		   *dirdesc;
-	struct dirent *dirent;
-	char		path[MAXPGPATH];
 	HASH_SEQ_STATUS iter;
-	FileSizeEntry *fsentry;
+	RoleUsageDeltaEntry *usagedelta;
+	bool		overflow = false;
 
-	/*
-	 * Bump the generation counter first, so that we can detect removed files.
-	 */
-	generation++;
+	if (hash_get_num_entries(usage_deltas_map) == 0)
+		return;
 
-	/* global/<relid> */
-	/* ignore shared relations */
+	AcquireLockTimed(shared->usage_lock, LW_EXCLUSIVE);
+	hash_seq_init(&iter, usage_deltas_map);
+	while ((usagedelta = hash_seq_search(&iter)) != NULL)
+	{
+		RoleUsageEntry *usage;
+		bool		found;
+		bool		empty = true;
+		int			i;
+
+		usage = (RoleUsageEntry *) hash_search(role_usage_map,
+											   (void *) &usagedelta->key,
+											   HASH_ENTER_NULL, &found);
+		if (!usage)
+		{
+			/* no room; keep the delta, and try again on the next pass */
+			overflow = true;
+			continue;
+		}
+		if (!found)
+			memset(usage->forksize, 0, sizeof(usage->forksize));
 
-	/* base/<dbid>/<relid> */
-	dirdesc = AllocateDir("base");
-	while ((dirent = ReadDirExtended(dirdesc, "base", DEBUG1)) != NULL)
+		for (i = 0; i <= MAX_FORKNUM; i++)
+		{
+			usage->forksize[i] += usagedelta->delta[i];
+			if (usage->forksize[i] != 0)
+				empty = false;
+		}
+		if (empty)
+			(void) hash_search(role_usage_map, (void *) &usagedelta->key,
+							   HASH_REMOVE, NULL);
+		usagedelta->published = true;
+	}
+	LWLockRelease(shared->usage_lock);
+
+	/* Reset the published ones for the next pass. */
+	hash_seq_init(&iter, usage_deltas_map);
+	while ((usagedelta = hash_seq_search(&iter)) != NULL)
 	{
-		Oid			dbid;
+		if (usagedelta->published)
+			(void) hash_search(usage_deltas_map, (void *) &usagedelta->key,
+							   HASH_REMOVE, NULL);
+	}
 
-		if (strcmp(dirent->d_name, ".") == 0 ||
-			strcmp(dirent->d_name, "..") == 0)
+	if (overflow)
+		pg_atomic_fetch_add_u64(&shared->overflow_count, 1);
+}
+
+/* qsort comparator, to sort RoleDeltaEntrys by partition */
+static int
+role_delta_partition_cmp(const void *a, const void *b)
+{
+	uint32		pa = (*(RoleDeltaEntry *const *) a)->hashcode % ROLE_TOTALS_PARTITIONS;
+	uint32		pb = (*(RoleDeltaEntry *const *) b)->hashcode % ROLE_TOTALS_PARTITIONS;
+
+	if (pa < pb)
+		return -1;
+	if (pa > pb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Apply all the accumulated changes to the role totals in shared memory.
+ *
+ * The changes are sorted by partition, so that we only need to acquire each
+ * partition lock once.
+ *
+ * If 'sample' is true, this is the end of a pass over the data directory,
+ * and the changes are also folded into the roles' growth rates. The other
+ * callers, that only attribute existing files to their owners, pass false.
+ * The entries of roles that are growing are kept with a zero delta, so that
+ * the next pass notices if they stop.
+ */
+static void
+PublishRoleDeltas(bool sample)
+{
+	HASH_SEQ_STATUS iter;
+	RoleDeltaEntry *delentry;
+	RoleDeltaEntry **deltas;
+	long		ndeltas;
+	long		i;
+	LWLock	   *curlock = NULL;
+	TimestampTz now;
+
+	ndeltas = hash_get_num_entries(role_deltas_map);
+	if (ndeltas == 0)
+	{
+		PublishUsageDeltas();
+		return;
+	}
+
+	deltas = (RoleDeltaEntry **) palloc(ndeltas * sizeof(RoleDeltaEntry *));
+	i = 0;
+	hash_seq_init(&iter, role_deltas_map);
+	while ((delentry = hash_seq_search(&iter)) != NULL)
+		deltas[i++] = delentry;
+	Assert(i == ndeltas);
+
+	qsort(deltas, ndeltas, sizeof(RoleDeltaEntry *), role_delta_partition_cmp);
+
+	now = GetCurrentTimestamp();
+	for (i = 0; i < ndeltas; i++)
+	{
+		RoleSizeEntry *rolentry;
+		LWLock	   *lock;
+
+		delentry = deltas[i];
+
+		lock = RoleTotalsPartitionLock(delentry->hashcode);
+		if (lock != curlock)
+		{
+			if (curlock)
+				LWLockRelease(curlock);
+			AcquireLockTimed(lock, LW_EXCLUSIVE);
+			curlock = lock;
+		}
+
+		rolentry = EnterRoleSizeEntry(&delentry->key, delentry->hashcode);
+
+		/*
+		 * If there's no room for this role in shared memory, keep the delta,
+		 * and try again on the next pass.
+		 */
+		if (!rolentry)
 			continue;
 
-		if (sscanf(dirent->d_name, "%u", &dbid) != 1)
+		rolentry->totalsize += delentry->delta;
+		rolentry->ownsize += delentry->owndelta;
+		rolentry->tempsize += delentry->tempdelta;
+		if (sample)
+			UpdateGrowthRate(rolentry, delentry->delta, now);
+		CheckRoleExceeded(rolentry);
+		delentry->published = true;
+		delentry->keep = rolentry->growing;
+		role_tiers_stale = true;
+	}
+
+	if (curlock)
+		LWLockRelease(curlock);
+
+	/* Reset the published ones for the next pass. */
+	for (i = 0; i < ndeltas; i++)
+	{
+		if (!deltas[i]->published)
 			continue;
+		if (deltas[i]->keep)
+		{
+			deltas[i]->delta = 0;
+			deltas[i]->owndelta = 0;
+			deltas[i]->tempdelta = 0;
+			deltas[i]->published = false;
+		}
+		else
+			(void) hash_search(role_deltas_map,
+							   (void *) &deltas[i]->key,
+							   HASH_REMOVE, NULL);
+	}
+	pfree(deltas);
 
-		snprintf(path, MAXPGPATH, "base/%s", dirent->d_name);
-		RebuildRelSizeMapDir(path);
+	if (eviction_needed)
+		EvictUnusedRoleEntries();
+	RebuildExceededSet();
+
+	PublishUsageDeltas();
+}
+
+/*
+ * Find or create the entry for the directory of a tablespace.
+ */
+static ScanDirEntry *
+GetScanDir(Oid spcNode)
+{
+	ScanDirEntry *dir;
+	bool		found;
+
+	dir = (ScanDirEntry *) hash_search(scan_dirs_map, (void *) &spcNode,
+									   HASH_ENTER, &found);
+	if (!found)
+	{
+		/* will be filled in by CheckDirUnchanged() */
+		dir->mtime = 0;
+		dir->listed_at = 0;
+		dir->fd = -1;
+		dir->path[0] = '\0';
+
+		dlist_init(&dir->rels);
+		dir->numfiles = 0;
+		dir->seen_generation = generation;
+		dir->numseen = 0;
 	}
-	FreeDir(dirdesc);
+	return dir;
+}
+
+/*
+ * Remember that we saw a file to exist during the current scan.
+ */
+static void
+MarkFileSeen(FileSizeEntry *fsentry)
+{
+	RelSizeEntry *relentry = fsentry->parent;
+	ScanDirEntry *dir = relentry->dir;
+
+	if (fsentry->generation == generation)
+		return;
+	fsentry->generation = generation;
+
+	if (relentry->seen_generation != generation)
+	{
+		relentry->seen_generation = generation;
+		relentry->numseen = 0;
+	}
+	relentry->numseen++;
+
+	if (dir->seen_generation != generation)
+	{
+		dir->seen_generation = generation;
+		dir->numseen = 0;
+	}
+	dir->numseen++;
+}
+
+/*
+ * Find the RelSizeEntry for a relation, or NULL if we don't know about it.
+ */
+static RelSizeEntry *
+LookupRelSizeEntry(RelFileNode *rnode)
+{
+	RelMapEntry *mapentry;
+
+	mapentry = relentry_lookup(relfilenode_to_relentry_map, *rnode);
+
+	return mapentry ? mapentry->entry : NULL;
+}
+
+/*
+ * Remove a file from the model.
+ *
+ * If called while iterating through file_to_fsentry_map, 'fsentry' must be
+ * the current entry of the iteration. Other entries may move around.
+ */
+static void
+RemoveFileSize(FileSizeEntry *fsentry)
+{
+	RelSizeEntry *relentry = fsentry->parent;
+	int64		filesize = fsentry->filesize;
+	ForkNumber	forknum = fsentry->key.forknum;
+	Oid			spcid = fsentry->key.spcNode;
+	Oid			owner = relentry->owner;
+	ScanDirEntry *dir = relentry->dir;
+	bool		found;
+
+	if (fsentry->generation == generation)
+	{
+		relentry->numseen--;
+		dir->numseen--;
+	}
+	dir->numfiles--;
+
+	/* Remove the FileSizeEntry. */
+	found = fsentry_delete(file_to_fsentry_map, fsentry->key);
+	Assert(found);
+	worker_stats.files_removed++;
+	model_changes++;
 
 	/*
-	 * pg_tblspc/<tblspc oid>/<tblspc version>/
-	 *		within a non-default tablespace (the name of the directory
-	 *		depends on version)
+	 * Update the parent relation. If this was the last file of this relation,
+	 * remove the entry for the relation altogether.
 	 */
-	/* TODO */
+	relentry->totalsize -= filesize;
+	relentry->forksize[forknum] -= filesize;
+	relentry->numfiles--;
+	if (relentry->numfiles == 0)
+	{
+		Assert(relentry->totalsize == 0);
+		if (relentry->owner == InvalidOid)
+		{
+			dlist_delete(&relentry->orphan_node);
+			num_orphans--;
+			if (relentry->stale_orphan)
+				num_stale_orphans--;
+		}
+		if (relentry->recheck)
+		{
+			dlist_delete(&relentry->recheck_node);
+			num_recheck--;
+		}
+		if (relentry->hot)
+		{
+			dlist_delete(&relentry->hot_node);
+			num_hot--;
+		}
+		dlist_delete(&relentry->dir_node);
+		found = relentry_delete(relfilenode_to_relentry_map, relentry->rnode);
+		Assert(found);
+		pfree(relentry);
+	}
 
 	/*
-	 * Finally, remove files that no longer exist.
+	 * If we know the owner of this file, update its totals too.
 	 */
-	hash_seq_init(&iter, path_to_fsentry_map);
+	if (OidIsValid(owner) && filesize != 0)
+		AddRoleDelta(owner, spcid, forknum, -filesize);
+}
+
+/*
+ * Update the model with the size of one file.
+ */
+static void
+UpdateFileSize(RelFileNode *rnode, ForkNumber forknum, uint32 segno,
+			   off_t newsize)
+{
+	RelSizeEntry *relentry;
+	FileSizeEntry *fsentry;
+	FileSizeEntryKey key;
+	off_t		oldsize;
+
+	/* Find or create entry for this relation */
+	relentry = LookupRelSizeEntry(rnode);
+	if (!relentry)
+	{
+		RelMapEntry *mapentry;
+		bool		found;
+
+		relentry = MemoryContextAlloc(RelEntryContext, sizeof(RelSizeEntry));
+		relentry->rnode = *rnode;
+		mapentry = relentry_insert(relfilenode_to_relentry_map, *rnode, &found);
+		Assert(!found);
+		mapentry->entry = relentry;
+
+		relentry->owner = InvalidOid;
+		dlist_push_head(&orphanRels, &relentry->orphan_node);
+		num_orphans++;
+		relentry->stale_orphan = false;
+		relentry->recheck = false;
+		relentry->hot = false;
+
+		relentry->numfiles = 0;
+		relentry->totalsize = 0;
+		memset(relentry->forksize, 0, sizeof(relentry->forksize));
+		memset(relentry->maxseg, 0, sizeof(relentry->maxseg));
+		relentry->seen_generation = generation;
+		relentry->numseen = 0;
+
+		relentry->dir = GetScanDir(rnode->spcNode);
+		dlist_push_tail(&relentry->dir->rels, &relentry->dir_node);
+	}
+
+	/* Find or create entry for this file */
+	key.spcNode = rnode->spcNode;
+	key.relNode = rnode->relNode;
+	key.forknum = forknum;
+	key.segno = segno;
+
+	/*
+	 * Look it up first, and insert only if it's missing. Inserting can grow
+	 * the table, which is not allowed while the caller is iterating through
+	 * it; but the callers that iterate only update existing files.
+	 */
+	fsentry = fsentry_lookup(file_to_fsentry_map, key);
+	if (!fsentry)
+	{
+		bool		found;
+
+		fsentry = fsentry_insert(file_to_fsentry_map, key, &found);
+		Assert(!found);
+		fsentry->parent = relentry;
+		relentry->numfiles++;
+		relentry->dir->numfiles++;
+		if (segno > relentry->maxseg[forknum])
+			relentry->maxseg[forknum] = segno;
+		fsentry->filesize = 0;
+		fsentry->generation = generation - 1;	/* not seen yet */
+		worker_stats.files_added++;
+	}
+	Assert(relentry->numfiles > 0);
+	Assert(fsentry->parent == relentry);
+
+	/* Update file size */
+	oldsize = fsentry->filesize;
+	fsentry->filesize = newsize;
+
+	/* also remember that we saw this file to exist */
+	MarkFileSeen(fsentry);
+
+	/*
+	 * If the file size changed, must also update the totals for the relation
+	 * and the owner.
+	 */
+	if (newsize != oldsize)
+	{
+		relentry->totalsize += (newsize - oldsize);
+		relentry->forksize[forknum] += (newsize - oldsize);
+		model_changes++;
+
+		if (relentry->owner)
+			AddRoleDelta(relentry->owner, rnode->spcNode, forknum,
+						 newsize - oldsize);
+
+		if (newsize > oldsize && model_populated)
+			MarkRelHot(relentry);
+	}
+}
+
+/*
+ * Put a relation that has grown on the hot list, or if it's already there,
+ * reset its cooldown. Relations whose owner is known to have no quota are
+ * not interesting.
+ */
+static void
+MarkRelHot(RelSizeEntry *relentry)
+{
+	if (relentry->hot)
+	{
+		relentry->hot_idle = 0;
+		return;
+	}
+
+	if (num_hot >= MAX_HOT_RELATIONS)
+		return;
+	if (OidIsValid(relentry->owner) && !role_tiers_stale &&
+		GetRoleTier(relentry->owner) == NULL)
+		return;
+
+	/*
+	 * Add to the head, so that a refresh_fs_model_hot() iteration in
+	 * progress doesn't visit it again.
+	 */
+	dlist_push_head(&hotRels, &relentry->hot_node);
+	relentry->hot = true;
+	relentry->hot_idle = 0;
+	num_hot++;
+}
+
+/*
+ * Take a relation off the hot list.
+ */
+static void
+UnmarkRelHot(RelSizeEntry *relentry)
+{
+	Assert(relentry->hot);
+	dlist_delete(&relentry->hot_node);
+	relentry->hot = false;
+	num_hot--;
+}
+
+/*
+ * Look up the quota tier of a role. Returns NULL if neither the role, nor
+ * any group it's a member of, has a quota. If there are several, one that
+ * is near its quota is preferred.
+ */
+static RoleTierEntry *
+GetRoleTier(Oid owner)
+{
+	RoleTierEntry *tier;
+	RoleTierEntry *result;
+	Oid		   *ancestors;
+	int			nancestors;
+	int			i;
+
+	result = (RoleTierEntry *) hash_search(role_tiers_map, (void *) &owner,
+										   HASH_FIND, NULL);
+	if (result && result->near_quota)
+		return result;
+
+	ancestors = GetRoleAncestors(owner, &nancestors);
+	for (i = 0; i < nancestors; i++)
+	{
+		tier = (RoleTierEntry *) hash_search(role_tiers_map,
+											 (void *) &ancestors[i],
+											 HASH_FIND, NULL);
+		if (tier && (!result || tier->near_quota))
+		{
+			result = tier;
+			if (result->near_quota)
+				break;
+		}
+	}
+	return result;
+}
+
+/*
+ * Rebuild role_tiers_map from the published totals and quotas, if they have
+ * changed since the last time.
+ */
+static void
+RebuildRoleTiers(void)
+{
+	HASH_SEQ_STATUS iter;
+	RoleSizeEntry *rolentry;
+	RoleTierEntry *tier;
+
+	if (!role_tiers_stale)
+		return;
+
+	hash_seq_init(&iter, role_tiers_map);
+	while ((tier = hash_seq_search(&iter)) != NULL)
+		(void) hash_search(role_tiers_map, (void *) &tier->owner,
+						   HASH_REMOVE, NULL);
+	num_near_quota = 0;
+
+	LockRoleTotals(LW_SHARED);
+	hash_seq_init(&iter, role_totals_map);
+	while ((rolentry = hash_seq_search(&iter)) != NULL)
+	{
+		bool		found;
+
+		if (rolentry->key.dbid != MyDatabaseId || rolentry->quota < 0)
+			continue;
+
+		tier = (RoleTierEntry *) hash_search(role_tiers_map,
+											 (void *) &rolentry->key.rolid,
+											 HASH_ENTER, &found);
+		if (!found)
+			tier->near_quota = false;
+		/* round the threshold up, so that a tiny quota isn't always "near" */
+		if (!tier->near_quota &&
+			RoleUsedSpace(rolentry) >=
+			rolentry->quota - rolentry->quota / 100 * (100 - NEAR_QUOTA_PERCENT))
+		{
+			tier->near_quota = true;
+			num_near_quota++;
+		}
+	}
+	UnlockRoleTotals();
+
+	role_tiers_stale = false;
+}
+
+/*
+ * Is 'path' a relation file that this worker should track? If so, parses the
+ * relfilenode, fork and segment number from it.
+ */
+static bool
+isTrackedRelFile(const char *path, RelFileNode *rnode, ForkNumber *forknum,
+				 uint32 *segno)
+{
+	/*
+	 * Only count relation files. (Or perhaps we should count other files
+	 * towards the database owner?)
+	 */
+	if (!isRelDataFile(path, rnode, forknum, segno))
+		return false;
+
+	/* Also ignore system relations */
+	if (rnode->relNode < FirstNormalObjectId)
+		return false;
+
+	/* and relations in other databases; we only track our own database */
+	if (rnode->dbNode != MyDatabaseId)
+		return false;
+
+	return true;
+}
+
+/*
+ * If 'path' is a file of a temporary relation in our database, remember it,
+ * for UpdateTempUsage() to look at. The name of the file is
+ * t<backend id>_<relfilenode>[_<fork name>][.<segment number>].
+ */
+static void
+NoteTempRelFile(const char *path)
+{
+	TempRelFileEntry *entry;
+	Oid			spcid;
+	Oid			dbNode;
+	Oid			relNode;
+	int			backend;
+	bool		found;
+
+	if (!pg_quota_track_temp)
+		return;
+
+	if (sscanf(path, "base/%u/t%d_%u", &dbNode, &backend, &relNode) == 3)
+		spcid = DEFAULTTABLESPACE_OID;
+	else if (sscanf(path, "pg_tblspc/%u/" TABLESPACE_VERSION_DIRECTORY "/%u/t%d_%u",
+					&spcid, &dbNode, &backend, &relNode) != 4)
+		return;
+
+	if (dbNode != MyDatabaseId)
+		return;
+
+	entry = (TempRelFileEntry *) hash_search(temp_rel_files_map,
+											 (void *) path,
+											 HASH_ENTER, &found);
+	entry->spcid = spcid;
+	entry->backend = backend;
+}
+
+/*
+ * Update the model with the current state of one file.
+ *
+ * 'dirpath' is the directory containing the file, and 'filename' is the name
+ * of the file within it. If the file doesn't exist anymore, it is removed
+ * from the model. This is used by the full scan, and by fs_watch.c when it
+ * gets a notification that a file has changed.
+ */
+void
+refresh_fs_model_file(const char *dirpath, const char *filename)
+{
+	char		path[MAXPGPATH];
+
+	snprintf(path, MAXPGPATH, "%s/%s", dirpath, filename);
+	RefreshFilePath(path);
+}
+
+/*
+ * Workhorse of refresh_fs_model_file(), with the full path of the file.
+ */
+static void
+RefreshFilePath(const char *path)
+{
+	struct stat statbuf;
+	RelFileNode rnode;
+	ForkNumber	forknum;
+	uint32		segno;
+
+	if (!isTrackedRelFile(path, &rnode, &forknum, &segno))
+	{
+		NoteTempRelFile(path);
+		return;
+	}
+
+	worker_stats.files_stated++;
+	if (stat(path, &statbuf) != 0)
+	{
+		FileSizeEntry *fsentry;
+		FileSizeEntryKey key;
+
+		if (errno != ENOENT)
+		{
+			ereport(DEBUG1,
+					(errcode_for_file_access(),
+					 errmsg("could not stat file \"%s\": %m", path)));
+			return;
+		}
+
+		/* The file was removed. Forget about it, if we knew about it. */
+		key.spcNode = rnode.spcNode;
+		key.relNode = rnode.relNode;
+		key.forknum = forknum;
+		key.segno = segno;
+		fsentry = fsentry_lookup(file_to_fsentry_map, key);
+		if (fsentry)
+			RemoveFileSize(fsentry);
+		return;
+	}
+
+	UpdateFileSize(&rnode, forknum, segno, statbuf.st_size);
+}
+
+/*
+ * Like refresh_fs_model_file(), but the caller has already stat()ed the file.
+ * Used for the results of the scanners, see fs_scanner.c.
+ */
+void
+refresh_fs_model_file_size(const char *dirpath, const char *filename,
+						   off_t filesize)
+{
+	RelFileNode rnode;
+	ForkNumber	forknum;
+	uint32		segno;
+	char		path[MAXPGPATH];
+
+	snprintf(path, MAXPGPATH, "%s/%s", dirpath, filename);
+
+	if (!isTrackedRelFile(path, &rnode, &forknum, &segno))
+	{
+		NoteTempRelFile(path);
+		return;
+	}
+
+	worker_stats.files_stated++;
+	UpdateFileSize(&rnode, forknum, segno, filesize);
+}
+
+/*
+ * Charge one readdir() entry or stat() of a full scan, and nap for
+ * pg_quota.scan_cost_delay once pg_quota.scan_cost_limit has accumulated,
+ * like vacuum_delay_point() does. That spreads a scan out over a longer
+ * period, so that it doesn't hog the storage, at the cost of slower
+ * refreshes.
+ *
+ * Returns false, if the worker has been asked to shut down. The caller
+ * should then stop scanning; see scan_interrupted. Also used by the scanner
+ * processes, each with a budget of its own. They just die on SIGTERM.
+ */
+bool
+scan_delay_point(void)
+{
+	CHECK_FOR_INTERRUPTS();
+
+	if (scan_interrupted || quota_worker_terminating())
+	{
+		scan_interrupted = true;
+		return false;
+	}
+
+	if (pg_quota_scan_cost_delay <= 0)
+		return true;
+
+	if (++scan_cost_balance >= pg_quota_scan_cost_limit)
+	{
+		int			rc;
+
+		/*
+		 * Sleep on the latch, rather than with pg_usleep(), so that we wake
+		 * up at once on SIGTERM, or if the postmaster dies.
+		 */
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   pg_quota_scan_cost_delay,
+					   PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		scan_cost_balance = 0;
+
+		/* emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (quota_worker_terminating())
+		{
+			scan_interrupted = true;
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * helper function for refresh_fs_model(), to scan one directory.
+ */
+static void
+RebuildRelSizeMapDir(char *dirpath)
+{
+	DIR		   *dirdesc;
+	struct dirent *dirent;
+
+	/*
+	 * Start watching the directory for changes, so that we can do incremental
+	 * updates between full scans.
+	 */
+	fs_watch_add_dir(dirpath);
+
+	dirdesc = AllocateDir(dirpath);
+
+	while((dirent = ReadDirExtended(dirdesc, dirpath, DEBUG1)) != NULL)
+	{
+		if (strcmp(dirent->d_name, ".") == 0 ||
+			strcmp(dirent->d_name, "..") == 0)
+			continue;
+
+		if (!scan_delay_point())
+			break;
+		refresh_fs_model_file(dirpath, dirent->d_name);
+
+		/* keep the scanners' queues from filling up while we're busy */
+		poll_fs_scanners();
+	}
+
+	FreeDir(dirdesc);
+}
+
+/*
+ * Check whether a directory has changed since we last listed it. If not,
+ * opens it for RefreshUnchangedDirs() and returns true. Otherwise remembers
+ * its current mtime, as the caller is about to list it, and returns false.
+ */
+static bool
+CheckDirUnchanged(Oid spcNode, const char *path, time_t now)
+{
+	ScanDirEntry *dir;
+	struct stat statbuf;
+
+	if (stat(path, &statbuf) != 0)
+		return false;
+
+	dir = GetScanDir(spcNode);
+	if (pg_quota_skip_static_segments &&
+			 strcmp(dir->path, path) == 0 &&
+			 statbuf.st_mtime == dir->mtime &&
+			 dir->mtime < dir->listed_at)
+	{
+		dir->fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+		if (dir->fd >= 0)
+			return true;
+	}
+
+	dir->mtime = statbuf.st_mtime;
+	dir->listed_at = now;
+	strlcpy(dir->path, path, MAXPGPATH);
+	return false;
+}
+
+/*
+ * Construct the file name of a file in the model, within its directory.
+ */
+static void
+ModelFileName(FileSizeEntryKey *key, char *name)
+{
+	int			len;
+
+	if (key->forknum == MAIN_FORKNUM)
+		len = snprintf(name, MAXPGPATH, "%u", key->relNode);
+	else
+		len = snprintf(name, MAXPGPATH, "%u_%s", key->relNode,
+					   forkNames[key->forknum]);
+	if (key->segno > 0)
+		snprintf(name + len, MAXPGPATH - len, ".%u", key->segno);
+}
+
+/*
+ * Is this a full segment, followed by a non-empty segment of the same fork?
+ * Such a segment can only change size by truncation of the fork, and that
+ * shrinks the following segment too, which RefreshUnchangedDirs() notices.
+ *
+ * mdtruncate() leaves the segments past the new end behind as zero-length
+ * files, rather than removing them. An empty segment cannot shrink, so it
+ * doesn't tell us about a later truncation of the segments before it.
+ */
+static bool
+IsStaticSegment(FileSizeEntry *fsentry)
+{
+	FileSizeEntryKey nextkey;
+	FileSizeEntry *next;
+
+	if (fsentry->filesize != (off_t) RELSEG_SIZE * BLCKSZ)
+		return false;
+
+	nextkey = fsentry->key;
+	nextkey.segno++;
+	next = fsentry_lookup(file_to_fsentry_map, nextkey);
+	return next != NULL && next->filesize > 0;
+}
+
+/*
+ * stat() a file of the model, in a directory opened by CheckDirUnchanged(),
+ * and update the model. Returns true, if the file shrank or vanished.
+ */
+static bool
+StatModelFile(ScanDirEntry *dir, FileSizeEntry *fsentry)
+{
+	char		name[MAXPGPATH];
+	struct stat statbuf;
+	RelFileNode rnode;
+	off_t		oldsize = fsentry->filesize;
+
+	ModelFileName(&fsentry->key, name);
+
+	/* stat relative to the directory, to avoid resolving the whole path */
+	worker_stats.files_stated++;
+	if (fstatat(dir->fd, name, &statbuf, 0) != 0)
+	{
+		if (errno == ENOENT)
+		{
+			/* removed after we looked at the directory */
+			RemoveFileSize(fsentry);
+			return true;
+		}
+		ereport(DEBUG1,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s/%s\": %m", dir->path, name)));
+		return false;
+	}
+
+	rnode = fsentry->parent->rnode;
+	UpdateFileSize(&rnode, fsentry->key.forknum, fsentry->key.segno,
+				   statbuf.st_size);
+	return statbuf.st_size < oldsize;
+}
+
+/*
+ * Refresh the files in the directories that CheckDirUnchanged() found to be
+ * unchanged, without reading the directories.
+ */
+static void
+RefreshUnchangedDirs(void)
+{
+	HASH_SEQ_STATUS iter;
+	fsentry_iterator fiter;
+	FileSizeEntry *fsentry;
+	ScanDirEntry *dir;
+	List	   *shrunk = NIL;
+	ListCell   *lc;
+
+	fsentry_start_iterate(file_to_fsentry_map, &fiter);
+	while ((fsentry = fsentry_iterate(file_to_fsentry_map, &fiter)) != NULL)
+	{
+		FileSizeEntryKey key;
+
+		dir = (ScanDirEntry *) hash_search(scan_dirs_map,
+										   (void *) &fsentry->key.spcNode,
+										   HASH_FIND, NULL);
+		if (!dir || dir->fd < 0)
+			continue;
+
+		/* Skip static segments, just note that they still exist */
+		if (IsStaticSegment(fsentry))
+		{
+			MarkFileSeen(fsentry);
+			continue;
+		}
+
+		if (!scan_delay_point())
+			break;
+
+		/*
+		 * If the last segment of a fork shrank, the fork was truncated, and
+		 * the static segments before it might have shrunk too. Check them
+		 * after the scan. (We cannot modify other entries while iterating.)
+		 */
+		key = fsentry->key;
+		if (StatModelFile(dir, fsentry))
+		{
+			FileSizeEntryKey *k = palloc(sizeof(FileSizeEntryKey));
+
+			*k = key;
+			shrunk = lappend(shrunk, k);
+		}
+	}
+
+	foreach(lc, shrunk)
+	{
+		FileSizeEntryKey key = *(FileSizeEntryKey *) lfirst(lc);
+		uint32		lastseg = key.segno;
+
+		dir = (ScanDirEntry *) hash_search(scan_dirs_map,
+										   (void *) &key.spcNode,
+										   HASH_FIND, NULL);
+		for (key.segno = 0; key.segno < lastseg; key.segno++)
+		{
+			if (!scan_delay_point())
+				break;
+			fsentry = fsentry_lookup(file_to_fsentry_map, key);
+			if (fsentry)
+				(void) StatModelFile(dir, fsentry);
+		}
+	}
+	list_free_deep(shrunk);
+
+	hash_seq_init(&iter, scan_dirs_map);
+	while ((dir = hash_seq_search(&iter)) != NULL)
+	{
+		if (dir->fd >= 0)
+		{
+			CloseTransientFile(dir->fd);
+			dir->fd = -1;
+		}
+	}
+}
+
+/*
+ * Remove the files of a relation that were not seen during the current scan.
+ * If that was all of them, the relation is removed too.
+ */
+static void
+RemoveUnseenRelFiles(RelSizeEntry *relentry)
+{
+	FileSizeEntryKey key;
+	int			forknum;
+
+	key.spcNode = relentry->rnode.spcNode;
+	key.relNode = relentry->rnode.relNode;
+
+	/*
+	 * We don't have a list of the files of the relation, but we know the
+	 * highest segment number of each fork, so probe for each possible file.
+	 */
+	for (forknum = 0; forknum <= MAX_FORKNUM; forknum++)
+	{
+		uint32		maxseg = 0;
+
+		key.forknum = forknum;
+		for (key.segno = 0; key.segno <= relentry->maxseg[forknum]; key.segno++)
+		{
+			FileSizeEntry *fsentry;
+
+			fsentry = fsentry_lookup(file_to_fsentry_map, key);
+			if (!fsentry)
+				continue;
+
+			if (fsentry->generation != generation)
+			{
+				/* RemoveFileSize() frees the relation with its last file */
+				if (relentry->numfiles == 1)
+				{
+					RemoveFileSize(fsentry);
+					return;
+				}
+				RemoveFileSize(fsentry);
+			}
+			else
+				maxseg = key.segno;
+		}
+		relentry->maxseg[forknum] = maxseg;
+	}
+}
+
+/*
+ * Remove files that were not seen during the current scan.
+ *
+ * Rather than going through every file in the model, compare the number of
+ * files seen in each directory, and in each relation, to the number of files
+ * in the model, and only look closer where some are missing. So this is
+ * cheap when no files, or only the files of a few relations, were removed.
+ */
+static void
+RemoveUnseenFiles(void)
+{
+	HASH_SEQ_STATUS iter;
+	ScanDirEntry *dir;
+
+	hash_seq_init(&iter, scan_dirs_map);
+	while ((dir = hash_seq_search(&iter)) != NULL)
+	{
+		dlist_mutable_iter riter;
+
+		/* nothing seen in this directory, e.g. if it was removed */
+		if (dir->seen_generation != generation)
+		{
+			dir->seen_generation = generation;
+			dir->numseen = 0;
+		}
+
+		if (dir->numfiles == dir->numseen)
+			continue;
+
+		dlist_foreach_modify(riter, &dir->rels)
+		{
+			RelSizeEntry *relentry = (RelSizeEntry *)
+				dlist_container(RelSizeEntry, dir_node, riter.cur);
+			int			numseen;
+
+			numseen = relentry->seen_generation == generation ? relentry->numseen : 0;
+			if (numseen == relentry->numfiles)
+				continue;
+
+			RemoveUnseenRelFiles(relentry);
+
+			/* stop early, if we have found all the removed files */
+			if (dir->numfiles == dir->numseen)
+				break;
+		}
+	}
+}
+
+/*
+ * Shrink the local hash tables, if many entries have been removed from them.
+ *
+ * simplehash never shrinks a table by itself, so after e.g. dropping a big
+ * partitioned table, we would be left with a mostly empty bucket array, which
+ * takes memory, and makes iterating through the table slow. Rebuild such
+ * tables with a size that fits the remaining entries. The bucket arrays are
+ * large enough to be allocated directly with malloc(), so the memory is
+ * really returned to the operating system.
+ */
+static void
+CompactFsModel(void)
+{
+	if (file_to_fsentry_map->size > FS_MODEL_COMPACT_MIN_SIZE &&
+		file_to_fsentry_map->members <
+		file_to_fsentry_map->size / FS_MODEL_COMPACT_RATIO)
+	{
+		fsentry_hash *newmap;
+		fsentry_iterator fiter;
+		FileSizeEntry *fsentry;
+
+		elog(DEBUG1, "compacting file map, %u entries in %llu buckets",
+			 file_to_fsentry_map->members,
+			 (unsigned long long) file_to_fsentry_map->size);
+
+		newmap = fsentry_create(FsModelContext,
+								Max(file_to_fsentry_map->members * 2, 1024),
+								NULL);
+		fsentry_start_iterate(file_to_fsentry_map, &fiter);
+		while ((fsentry = fsentry_iterate(file_to_fsentry_map, &fiter)) != NULL)
+		{
+			FileSizeEntry *newentry;
+			bool		found;
+
+			newentry = fsentry_insert(newmap, fsentry->key, &found);
+			Assert(!found);
+			newentry->filesize = fsentry->filesize;
+			newentry->parent = fsentry->parent;
+			newentry->generation = fsentry->generation;
+		}
+		fsentry_destroy(file_to_fsentry_map);
+		file_to_fsentry_map = newmap;
+	}
+
+	if (relfilenode_to_relentry_map->size > FS_MODEL_COMPACT_MIN_SIZE &&
+		relfilenode_to_relentry_map->members <
+		relfilenode_to_relentry_map->size / FS_MODEL_COMPACT_RATIO)
+	{
+		relentry_hash *newmap;
+		relentry_iterator riter;
+		RelMapEntry *mapentry;
+
+		newmap = relentry_create(FsModelContext,
+								 Max(relfilenode_to_relentry_map->members * 2, 1024),
+								 NULL);
+		relentry_start_iterate(relfilenode_to_relentry_map, &riter);
+		while ((mapentry = relentry_iterate(relfilenode_to_relentry_map, &riter)) != NULL)
+		{
+			RelMapEntry *newentry;
+			bool		found;
+
+			newentry = relentry_insert(newmap, mapentry->key, &found);
+			Assert(!found);
+			newentry->entry = mapentry->entry;
+		}
+		relentry_destroy(relfilenode_to_relentry_map);
+		relfilenode_to_relentry_map = newmap;
+	}
+}
+
+/*
+ * Scan file system, to update the model with all files.
+ *
+ * Returns true, if anything had changed since the last scan.
+ */
+bool
+refresh_fs_model(void)
+{
+	DIR		   *dirdesc;
+	struct dirent *dirent;
+	char		path[MAXPGPATH];
+	List	   *local_dirs = NIL;
+	List	   *failed_dirs;
+	ListCell   *lc;
+	time_t		now = time(NULL);
+	bool		unchanged_dirs = false;
+	uint64		old_changes = model_changes;
+
+	/*
+	 * Bump the generation counter first, so that we can detect removed files.
+	 */
+	generation++;
+	scan_interrupted = false;
+
+	/* global/<relid> */
+	/* ignore shared relations */
+
+	/*
+	 * This worker only tracks the database it's connected to, so there's no
+	 * need to look at the other databases' directories.
+	 */
+
+	/*
+	 * pg_tblspc/<tblspc oid>/<tblspc version>/<dbid>/<relid>
+	 *		within a non-default tablespace (the name of the directory
+	 *		depends on version)
+	 *
+	 * Each tablespace is likely on a different device, so hand each one to
+	 * a scanner, to stat() the files in parallel. We'll scan the default
+	 * tablespace ourselves while they're working.
+	 */
+	dirdesc = AllocateDir("pg_tblspc");
+	while ((dirent = ReadDirExtended(dirdesc, "pg_tblspc", DEBUG1)) != NULL)
+	{
+		Oid			spcid;
+		struct stat statbuf;
+
+		if (strcmp(dirent->d_name, ".") == 0 ||
+			strcmp(dirent->d_name, "..") == 0)
+			continue;
+
+		if (sscanf(dirent->d_name, "%u", &spcid) != 1)
+			continue;
+
+		snprintf(path, MAXPGPATH, "pg_tblspc/%s/%s/%u",
+				 dirent->d_name, TABLESPACE_VERSION_DIRECTORY, MyDatabaseId);
+
+		/* Skip tablespaces that don't contain anything for this database. */
+		if (stat(path, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode))
+			continue;
+
+		if (CheckDirUnchanged(spcid, path, now))
+		{
+			unchanged_dirs = true;
+			continue;
+		}
+
+		if (request_fs_scan(path))
+		{
+			/* the scanner doesn't know about fs_watch.c, so do it here */
+			fs_watch_add_dir(path);
+			continue;
+		}
+		local_dirs = lappend(local_dirs, pstrdup(path));
+	}
+	FreeDir(dirdesc);
+
+	/* base/<dbid>/<relid> */
+	snprintf(path, MAXPGPATH, "base/%u", MyDatabaseId);
+	if (CheckDirUnchanged(DEFAULTTABLESPACE_OID, path, now))
+		unchanged_dirs = true;
+	else
+		RebuildRelSizeMapDir(path);
+
+	/* Tablespaces that we couldn't launch a scanner for */
+	foreach(lc, local_dirs)
+		RebuildRelSizeMapDir((char *) lfirst(lc));
+	list_free_deep(local_dirs);
+
+	/*
+	 * Collect the results from the scanners, and rescan any directories whose
+	 * scanner failed.
+	 */
+	failed_dirs = finish_fs_scanners();
+	foreach(lc, failed_dirs)
+		RebuildRelSizeMapDir((char *) lfirst(lc));
+	list_free_deep(failed_dirs);
+
+	/*
+	 * Directories that haven't changed since the last scan. This iterates
+	 * the model, so it cannot apply the scanners' results as it goes; do it
+	 * after they're done, so that they don't wait for it.
+	 */
+	if (unchanged_dirs)
+		RefreshUnchangedDirs();
+
+	/*
+	 * Finally, remove files that no longer exist. If we're shutting down,
+	 * and didn't see everything, we cannot tell which ones those are, so
+	 * leave the model as it is. It's still as good as it was after the
+	 * previous scan.
+	 */
+	if (!scan_interrupted)
+		RemoveUnseenFiles();
+	else
+		elog(DEBUG1, "pg_quota full scan interrupted by shutdown request");
+
+	CompactFsModel();
+
+	PublishRoleDeltas(true);
+	model_populated = true;
+
+	return model_changes != old_changes;
+}
+
+/*
+ * Update the model with the files that have changed since the last refresh,
+ * as reported by fs_watch.c.
+ *
+ * Returns false if we have lost track of some changes, and a full
+ * refresh_fs_model() scan is needed.
+ */
+bool
+refresh_fs_model_changes(void)
+{
+	bool		result;
+
+	result = fs_watch_process_events(true);
+
+	PublishRoleDeltas(true);
+
+	return result;
+}
+
+/*
+ * Refresh the hot relations, see hotRels.
+ *
+ * For each fork, we stat() the last segment that we know of, and the one
+ * after it, to catch a new segment. That's enough to follow a relation that
+ * grows at the end; truncations and removals are left for the next full
+ * scan.
+ */
+void
+refresh_fs_model_hot(void)
+{
+	dlist_mutable_iter iter;
+
+	RebuildRoleTiers();
+
+	dlist_foreach_modify(iter, &hotRels)
+	{
+		RelSizeEntry *relentry = dlist_container(RelSizeEntry, hot_node, iter.cur);
+		RelFileNode rnode = relentry->rnode;
+		off_t		oldsize = relentry->totalsize;
+		RoleTierEntry *tier = NULL;
+		ForkNumber	forknum;
+
+		if (OidIsValid(relentry->owner))
+		{
+			tier = GetRoleTier(relentry->owner);
+			if (!tier)
+			{
+				/* the owner doesn't have a quota (anymore) */
+				UnmarkRelHot(relentry);
+				continue;
+			}
+		}
+
+		for (forknum = 0; forknum <= MAX_FORKNUM && relentry; forknum++)
+		{
+			FileSizeEntryKey key;
+			uint32		maxseg;
+			char	   *relpath;
+			char		path[MAXPGPATH];
+
+			key.spcNode = rnode.spcNode;
+			key.relNode = rnode.relNode;
+			key.forknum = forknum;
+			key.segno = 0;
+			if (!fsentry_lookup(file_to_fsentry_map, key))
+				continue;
+
+			maxseg = relentry->maxseg[forknum];
+			relpath = relpathperm(rnode, forknum);
+
+			if (maxseg == 0)
+				RefreshFilePath(relpath);
+			else
+			{
+				snprintf(path, MAXPGPATH, "%s.%u", relpath, maxseg);
+				RefreshFilePath(path);
+			}
+			snprintf(path, MAXPGPATH, "%s.%u", relpath, maxseg + 1);
+			RefreshFilePath(path);
+			pfree(relpath);
+
+			/* the relation is gone, if its last file was removed */
+			relentry = LookupRelSizeEntry(&rnode);
+		}
+		if (!relentry || !relentry->hot)
+			continue;
+
+		if (relentry->totalsize <= oldsize &&
+			++relentry->hot_idle >= HOT_RELATION_COOLDOWN &&
+			!(tier && tier->near_quota))
+			UnmarkRelHot(relentry);
+	}
+
+	PublishRoleDeltas(true);
+}
+
+/*
+ * Are there any relations on the hot list?
+ */
+bool
+HaveHotRelations(void)
+{
+	return num_hot > 0;
+}
+
+/*
+ * Total memory allocated in a memory context and all its children.
+ */
+static int64
+ContextTotalSpace(MemoryContext context)
+{
+	MemoryContextCounters totals;
+	MemoryContext child;
+	int64		result;
+
+	memset(&totals, 0, sizeof(totals));
+	context->methods->stats(context, NULL, NULL, &totals);
+	result = totals.totalspace;
+
+	for (child = context->firstchild; child != NULL; child = child->nextchild)
+		result += ContextTotalSpace(child);
+
+	return result;
+}
+
+/*
+ * Record how long one phase of a refresh took, in milliseconds.
+ */
+void
+RecordRefreshPhase(QuotaRefreshPhase phase, double elapsed)
+{
+	worker_stats.phase_count[phase]++;
+	worker_stats.phase_last[phase] = elapsed;
+	worker_stats.phase_total[phase] += elapsed;
+}
+
+/*
+ * Copy the worker's statistics to shared memory. Called at the end of every
+ * refresh.
+ */
+void
+PublishWorkerStats(bool full_scan)
+{
+	worker_stats.last_refresh = GetCurrentTimestamp();
+	worker_stats.num_refreshes++;
+	if (full_scan)
+		worker_stats.num_full_scans++;
+	worker_stats.num_orphans = num_orphans;
+	worker_stats.model_memory = ContextTotalSpace(FsModelContext);
+
+	SpinLockAcquire(&MyDbState->stats_mutex);
+	MyDbState->stats = worker_stats;
+	SpinLockRelease(&MyDbState->stats_mutex);
+}
+
+/*
+ * The DSA area for the relation sizes: created by the worker, and attached
+ * to by backends on demand. relsizes_area_handle is the handle of the area
+ * we're attached to, in a backend.
+ */
+static dsa_area *relsizes_area = NULL;
+static dsa_handle relsizes_area_handle = DSM_HANDLE_INVALID;
+
+/* model_changes, as of the last PublishRelationSizes() */
+static uint64 relsizes_changes = 0;
+
+/*
+ * Publish the size and owner of every relation in the model, so that
+ * monitoring can read them from quota.relation_sizes, instead of stat()ing
+ * all the files again with pg_total_relation_size().
+ *
+ * The array is rebuilt from scratch, but only after a refresh that changed
+ * something. If the DSA area cannot be grown, the previous array stays.
+ */
+void
+PublishRelationSizes(void)
+{
+	relentry_iterator riter;
+	RelMapEntry *mapentry;
+	RelationSizeRecord *records;
+	dsa_pointer newrelsizes;
+	dsa_pointer oldrelsizes;
+	int64		nrels;
+	int64		i;
+	int			forknum;
+
+	if (!pg_quota_publish_relation_sizes)
+	{
+		/* Drop the array, if it was just turned off */
+		if (relsizes_area == NULL)
+			return;
+
+		LWLockAcquire(shared->relsizes_lock, LW_EXCLUSIVE);
+		MyDbState->relsizes_area = DSM_HANDLE_INVALID;
+		MyDbState->relsizes = InvalidDsaPointer;
+		MyDbState->num_relsizes = 0;
+		LWLockRelease(shared->relsizes_lock);
+
+		/* detaching destroys the area, once no backend is attached to it */
+		dsa_detach(relsizes_area);
+		relsizes_area = NULL;
+		return;
+	}
+
+	if (relsizes_area != NULL && relsizes_changes == model_changes)
+		return;
+
+	if (relsizes_area == NULL)
+	{
+		/* Don't let it go away at the end of a transaction */
+		LWLockRegisterTranche(shared->relsizes_tranche, "pg_quota relation sizes");
+		relsizes_area = dsa_create(shared->relsizes_tranche);
+		dsa_pin_mapping(relsizes_area);
+	}
+
+	nrels = relfilenode_to_relentry_map->members;
+	newrelsizes = dsa_allocate_extended(relsizes_area,
+										Max(nrels, 1) * sizeof(RelationSizeRecord),
+										DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(newrelsizes))
+	{
+		elog(LOG, "could not allocate memory for the sizes of %ld relations",
+			 (long) nrels);
+		return;
+	}
+
+	records = (RelationSizeRecord *) dsa_get_address(relsizes_area, newrelsizes);
+	i = 0;
+	relentry_start_iterate(relfilenode_to_relentry_map, &riter);
+	while ((mapentry = relentry_iterate(relfilenode_to_relentry_map, &riter)) != NULL)
+	{
+		RelSizeEntry *relentry = mapentry->entry;
+
+		records[i].spcid = relentry->rnode.spcNode;
+		records[i].relfilenode = relentry->rnode.relNode;
+		records[i].owner = relentry->owner;
+		for (forknum = 0; forknum <= MAX_FORKNUM; forknum++)
+			records[i].forksize[forknum] = relentry->forksize[forknum];
+		i++;
+	}
+	Assert(i == nrels);
+
+	LWLockAcquire(shared->relsizes_lock, LW_EXCLUSIVE);
+	oldrelsizes = MyDbState->relsizes;
+	MyDbState->relsizes_area = dsa_get_handle(relsizes_area);
+	MyDbState->relsizes = newrelsizes;
+	MyDbState->num_relsizes = nrels;
+	MyDbState->relsizes_time = GetCurrentTimestamp();
+	LWLockRelease(shared->relsizes_lock);
+
+	/* No reader can be looking at the old array anymore */
+	if (DsaPointerIsValid(oldrelsizes))
+		dsa_free(relsizes_area, oldrelsizes);
+
+	relsizes_changes = model_changes;
+}
+
+/*
+ * Update the owner of a relation in the model.
+ */
+void
+UpdateRelOwner(RelFileNode *rnode, Oid owner)
+{
+	RelSizeEntry *relentry;
+	int			forknum;
+
+	relentry = LookupRelSizeEntry(rnode);
+	if (!relentry)
+		return;
+
+	if (relentry->owner == owner)
+		return;
+
+	/* Subtract the old size from the old owner's total. */
+	if (relentry->owner != InvalidOid)
+	{
+		for (forknum = 0; forknum <= MAX_FORKNUM; forknum++)
+			AddRoleDelta(relentry->owner, rnode->spcNode, forknum,
+						 -relentry->forksize[forknum]);
+	}
+	else
+	{
+		dlist_delete(&relentry->orphan_node);
+		num_orphans--;
+		if (relentry->stale_orphan)
+			num_stale_orphans--;
+	}
+
+	/* And add it to the new owner's total. */
+	relentry->owner = owner;
+	model_changes++;
+	if (owner != InvalidOid)
+	{
+		for (forknum = 0; forknum <= MAX_FORKNUM; forknum++)
+			AddRoleDelta(owner, rnode->spcNode, forknum,
+						 relentry->forksize[forknum]);
+	}
+	else
+	{
+		dlist_push_head(&orphanRels, &relentry->orphan_node);
+		num_orphans++;
+		relentry->stale_orphan = false;
+	}
+}
+
+/*
+ * Update the quota for a role.
+ *
+ * This update the quota field in the in-memory model. This is used when the
+ * quotas are loaded from the cofiguration table. A negative 'newquota' means
+ * that the role has no quota. 'spcid' is the tablespace the quota applies to,
+ * or InvalidOid for a database-wide quota.
+ *
+ * Returns false if the quota could not be stored, because the shared memory
+ * table is full.
+ */
+bool
+UpdateQuota(Oid owner, Oid spcid, int64 newquota)
+{
+	RoleSizeEntry *rolentry;
+	RoleSizeEntryKey key;
+	uint32		hashcode;
+	LWLock	   *lock;
+
+	key.rolid = owner;
+	key.dbid = MyDatabaseId;
+	key.spcid = spcid;
+	hashcode = get_hash_value(role_totals_map, (void *) &key);
+	lock = RoleTotalsPartitionLock(hashcode);
+
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+
+	/*
+	 * When removing a quota, don't bother creating an entry for a role we
+	 * haven't seen yet.
+	 */
+	if (newquota < 0)
+		rolentry = (RoleSizeEntry *) hash_search_with_hash_value(role_totals_map,
+																 (void *) &key,
+																 hashcode,
+																 HASH_FIND, NULL);
+	else
+		rolentry = EnterRoleSizeEntry(&key, hashcode);
+
+	if (rolentry)
+	{
+		rolentry->quota = newquota;
+		CheckRoleExceeded(rolentry);
+	}
+
+	LWLockRelease(lock);
+
+	role_tiers_stale = true;
+
+	if (eviction_needed)
+		EvictUnusedRoleEntries();
+	RebuildExceededSet();
+
+	return (rolentry != NULL || newquota < 0);
+}
+
+/*
+ * Returns the version number of the quota configuration of this worker's
+ * database. It changes whenever quota.config is modified.
+ */
+uint64
+GetQuotaConfigVersion(void)
+{
+	return pg_atomic_read_u64(&MyDbState->config_version);
+}
+
+/*
+ * Callback for scan_relation_owners(), used by UpdateOrphans().
+ */
+static void
+bulk_owner_callback(RelFileNode *rnode, Oid owner)
+{
+	RelSizeEntry *relentry;
+
+	relentry = LookupRelSizeEntry(rnode);
+	if (!relentry)
+		return;
+
+	if (relentry->recheck)
+	{
+		dlist_delete(&relentry->recheck_node);
+		relentry->recheck = false;
+		num_recheck--;
+	}
+
+	/* this also takes it off the orphan list, if it was there */
+	if (relentry->owner != owner)
+		UpdateRelOwner(rnode, owner);
+}
+
+/*
+ * Scan the list of relations that without owner information, and get their
+ * owners.
+ */
+void
+UpdateOrphans(void)
+{
+	dlist_mutable_iter iter;
+	HASH_SEQ_STATUS hiter;
+	Oid		   *relid;
+	int			i;
+	bool		bulk;
+	bool		retry;
+	int			pending;
+
+	/*
+	 * Re-resolve the owners of relations that have been modified. The
+	 * invalidations were processed when our transaction started.
+	 */
+	bulk = all_relids_changed;
+	all_relids_changed = false;
+
+	/* Look up the stale orphans again, too, this time? */
+	retry = bulk || ++orphan_passes >= STALE_ORPHAN_RETRY_PASSES;
+	if (retry)
+		orphan_passes = 0;
+	pending = num_orphans + num_recheck;
+	if (!retry)
+		pending -= num_stale_orphans;
+
+	hash_seq_init(&hiter, changed_relids_map);
+	while ((relid = hash_seq_search(&hiter)) != NULL)
+	{
+		RelFileNode rnode;
+		Oid			owner;
+
+		if (!bulk && get_relid_rnode_owner(*relid, &rnode, &owner))
+		{
+			RelSizeEntry *relentry;
+
+			relentry = LookupRelSizeEntry(&rnode);
+			if (relentry && relentry->owner != owner)
+			{
+				elog(DEBUG1, "owner of relation %u changed to %u", *relid, owner);
+				UpdateRelOwner(&rnode, owner);
+			}
+		}
+		(void) hash_search(changed_relids_map, (void *) relid,
+						   HASH_REMOVE, NULL);
+	}
+
+	/*
+	 * When there are a lot of relations to look up, like after startup, it's
+	 * much cheaper to read through pg_class once, and look up each row in our
+	 * hash table, than to do two catalog lookups for each relation. The scan
+	 * also updates the owners of all the other relations.
+	 */
+	if (bulk || pending >= BULK_OWNER_THRESHOLD)
+	{
+		elog(DEBUG1, "resolving owners of %d relations with a scan of pg_class",
+			 pending);
+
+		scan_relation_owners(bulk_owner_callback);
+
+		/*
+		 * Any relations still waiting for a recheck were not found in
+		 * pg_class. Forget their old owner.
+		 */
+		while (!dlist_is_empty(&recheckRels))
+		{
+			RelSizeEntry *relentry = (RelSizeEntry *)
+				dlist_container(RelSizeEntry, recheck_node,
+								dlist_pop_head_node(&recheckRels));
+
+			relentry->recheck = false;
+			num_recheck--;
+			UpdateRelOwner(&relentry->rnode, InvalidOid);
+		}
+
+		/* Whatever is left wasn't found in pg_class */
+		dlist_foreach_modify(iter, &orphanRels)
+		{
+			RelSizeEntry *relentry = (RelSizeEntry *)
+				dlist_container(RelSizeEntry, orphan_node, iter.cur);
+
+			relentry->stale_orphan = true;
+		}
+		num_stale_orphans = num_orphans;
+
+		PublishRoleDeltas(false);
+		return;
+	}
+
+	dlist_foreach_modify(iter, &orphanRels)
+	{
+		RelSizeEntry *relentry = (RelSizeEntry *)
+			dlist_container(RelSizeEntry, orphan_node, iter.cur);
+		Oid			owner;
+
+		if (relentry->stale_orphan && !retry)
+			continue;
+
+		owner = get_relfilenode_owner(&relentry->rnode);
+		if (owner)
+		{
+			UpdateRelOwner(&relentry->rnode, owner);
+
+			/* Note: UpdateRelOwner() unlinks the entry from this list */
+
+			elog(DEBUG1, "updated owner of relation %u/%u/%u to %u",
+				 relentry->rnode.dbNode, relentry->rnode.spcNode, relentry->rnode.relNode, owner);
+		}
+		else if (!relentry->stale_orphan)
+		{
+			relentry->stale_orphan = true;
+			num_stale_orphans++;
+		}
+	}
+
+	/*
+	 * Verify some of the owners loaded from the snapshot. They were correct
+	 * when the snapshot was written, so there's no hurry; do a batch on each
+	 * pass, to spread out the cost.
+	 */
+	for (i = 0; i < RECHECK_BATCH_SIZE && !dlist_is_empty(&recheckRels); i++)
+	{
+		RelSizeEntry *relentry = (RelSizeEntry *)
+			dlist_container(RelSizeEntry, recheck_node,
+							dlist_pop_head_node(&recheckRels));
+		Oid			owner;
+
+		relentry->recheck = false;
+		num_recheck--;
+
+		/* If it's not found, UpdateRelOwner() puts it on the orphan list */
+		owner = get_relfilenode_owner(&relentry->rnode);
+		UpdateRelOwner(&relentry->rnode, owner);
+	}
+
+	PublishRoleDeltas(false);
+}
+
+/*
+ * Recompute the totals of all group roles from their members' usage, if
+ * memberships have changed, or some changes could not be rolled up, since
+ * the last call.
+ *
+ * Must be called in a transaction.
+ */
+void
+UpdateRoleRollups(void)
+{
+	HASHCTL		hash_ctl;
+	HTAB	   *rollups_map;
+	HASH_SEQ_STATUS iter;
+	RoleSizeEntry *rolentry;
+	RoleDeltaEntry *delentry;
+	RoleRollupEntry *rollup;
+	RoleRollupEntry **roles;
+	long		nroles;
+	long		i;
+	bool		found;
+
+	if (!role_rollups_stale)
+		return;
+
+	/*
+	 * Clear the flag first, so that if memberships change again while we're
+	 * at it, we'll come back.
+	 */
+	role_rollups_stale = false;
+	if (role_ancestors_map)
+	{
+		MemoryContextReset(RoleAncestorsContext);
+		role_ancestors_map = NULL;
+	}
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(RoleSizeEntryKey);
+	hash_ctl.entrysize = sizeof(RoleRollupEntry);
+	hash_ctl.hcxt = CurrentMemoryContext;
+
+	rollups_map = hash_create("role rollups map",
+							  1024,
+							  &hash_ctl,
+							  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/*
+	 * Collect each role's own usage and current total, counting the changes
+	 * that haven't been published yet.
+	 */
+	LockRoleTotals(LW_SHARED);
+	hash_seq_init(&iter, role_totals_map);
+	while ((rolentry = hash_seq_search(&iter)) != NULL)
+	{
+		if (rolentry->key.dbid != MyDatabaseId)
+			continue;
+
+		rollup = (RoleRollupEntry *) hash_search(rollups_map,
+												 (void *) &rolentry->key,
+												 HASH_ENTER, NULL);
+		rollup->ownsize = rolentry->ownsize;
+		rollup->totalsize = rolentry->totalsize;
+		rollup->target = 0;
+	}
+	UnlockRoleTotals();
+
+	hash_seq_init(&iter, role_deltas_map);
+	while ((delentry = hash_seq_search(&iter)) != NULL)
+	{
+		rollup = (RoleRollupEntry *) hash_search(rollups_map,
+												 (void *) &delentry->key,
+												 HASH_ENTER, &found);
+		if (!found)
+		{
+			rollup->ownsize = 0;
+			rollup->totalsize = 0;
+			rollup->target = 0;
+		}
+		rollup->ownsize += delentry->owndelta;
+		rollup->totalsize += delentry->delta;
+	}
+
+	/* Roll up each role's own usage to itself, and its groups */
+	nroles = hash_get_num_entries(rollups_map);
+	roles = (RoleRollupEntry **) palloc(nroles * sizeof(RoleRollupEntry *));
+	i = 0;
+	hash_seq_init(&iter, rollups_map);
+	while ((rollup = hash_seq_search(&iter)) != NULL)
+		roles[i++] = rollup;
+	Assert(i == nroles);
+
+	for (i = 0; i < nroles; i++)
+	{
+		Oid		   *ancestors;
+		int			nancestors;
+		int			j;
+
+		roles[i]->target += roles[i]->ownsize;
+
+		/* this also caches the ancestors of every role, for the next pass */
+		ancestors = GetRoleAncestors(roles[i]->key.rolid, &nancestors);
+		for (j = 0; j < nancestors; j++)
+		{
+			RoleSizeEntryKey key;
+
+			key.rolid = ancestors[j];
+			key.dbid = MyDatabaseId;
+			key.spcid = roles[i]->key.spcid;
+			rollup = (RoleRollupEntry *) hash_search(rollups_map,
+													 (void *) &key,
+													 HASH_ENTER, &found);
+			if (!found)
+			{
+				rollup->ownsize = 0;
+				rollup->totalsize = 0;
+				rollup->target = 0;
+			}
+			rollup->target += roles[i]->ownsize;
+		}
+	}
+	pfree(roles);
+
+	/* Apply the differences */
+	hash_seq_init(&iter, rollups_map);
+	while ((rollup = hash_seq_search(&iter)) != NULL)
+	{
+		if (rollup->target != rollup->totalsize)
+		{
+			elog(DEBUG1, "rolled-up total of role %u in tablespace %u changed from " INT64_FORMAT " to " INT64_FORMAT,
+				 rollup->key.rolid, rollup->key.spcid,
+				 rollup->totalsize, rollup->target);
+			AddRoleTotalDelta(rollup->key.rolid, rollup->key.spcid,
+							  rollup->target - rollup->totalsize, false);
+		}
+	}
+	hash_destroy(rollups_map);
+
+	PublishRoleDeltas(false);
+}
+
+/*
+ * Count 'size' bytes of temporary space in tablespace 'spcid' toward the
+ * temporary usage of the role connected as backend 'proc', and its groups.
+ */
+static void
+AddTempUsage(PGPROC *proc, Oid spcid, int64 size)
+{
+	Oid			roleid;
+	Oid		   *ancestors;
+	int			nancestors;
+	int			i;
+
+	/* Only count sessions of our own database, and not e.g. autovacuum */
+	if (proc == NULL || proc->databaseId != MyDatabaseId)
+		return;
+	roleid = proc->roleId;
+	if (!OidIsValid(roleid))
+		return;
+
+	ancestors = GetRoleAncestors(roleid, &nancestors);
+	for (i = -1; i < nancestors; i++)
+	{
+		RoleSizeEntryKey key;
+		TempTotalEntry *total;
+		bool		found;
+
+		key.rolid = (i < 0) ? roleid : ancestors[i];
+		key.dbid = MyDatabaseId;
+
+		key.spcid = InvalidOid;
+		total = (TempTotalEntry *) hash_search(temp_totals_map, (void *) &key,
+											   HASH_ENTER, &found);
+		if (!found)
+			total->size = total->newsize = 0;
+		total->newsize += size;
+
+		key.spcid = spcid;
+		total = (TempTotalEntry *) hash_search(temp_totals_map, (void *) &key,
+											   HASH_ENTER, &found);
+		if (!found)
+			total->size = total->newsize = 0;
+		total->newsize += size;
+	}
+}
+
+/*
+ * Count the temporary files in one pgsql_tmp directory of tablespace
+ * 'spcid'.
+ *
+ * The files are named pgsql_tmp<pid>.<n>, after the backend that created
+ * them. Parallel queries put their files in pgsql_tmp<pid>.<n>.sharedfileset
+ * directories, named after the leader; 'dirpid' is that pid when we're
+ * looking into one of them, and 0 at the top level. There's no deeper
+ * nesting than that.
+ */
+static void
+ScanTempFilesDir(const char *dirpath, Oid spcid, int dirpid)
+{
+	DIR		   *dirdesc;
+	struct dirent *dirent;
+	char		path[MAXPGPATH];
+
+	dirdesc = AllocateDir(dirpath);
+	if (dirdesc == NULL)
+	{
+		/* no temporary files have been created in this tablespace yet */
+		if (errno != ENOENT)
+			ereport(DEBUG1,
+					(errcode_for_file_access(),
+					 errmsg("could not open directory \"%s\": %m", dirpath)));
+		return;
+	}
+
+	while ((dirent = ReadDirExtended(dirdesc, dirpath, DEBUG1)) != NULL)
+	{
+		struct stat statbuf;
+		int			pid = dirpid;
+
+		if (strcmp(dirent->d_name, ".") == 0 ||
+			strcmp(dirent->d_name, "..") == 0)
+			continue;
+
+		if (dirpid == 0 &&
+			sscanf(dirent->d_name, PG_TEMP_FILE_PREFIX "%d", &pid) != 1)
+			continue;
+
+		snprintf(path, MAXPGPATH, "%s/%s", dirpath, dirent->d_name);
+		if (lstat(path, &statbuf) != 0)
+			continue;			/* removed already */
+
+		if (S_ISDIR(statbuf.st_mode))
+		{
+			if (dirpid == 0)
+				ScanTempFilesDir(path, spcid, pid);
+		}
+		else if (S_ISREG(statbuf.st_mode))
+			AddTempUsage(BackendPidGetProc(pid), spcid, statbuf.st_size);
+	}
+
+	FreeDir(dirdesc);
+}
+
+/*
+ * Recompute the temporary space usage of each role, and publish the changes.
+ *
+ * Temporary space is attributed to the role the backend that uses it is
+ * connected as, in the tablespace it's in. It consists of:
+ *
+ * - the files of temporary relations, t<backend id>_<relfilenode>, in our
+ *	 database's directories. The scans already list those directories, so
+ *	 they remember the files they come across, see NoteTempRelFile(), and we
+ *	 only need to stat() those here.
+ *
+ * - temporary files, for sorts, hashes etc., in the pgsql_tmp directory of
+ *	 each tablespace. Those are listed here, which costs a readdir() of a
+ *	 directory that's normally near-empty, and a stat() for each live file.
+ *	 Only backends connected to our database are counted, so with several
+ *	 workers, each file is counted only once.
+ *
+ * Must be called in a transaction, to look up the groups of each role.
+ */
+void
+UpdateTempUsage(void)
+{
+	HASH_SEQ_STATUS iter;
+	TempRelFileEntry *relfile;
+	TempTotalEntry *total;
+	DIR		   *dirdesc;
+	struct dirent *dirent;
+	char		path[MAXPGPATH];
+	bool		changed = false;
+
+	if (!pg_quota_track_temp)
+	{
+		/* Forget what we had, if tracking was just turned off */
+		if (hash_get_num_entries(temp_totals_map) == 0)
+			return;
+
+		hash_seq_init(&iter, temp_rel_files_map);
+		while ((relfile = hash_seq_search(&iter)) != NULL)
+			(void) hash_search(temp_rel_files_map, (void *) relfile->path,
+							   HASH_REMOVE, NULL);
+	}
+
+	hash_seq_init(&iter, temp_totals_map);
+	while ((total = hash_seq_search(&iter)) != NULL)
+		total->newsize = 0;
+
+	/* Temporary relations */
+	hash_seq_init(&iter, temp_rel_files_map);
+	while ((relfile = hash_seq_search(&iter)) != NULL)
+	{
+		struct stat statbuf;
+
+		if (stat(relfile->path, &statbuf) != 0)
+		{
+			(void) hash_search(temp_rel_files_map, (void *) relfile->path,
+							   HASH_REMOVE, NULL);
+			continue;
+		}
+		AddTempUsage(BackendIdGetProc(relfile->backend), relfile->spcid,
+					 statbuf.st_size);
+	}
+
+	/* Temporary files */
+	if (pg_quota_track_temp)
+	{
+		snprintf(path, MAXPGPATH, "base/%s", PG_TEMP_FILES_DIR);
+		ScanTempFilesDir(path, DEFAULTTABLESPACE_OID, 0);
+
+		dirdesc = AllocateDir("pg_tblspc");
+		while ((dirent = ReadDirExtended(dirdesc, "pg_tblspc", DEBUG1)) != NULL)
+		{
+			Oid			spcid;
+
+			if (sscanf(dirent->d_name, "%u", &spcid) != 1)
+				continue;
+
+			snprintf(path, MAXPGPATH, "pg_tblspc/%s/%s/%s",
+					 dirent->d_name, TABLESPACE_VERSION_DIRECTORY,
+					 PG_TEMP_FILES_DIR);
+			ScanTempFilesDir(path, spcid, 0);
+		}
+		FreeDir(dirdesc);
+	}
+
+	/* Publish the differences */
+	hash_seq_init(&iter, temp_totals_map);
+	while ((total = hash_seq_search(&iter)) != NULL)
+	{
+		if (total->newsize != total->size)
+		{
+			GetRoleDeltaEntry(total->key.rolid, total->key.spcid)->tempdelta +=
+				total->newsize - total->size;
+			total->size = total->newsize;
+			changed = true;
+		}
+		if (total->size == 0)
+			(void) hash_search(temp_totals_map, (void *) &total->key,
+							   HASH_REMOVE, NULL);
+	}
+
+	if (changed)
+		PublishRoleDeltas(false);
+}
+
+/*
+ * Recompute whether each role of our database has exceeded its quota, after
+ * pg_quota.temp_counts_toward_quota has changed.
+ */
+void
+RecheckQuotas(void)
+{
+	HASH_SEQ_STATUS iter;
+	RoleSizeEntry *rolentry;
+
+	LockRoleTotals(LW_EXCLUSIVE);
+	hash_seq_init(&iter, role_totals_map);
+	while ((rolentry = hash_seq_search(&iter)) != NULL)
+	{
+		if (rolentry->key.dbid == MyDatabaseId)
+			CheckRoleExceeded(rolentry);
+	}
+	UnlockRoleTotals();
+
+	role_tiers_stale = true;
+	RebuildExceededSet();
+}
+
+/*
+ * Path of the snapshot file for this worker's database.
+ */
+static void
+snapshot_path(char *path)
+{
+	snprintf(path, MAXPGPATH, "%s/pg_quota.%u.snap",
+			 PGSTAT_STAT_PERMANENT_DIRECTORY, MyDatabaseId);
+}
+
+/*
+ * Write a snapshot of the model to disk.
+ *
+ * The snapshot is written to a temporary file first, and renamed into place,
+ * so that a crash in the middle leaves the old snapshot intact.
+ */
+void
+write_fs_model_snapshot(void)
+{
+	char		path[MAXPGPATH];
+	char		tmppath[MAXPGPATH];
+	FILE	   *file;
+	SnapshotHeader hdr;
+	SnapshotFileRecord rec;
+	fsentry_iterator fiter;
+	FileSizeEntry *fsentry;
+	pg_crc32c	crc;
+
+	snapshot_path(path);
+	snprintf(tmppath, MAXPGPATH, "%s.tmp", path);
+
+	file = AllocateFile(tmppath, PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	hdr.magic = PG_QUOTA_SNAPSHOT_MAGIC;
+	hdr.version = PG_QUOTA_SNAPSHOT_VERSION;
+	hdr.dbid = MyDatabaseId;
+	hdr.nfiles = file_to_fsentry_map->members;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, &hdr, sizeof(hdr));
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1)
+		goto error;
+
+	/* zero the padding, so that the CRC is deterministic */
+	memset(&rec, 0, sizeof(rec));
+
+	fsentry_start_iterate(file_to_fsentry_map, &fiter);
+	while ((fsentry = fsentry_iterate(file_to_fsentry_map, &fiter)) != NULL)
+	{
+		rec.key = fsentry->key;
+		rec.owner = fsentry->parent->owner;
+		rec.filesize = fsentry->filesize;
+
+		COMP_CRC32C(crc, &rec, sizeof(rec));
+		if (fwrite(&rec, sizeof(rec), 1, file) != 1)
+			goto error;
+	}
+
+	FIN_CRC32C(crc);
+	if (fwrite(&crc, sizeof(crc), 1, file) != 1)
+		goto error;
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	/* durable_rename() reports its own errors */
+	(void) durable_rename(tmppath, path, LOG);
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m", tmppath)));
+	if (file)
+		FreeFile(file);
+	unlink(tmppath);
+}
+
+/*
+ * Read the records of a snapshot file. If 'apply' is false, just verify the
+ * CRC; otherwise load them into the model.
+ *
+ * Returns false if the file is truncated, or the CRC doesn't match.
+ */
+static bool
+read_snapshot_records(FILE *file, SnapshotHeader *hdr, bool apply)
+{
+	SnapshotFileRecord rec;
+	pg_crc32c	crc;
+	pg_crc32c	filecrc;
+	uint32		i;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, hdr, sizeof(SnapshotHeader));
+
+	for (i = 0; i < hdr->nfiles; i++)
+	{
+		RelFileNode rnode;
+		RelSizeEntry *relentry;
+
+		if (fread(&rec, sizeof(rec), 1, file) != 1)
+			return false;
+		COMP_CRC32C(crc, &rec, sizeof(rec));
+
+		if (!apply)
+			continue;
+
+		rnode.spcNode = rec.key.spcNode;
+		rnode.dbNode = MyDatabaseId;
+		rnode.relNode = rec.key.relNode;
+		UpdateFileSize(&rnode, rec.key.forknum, rec.key.segno, rec.filesize);
+
+		/*
+		 * The owner might have changed while we were not running. Use the
+		 * saved one for now, but verify it later.
+		 */
+		if (OidIsValid(rec.owner))
+		{
+			relentry = LookupRelSizeEntry(&rnode);
+			Assert(relentry);
+			if (!OidIsValid(relentry->owner))
+				UpdateRelOwner(&rnode, rec.owner);
+			if (!relentry->recheck)
+			{
+				relentry->recheck = true;
+				dlist_push_tail(&recheckRels, &relentry->recheck_node);
+				num_recheck++;
+			}
+		}
+	}
+
+	if (fread(&filecrc, sizeof(filecrc), 1, file) != 1)
+		return false;
+	FIN_CRC32C(crc);
+	if (!EQ_CRC32C(crc, filecrc))
+		return false;
+
+	/* there should be nothing after the CRC */
+	if (fgetc(file) != EOF)
+		return false;
+
+	return true;
+}
+
+/*
+ * Load the model from the snapshot file, written by an earlier worker.
+ *
+ * The file sizes in the snapshot are stale, but they are a much better
+ * starting point than nothing. The next full scan corrects them, and removes
+ * files that were deleted in the meanwhile. The owners are verified against
+ * pg_class a batch at a time, in UpdateOrphans().
+ *
+ * Returns true if the snapshot was loaded.
+ */
+bool
+load_fs_model_snapshot(void)
+{
+	char		path[MAXPGPATH];
+	FILE	   *file;
+	SnapshotHeader hdr;
+
+	snapshot_path(path);
+
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m", path)));
+		return false;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+		hdr.magic != PG_QUOTA_SNAPSHOT_MAGIC ||
+		hdr.version != PG_QUOTA_SNAPSHOT_VERSION ||
+		hdr.dbid != MyDatabaseId)
+		goto invalid;
+
+	/*
+	 * Verify the whole file before touching the model, so that we don't need
+	 * to undo anything if it's corrupt.
+	 */
+	if (!read_snapshot_records(file, &hdr, false))
+		goto invalid;
+
+	if (fseek(file, sizeof(hdr), SEEK_SET) != 0)
+		goto invalid;
+	if (!read_snapshot_records(file, &hdr, true))
+	{
+		/* can't happen, unless the file changed under us */
+		FreeFile(file);
+		elog(ERROR, "snapshot file \"%s\" changed while reading it", path);
+	}
+
+	FreeFile(file);
+
+	PublishRoleDeltas(false);
+	model_populated = true;
+
+	ereport(LOG,
+			(errmsg("loaded %u files from pg_quota snapshot \"%s\"",
+					hdr.nfiles, path)));
+	return true;
+
+invalid:
+	ereport(LOG,
+			(errmsg("ignoring invalid pg_quota snapshot file \"%s\"", path)));
+	FreeFile(file);
+	return false;
+}
+
+
+/* ---------------------------------------------------------------------------
+ * Functions for use in backend processes.
+ * ---------------------------------------------------------------------------
+ */
+
+/*
+ * Is an "exceeded" entry with projected time 'exceed_at' in effect already?
+ * If not, remember the time when it will be in *recheck_at.
+ */
+static bool
+ExceededNow(TimestampTz exceed_at, TimestampTz *recheck_at)
+{
+	if (exceed_at == 0 || exceed_at <= GetCurrentTimestamp())
+		return true;
+
+	if (*recheck_at == 0 || exceed_at < *recheck_at)
+		*recheck_at = exceed_at;
+	return false;
+}
+
+/*
+ * Look up whether a role has exceeded a quota, in the shared hash table.
+ */
+static bool
+RoleExceededLocked(Oid owner, Oid spcid, TimestampTz *recheck_at)
+{
+	RoleSizeEntry *rolentry;
+	RoleSizeEntryKey key;
+	uint32		hashcode;
+	LWLock	   *lock;
+	bool		result;
+
+	key.rolid = owner;
+	key.dbid = MyDatabaseId;
+	key.spcid = spcid;
+	hashcode = get_hash_value(role_totals_map, (void *) &key);
+	lock = RoleTotalsPartitionLock(hashcode);
+
+	LWLockAcquire(lock, LW_SHARED);
+
+	rolentry = (RoleSizeEntry *) hash_search_with_hash_value(role_totals_map,
+															 (void *) &key,
+															 hashcode,
+															 HASH_FIND, NULL);
+	/* User has a quota, and it's been exceeded? */
+	result = (rolentry && rolentry->exceeded &&
+			  ExceededNow(rolentry->exceed_at, recheck_at));
+
+	LWLockRelease(lock);
+
+	return result;
+}
+
+/*
+ * Is 'roleid' either 'owner', or one of its ancestors?
+ */
+static inline bool
+RoleMatches(Oid roleid, Oid owner, Oid *ancestors, int nancestors)
+{
+	int			i;
+
+	if (roleid == owner)
+		return true;
+	for (i = 0; i < nancestors; i++)
+	{
+		if (roleid == ancestors[i])
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Returns 'true', if neither the database-wide quota for 'owner', nor its
+ * quota in tablespace 'spcid', nor those of any group it's a member of,
+ * have been exceeded yet.
+ *
+ * This is called for every INSERT and COPY, so it needs to be fast. We first
+ * look at the lock-free "exceeded" array, and only if that has overflowed,
+ * fall back to looking up the roles in the shared hash table. All the quotas
+ * are checked with the same pass over the array. The owner's groups come
+ * from a backend-local cache, so there's no catalog access here, except
+ * after a change to pg_auth_members.
+ *
+ * If the owner is projected to exceed a quota soon, but hasn't yet, the
+ * result is only valid until then; *recheck_at is set to that time.
+ * Otherwise it's set to 0.
+ */
+bool
+CheckQuota(Oid owner, Oid spcid, TimestampTz *recheck_at)
+{
+	Oid		   *ancestors;
+	int			nancestors;
+	int			j;
+
+	*recheck_at = 0;
+
+	if (!role_totals_map)
+		return true;
+
+	ancestors = GetRoleAncestors(owner, &nancestors);
+
+	for (;;)
+	{
+		uint64		seq;
+		bool		overflow;
+		bool		exceeded = false;
+		int			num_exceeded;
+		int			i;
+
+		*recheck_at = 0;
+		seq = pg_atomic_read_u64(&shared->exceeded_seq);
+		if (seq & 1)
+		{
+			/* a writer is busy modifying the array, wait */
+			pg_spin_delay();
+			continue;
+		}
+		pg_read_barrier();
+
+		overflow = shared->exceeded_overflow;
+		num_exceeded = Min(shared->num_exceeded, MAX_EXCEEDED_ROLES);
+		for (i = 0; i < num_exceeded; i++)
+		{
+			ExceededRole *ex = &shared->exceeded[i];
+
+			if (ex->key.dbid == MyDatabaseId &&
+				(ex->key.spcid == InvalidOid ||
+				 ex->key.spcid == spcid) &&
+				RoleMatches(ex->key.rolid, owner, ancestors, nancestors) &&
+				ExceededNow(ex->exceed_at, recheck_at))
+			{
+				exceeded = true;
+				break;
+			}
+		}
+
+		pg_read_barrier();
+		if (pg_atomic_read_u64(&shared->exceeded_seq) != seq)
+			continue;			/* array was modified while we read it, retry */
+
+		if (exceeded)
+			return false;
+		if (!overflow)
+			return true;
+		break;
+	}
+
+	/* The array is incomplete, need to check the hash table. */
+	for (j = -1; j < nancestors; j++)
+	{
+		Oid			roleid = (j < 0) ? owner : ancestors[j];
+
+		if (RoleExceededLocked(roleid, InvalidOid, recheck_at))
+			return false;
+		if (OidIsValid(spcid) && RoleExceededLocked(roleid, spcid, recheck_at))
+			return false;
+	}
+	return true;
+}
+
+/* Quota checks done by this backend, not yet added to MyDbState */
+static uint64 pending_checks = 0;
+static uint64 pending_rejections = 0;
+
+static void FlushCheckCounts(void);
+
+static void
+backend_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			FlushCheckCounts();
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Register backend_xact_callback(), if not done already.
+ */
+static void
+RegisterBackendXactCallback(void)
+{
+	static bool registered = false;
+
+	if (!registered)
+	{
+		RegisterXactCallback(backend_xact_callback, NULL);
+		registered = true;
+	}
+}
+
+/*
+ * Find the shared state of the current database, in a backend. Returns false
+ * if there's no worker for this database.
+ */
+static bool
+LookupMyDbState(void)
+{
+	if (!MyDbState || MyDbState->dbid != MyDatabaseId)
+	{
+		LWLockAcquire(shared->lock, LW_SHARED);
+		MyDbState = (QuotaDbState *) hash_search(db_state_map,
+												 (void *) &MyDatabaseId,
+												 HASH_FIND, NULL);
+		LWLockRelease(shared->lock);
+	}
+	return MyDbState != NULL;
+}
+
+/*
+ * Count a quota check performed by a backend, for quota.worker_stats.
+ *
+ * To keep the shared counters from becoming a point of contention, the
+ * counts are accumulated locally, and added to the shared counters at the
+ * end of the transaction.
+ */
+void
+CountQuotaCheck(bool rejected)
+{
+	if (!db_state_map)
+		return;
+
+	RegisterBackendXactCallback();
+
+	pending_checks++;
+	if (rejected)
+		pending_rejections++;
+
+	if (pending_checks >= CHECK_COUNT_FLUSH_INTERVAL)
+		FlushCheckCounts();
+}
+
+static void
+FlushCheckCounts(void)
+{
+	QuotaDbState *dbstate;
+
+	if (pending_checks == 0)
+		return;
+
+	/* hold the lock, so that the entry cannot be removed under us */
+	LWLockAcquire(shared->lock, LW_SHARED);
+	dbstate = (QuotaDbState *) hash_search(db_state_map,
+										   (void *) &MyDatabaseId,
+										   HASH_FIND, NULL);
+	if (dbstate)
+	{
+		pg_atomic_fetch_add_u64(&dbstate->num_checks, pending_checks);
+		if (pending_rejections > 0)
+			pg_atomic_fetch_add_u64(&dbstate->num_rejections,
+									pending_rejections);
+	}
+	LWLockRelease(shared->lock);
+	pending_checks = 0;
+	pending_rejections = 0;
+}
+
+/*
+ * Signal the worker for the current database, that the quota configuration
+ * has changed. Called after a transaction that modified quota.config
+ * commits.
+ */
+void
+QuotaConfigChanged(void)
+{
+	QuotaDbState *dbstate;
+
+	if (!db_state_map)
+		return;
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+	dbstate = (QuotaDbState *) hash_search(db_state_map,
+										   (void *) &MyDatabaseId,
+										   HASH_FIND, NULL);
+	if (dbstate)
+		pg_atomic_fetch_add_u64(&dbstate->config_version, 1);
+	LWLockRelease(shared->lock);
+}
+
+/*
+ * Returns the current "quota generation".
+ *
+ * It changes whenever any role crosses its quota, in either direction, so
+ * the result of CheckQuota() can be cached for as long as the generation
+ * stays the same. An odd value means that the set of exceeded roles is being
+ * modified, and the result should not be cached.
+ */
+uint64
+GetQuotaGeneration(void)
+{
+	if (!role_totals_map)
+		return 1;
+
+	return pg_atomic_read_u64(&shared->exceeded_seq);
+}
+
+/*
+ * Function to implement the quota.status view.
+ *
+ * Version 1.0 of the extension declared the function with just the role,
+ * space used and quota, and had no per-tablespace quotas. Until the
+ * extension is updated, return only those columns, and the database-wide
+ * rows.
+ */
+Datum
+get_quota_status(PG_FUNCTION_ARGS)
+{
+#define GET_QUOTA_STATUS_COLS	7
+#define GET_QUOTA_STATUS_COLS_V1_0	3
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS iter;
+	RoleSizeEntry *rolentry;
+	bool		v1_0;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	if (tupdesc->natts == GET_QUOTA_STATUS_COLS_V1_0)
+		v1_0 = true;
+	else if (tupdesc->natts == GET_QUOTA_STATUS_COLS)
+		v1_0 = false;
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("function get_quota_status() has an unexpected result type"),
+				 errhint("Run ALTER EXTENSION pg_quota UPDATE.")));
 
-	while ((fsentry = hash_seq_search(&iter)) != NULL)
-	{
-		if (fsentry->generation != generation)
-		{
-			/*
-			 * We didn't see this file during this scan, so it doesn't
-			 * exist anymore.
-			 */
-			RemoveFileSize(fsentry);
-		}
-	}
-}
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-/*
- * Update the owner of a relation in the model.
- */
-void
-UpdateRelOwner(RelFileNode *rnode, Oid owner)
-{
-	RelSizeEntry *relentry;
-	RoleSizeEntry *rolentry;
-	RoleSizeEntryKey key;
-	bool		found;
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
 
-	relentry = (RelSizeEntry *) hash_search(relfilenode_to_relentry_map,
-											(void *) rnode,
-											HASH_FIND, &found);
-	if (!found)
-		return;
+	MemoryContextSwitchTo(oldcontext);
 
-	if (relentry->owner == owner)
-		return;
+	if (role_totals_map)
+	{
+		LockRoleTotals(LW_SHARED);
 
-	/* Subtract the old size from the old owner's total. */
-	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+		hash_seq_init(&iter, role_totals_map);
+		while ((rolentry = hash_seq_search(&iter)) != NULL)
+		{
+			/* for each row */
+			Datum		values[GET_QUOTA_STATUS_COLS];
+			bool		nulls[GET_QUOTA_STATUS_COLS];
 
-	key.rolid = relentry->owner;
-	key.dbid = MyDatabaseId;
-	rolentry = (RoleSizeEntry *) hash_search(role_totals_map,
-											 (void *) &key,
-											 HASH_FIND, &found);
-	Assert(found == (relentry->owner != InvalidOid));
-	if (found)
-		rolentry->totalsize -= relentry->totalsize;
-	LWLockRelease(shared->lock);
+			/* Ignore entries for other databases. */
+			if (rolentry->key.dbid != MyDatabaseId)
+				continue;
 
-	relentry->owner = owner;
-	if (relentry->owner == InvalidOid)
-		dlist_delete(&relentry->orphan_node);
+			if (v1_0)
+			{
+				if (OidIsValid(rolentry->key.spcid))
+					continue;
 
-	if (owner != InvalidOid)
-	{
-		/* Link to new parent, creating it if it doesn't exist yet. */
-		key.rolid = owner;
-		key.dbid = MyDatabaseId;
+				values[0] = rolentry->key.rolid;
+				nulls[0] = false;
+				values[1] = rolentry->totalsize;
+				nulls[1] = false;
+				values[2] = rolentry->quota;
+				nulls[2] = (rolentry->quota == -1);
 
-		LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+				tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+				continue;
+			}
 
-		rolentry = (RoleSizeEntry *) hash_search(role_totals_map,
-												 (void *) &key,
-												 HASH_ENTER, &found);
-		if (!found)
-		{
-			rolentry->totalsize = 0;
-			rolentry->quota = -1;	/* -1 means no quota */
+			values[0] = rolentry->key.rolid;
+			nulls[0] = false;
+			values[1] = rolentry->key.spcid;
+			nulls[1] = false;
+			values[2] = rolentry->totalsize;
+			nulls[2] = false;
+			if (rolentry->quota != -1)
+			{
+				values[3] = rolentry->quota;
+				nulls[3] = false;
+			}
+			else
+			{
+				values[3] = (Datum) 0;
+				nulls[3] = true;
+			}
+			values[4] = Float8GetDatum(rolentry->growth_rate);
+			nulls[4] = false;
+			if (rolentry->exceeded && rolentry->exceed_at != 0)
+			{
+				values[5] = TimestampTzGetDatum(rolentry->exceed_at);
+				nulls[5] = false;
+			}
+			else
+			{
+				values[5] = (Datum) 0;
+				nulls[5] = true;
+			}
+			values[6] = Int64GetDatum(rolentry->tempsize);
+			nulls[6] = false;
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 		}
-		rolentry->totalsize += relentry->totalsize;
+
+		UnlockRoleTotals();
 	}
-	else
-		dlist_push_head(&orphanRels, &relentry->orphan_node);
 
-	LWLockRelease(shared->lock);
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
 }
 
 /*
- * Update the quota for a role.
- *
- * This update the quota field in the in-memory model. This is used when the
- * quotas are loaded from the cofiguration table.
+ * Function to implement the quota.usage view: the space used by each role in
+ * the current database, by tablespace and fork.
  */
-void
-UpdateQuota(Oid owner, int64 newquota)
+Datum
+get_quota_usage(PG_FUNCTION_ARGS)
 {
-	RoleSizeEntry *rolentry;
-	RoleSizeEntryKey key;
-	bool		found;
+#define GET_QUOTA_USAGE_COLS	(2 + MAX_FORKNUM + 1)
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS iter;
+	RoleUsageEntry *usage;
 
-	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
 
-	key.rolid = owner;
-	key.dbid = MyDatabaseId;
-	rolentry = (RoleSizeEntry *) hash_search(role_totals_map,
-											 (void *) &key,
-											 HASH_ENTER, &found);
-	if (!found)
-		rolentry->totalsize = 0;
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
 
-	rolentry->quota = newquota;
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 
-	LWLockRelease(shared->lock);
-}
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
 
-/*
- * Scan the list of relations that without owner information, and get their
- * owners.
- */
-void
-UpdateOrphans(void)
-{
-	dlist_mutable_iter iter;
+	MemoryContextSwitchTo(oldcontext);
 
-	dlist_foreach_modify(iter, &orphanRels)
+	if (role_usage_map)
 	{
-		RelSizeEntry *relentry = (RelSizeEntry *)
-			dlist_container(RelSizeEntry, orphan_node, iter.cur);
-		Oid			owner;
+		LWLockAcquire(shared->usage_lock, LW_SHARED);
 
-		owner = get_relfilenode_owner(&relentry->rnode);
-		if (owner)
+		hash_seq_init(&iter, role_usage_map);
+		while ((usage = hash_seq_search(&iter)) != NULL)
 		{
-			UpdateRelOwner(&relentry->rnode, owner);
+			Datum		values[GET_QUOTA_USAGE_COLS];
+			bool		nulls[GET_QUOTA_USAGE_COLS];
+			int			i;
 
-			/* Note: UpdateRelOwner() unlinks the entry from this list */
+			/* Ignore entries for other databases. */
+			if (usage->key.dbid != MyDatabaseId)
+				continue;
 
-			elog(DEBUG1, "updated owner of relation %u/%u/%u to %u",
-				 relentry->rnode.dbNode, relentry->rnode.spcNode, relentry->rnode.relNode, owner);
+			memset(nulls, 0, sizeof(nulls));
+			values[0] = ObjectIdGetDatum(usage->key.rolid);
+			values[1] = ObjectIdGetDatum(usage->key.spcid);
+			for (i = 0; i <= MAX_FORKNUM; i++)
+				values[2 + i] = Int64GetDatum(usage->forksize[i]);
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 		}
+
+		LWLockRelease(shared->usage_lock);
 	}
-}
 
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
 
-/* ---------------------------------------------------------------------------
- * Functions for use in backend processes.
- * ---------------------------------------------------------------------------
- */
+	return (Datum) 0;
+}
 
 /*
- * Returns 'true', if the quota for 'owner' has not been exceeded yet.
+ * Function to report how full the shared memory hash table is.
  */
-bool
-CheckQuota(Oid owner)
+Datum
+get_shmem_usage(PG_FUNCTION_ARGS)
 {
-	RoleSizeEntry *rolentry;
-	RoleSizeEntryKey key;
-	bool		result;
+#define GET_SHMEM_USAGE_COLS	3
+	TupleDesc	tupdesc;
+	Datum		values[GET_SHMEM_USAGE_COLS];
+	bool		nulls[GET_SHMEM_USAGE_COLS];
 
-	if (!role_totals_map)
-		return true;
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
 
-	LWLockAcquire(shared->lock, LW_SHARED);
+	memset(nulls, 0, sizeof(nulls));
 
-	key.rolid = owner;
-	key.dbid = MyDatabaseId;
-	rolentry = (RoleSizeEntry *) hash_search(role_totals_map,
-											 (void *) &key,
-											 HASH_FIND, NULL);
-	if (rolentry &&
-		rolentry->quota >= 0 &&
-		rolentry->totalsize > rolentry->quota)
+	if (role_totals_map)
 	{
-		/* User has a quota, and it's been exceeded. */
-		result = false;
+		/* An approximate count is good enough here, so don't bother locking */
+		values[0] = Int64GetDatum(hash_get_num_entries(role_totals_map));
+		values[2] = Int64GetDatum(pg_atomic_read_u64(&shared->overflow_count));
 	}
 	else
 	{
-		result = true;
+		values[0] = Int64GetDatum(0);
+		values[2] = Int64GetDatum(0);
 	}
+	values[1] = Int64GetDatum(pg_quota_max_entries);
 
-	LWLockRelease(shared->lock);
-
-	return result;
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
 
 /*
- * Function to implement the quota.status view.
+ * Function to implement the quota.worker_stats view: the statistics of the
+ * workers of all databases.
  */
 Datum
-get_quota_status(PG_FUNCTION_ARGS)
+get_worker_stats(PG_FUNCTION_ARGS)
 {
-#define GET_QUOTA_STATUS_COLS	3
+#define GET_WORKER_STATS_COLS	(5 + 2 * QUOTA_NUM_PHASES + 8)
 	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	TupleDesc	tupdesc;
 	Tuplestorestate *tupstore;
 	MemoryContext per_query_ctx;
 	MemoryContext oldcontext;
 	HASH_SEQ_STATUS iter;
-	RoleSizeEntry *rolentry;
+	QuotaDbState *dbstate;
 
 	/* check to see if caller supports us returning a tuplestore */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
@@ -786,35 +4838,58 @@ get_quota_status(PG_FUNCTION_ARGS)
 
 	MemoryContextSwitchTo(oldcontext);
 
-	if (role_totals_map)
+	if (db_state_map)
 	{
 		LWLockAcquire(shared->lock, LW_SHARED);
 
-		hash_seq_init(&iter, role_totals_map);
-		while ((rolentry = hash_seq_search(&iter)) != NULL)
+		hash_seq_init(&iter, db_state_map);
+		while ((dbstate = hash_seq_search(&iter)) != NULL)
 		{
-			/* for each row */
-			Datum		values[GET_QUOTA_STATUS_COLS];
-			bool		nulls[GET_QUOTA_STATUS_COLS];
-
-			/* Ignore entries for other databases. */
-			if (rolentry->key.dbid != MyDatabaseId)
-				continue;
-
-			values[0] = rolentry->key.rolid;
-			nulls[0] = false;
-			values[1] = rolentry->totalsize;
-			nulls[1] = false;
-			if (rolentry->quota != -1)
-			{
-				values[2] = rolentry->quota;
-				nulls[2] = false;
-			}
+			Datum		values[GET_WORKER_STATS_COLS];
+			bool		nulls[GET_WORKER_STATS_COLS];
+			QuotaWorkerStats stats;
+			int			i;
+			int			col = 0;
+
+			SpinLockAcquire(&dbstate->stats_mutex);
+			stats = dbstate->stats;
+			SpinLockRelease(&dbstate->stats_mutex);
+
+			memset(nulls, 0, sizeof(nulls));
+			values[col++] = ObjectIdGetDatum(dbstate->dbid);
+			if (dbstate->worker_pid != 0)
+				values[col++] = Int32GetDatum(dbstate->worker_pid);
 			else
+				nulls[col++] = true;
+			if (stats.last_refresh != 0)
+				values[col++] = TimestampTzGetDatum(stats.last_refresh);
+			else
+				nulls[col++] = true;
+			values[col++] = Int64GetDatum(stats.num_refreshes);
+			values[col++] = Int64GetDatum(stats.num_full_scans);
+			for (i = 0; i < QUOTA_NUM_PHASES; i++)
 			{
-				values[2] = (Datum) 0;
-				nulls[2] = true;
+				if (stats.phase_count[i] > 0)
+				{
+					values[col++] = Float8GetDatum(stats.phase_last[i]);
+					values[col++] = Float8GetDatum(stats.phase_total[i] /
+												   stats.phase_count[i]);
+				}
+				else
+				{
+					nulls[col++] = true;
+					nulls[col++] = true;
+				}
 			}
+			values[col++] = Int64GetDatum(stats.files_stated);
+			values[col++] = Int64GetDatum(stats.files_added);
+			values[col++] = Int64GetDatum(stats.files_removed);
+			values[col++] = Int64GetDatum(stats.num_orphans);
+			values[col++] = Int64GetDatum(stats.model_memory);
+			values[col++] = Float8GetDatum(stats.lock_wait);
+			values[col++] = Int64GetDatum(pg_atomic_read_u64(&dbstate->num_checks));
+			values[col++] = Int64GetDatum(pg_atomic_read_u64(&dbstate->num_rejections));
+			Assert(col == GET_WORKER_STATS_COLS);
 
 			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 		}
@@ -827,3 +4902,147 @@ get_quota_status(PG_FUNCTION_ARGS)
 
 	return (Datum) 0;
 }
+
+/*
+ * Function to implement the quota.relation_sizes view: the size of every
+ * relation in the current database, as last published by the worker. This
+ * doesn't touch the filesystem.
+ */
+Datum
+get_relation_sizes(PG_FUNCTION_ARGS)
+{
+#define GET_RELATION_SIZES_COLS	(4 + MAX_FORKNUM + 1 + 2)
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	RelationSizeRecord *records = NULL;
+	int64		nrels = 0;
+	TimestampTz snapshot_time = 0;
+	int64		i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/*
+	 * Copy the array, while holding the lock. The worker cannot free it
+	 * until we release it. If the worker has been restarted since we last
+	 * looked, its area is a different one.
+	 *
+	 * Look the database's entry up afresh, rather than trusting MyDbState:
+	 * the entry can be removed and reused for another database while we're
+	 * not holding shared->lock. Lock order is shared->lock, then
+	 * relsizes_lock.
+	 */
+	if (db_state_map)
+	{
+		QuotaDbState *dbstate;
+
+		LWLockAcquire(shared->lock, LW_SHARED);
+		dbstate = (QuotaDbState *) hash_search(db_state_map,
+											   (void *) &MyDatabaseId,
+											   HASH_FIND, NULL);
+		if (dbstate)
+		{
+			LWLockAcquire(shared->relsizes_lock, LW_SHARED);
+			if (dbstate->relsizes_area != DSM_HANDLE_INVALID &&
+				DsaPointerIsValid(dbstate->relsizes))
+			{
+				if (relsizes_area != NULL &&
+					relsizes_area_handle != dbstate->relsizes_area)
+				{
+					dsa_detach(relsizes_area);
+					relsizes_area = NULL;
+				}
+				if (relsizes_area == NULL)
+				{
+					LWLockRegisterTranche(shared->relsizes_tranche,
+										  "pg_quota relation sizes");
+					relsizes_area = dsa_attach(dbstate->relsizes_area);
+					dsa_pin_mapping(relsizes_area);
+					relsizes_area_handle = dbstate->relsizes_area;
+				}
+
+				nrels = dbstate->num_relsizes;
+				snapshot_time = dbstate->relsizes_time;
+				records = (RelationSizeRecord *)
+					MemoryContextAllocHuge(CurrentMemoryContext,
+										   Max(nrels, 1) * sizeof(RelationSizeRecord));
+				memcpy(records,
+					   dsa_get_address(relsizes_area, dbstate->relsizes),
+					   nrels * sizeof(RelationSizeRecord));
+			}
+			LWLockRelease(shared->relsizes_lock);
+		}
+		LWLockRelease(shared->lock);
+	}
+
+	for (i = 0; i < nrels; i++)
+	{
+		RelationSizeRecord *rec = &records[i];
+		Datum		values[GET_RELATION_SIZES_COLS];
+		bool		nulls[GET_RELATION_SIZES_COLS];
+		Oid			relid;
+		int64		total = 0;
+		int			forknum;
+		int			col = 0;
+
+		/* pg_class.reltablespace is 0 for the database's default tablespace */
+		relid = RelidByRelfilenode(rec->spcid == MyDatabaseTableSpace ?
+								   InvalidOid : rec->spcid,
+								   rec->relfilenode);
+
+		memset(nulls, 0, sizeof(nulls));
+		if (OidIsValid(relid))
+			values[col++] = ObjectIdGetDatum(relid);
+		else
+			nulls[col++] = true;
+		values[col++] = ObjectIdGetDatum(rec->spcid);
+		values[col++] = ObjectIdGetDatum(rec->relfilenode);
+		if (OidIsValid(rec->owner))
+			values[col++] = ObjectIdGetDatum(rec->owner);
+		else
+			nulls[col++] = true;
+		for (forknum = 0; forknum <= MAX_FORKNUM; forknum++)
+		{
+			values[col++] = Int64GetDatum(rec->forksize[forknum]);
+			total += rec->forksize[forknum];
+		}
+		values[col++] = Int64GetDatum(total);
+		values[col++] = TimestampTzGetDatum(snapshot_time);
+		Assert(col == GET_RELATION_SIZES_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	if (records)
+		pfree(records);
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
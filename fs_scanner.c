@@ -0,0 +1,654 @@
+/* -------------------------------------------------------------------------
+ *
+ * fs_scanner.c
+ *		Scan tablespace directories in parallel, using helper workers.
+ *
+ * A full scan of the data directory is dominated by the stat() calls, one for
+ * every relation file. When the relations are spread over several
+ * tablespaces, on different devices, it's a waste to stat() them one device
+ * at a time. So during a full scan, the worker hands each tablespace
+ * directory to a dynamic background worker, a "scanner". The scanner walks
+ * its directory, and sends the name and size of every file it sees back to
+ * the worker through a shm_mq. Meanwhile the worker scans the default
+ * tablespace itself, and every now and then drains the queues without
+ * waiting, so that the scanners don't stall on a full queue. The scanners
+ * don't touch the model; they only issue the system calls, so the total
+ * refresh time is bounded by the slowest device, rather than the sum of all
+ * of them.
+ *
+ * A scanner stays around after its scan, waiting on its latch for the worker
+ * to request the next one, so that we don't fork a process for every
+ * tablespace on every full scan. A scanner that hasn't been needed for
+ * SCANNER_MAX_IDLE_SCANS full scans, e.g. because its tablespace hasn't
+ * changed, or was dropped, is stopped, to give back its slot in
+ * max_worker_processes. The worker stops all its scanners when it exits.
+ *
+ * If a scanner cannot be launched, e.g. because max_worker_processes has
+ * been reached, or if it dies before it has finished, the worker scans the
+ * directory itself, so the result of the full scan is always complete.
+ *
+ * Copyright (c) 2013-2018, PostgreSQL Global Development Group
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <sys/stat.h>
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+
+#include "pg_quota.h"
+
+/* GUC variable */
+int			pg_quota_max_parallel_scanners = 4;
+
+/* Identifies the contents of a scanner's DSM segment */
+#define PG_QUOTA_SCANNER_MAGIC		0x51554f54
+
+/* Keys in the shm_toc */
+#define PG_QUOTA_SCANNER_KEY_DIRPATH	0
+#define PG_QUOTA_SCANNER_KEY_QUEUE		1
+#define PG_QUOTA_SCANNER_KEY_CONTROL	2
+
+/* Size of the queue between each scanner and the worker */
+#define PG_QUOTA_SCANNER_QUEUE_SIZE		65536
+
+/* Stop a scanner that hasn't been asked to scan in this many full scans */
+#define SCANNER_MAX_IDLE_SCANS			10
+
+/*
+ * While scanning a directory itself, the worker drains the scanners' queues
+ * after every this many entries.
+ */
+#define SCANNER_POLL_INTERVAL			256
+
+/*
+ * The scanner sends the files in batches, to amortize the overhead of the
+ * queue. Each message is a sequence of ScannedFile records, each followed
+ * by the (null-terminated) file name, padded to maximum alignment. A record
+ * with namelen == -1 marks the end of a scan.
+ */
+#define SCANNER_BATCH_SIZE		8192
+
+typedef struct
+{
+	off_t		filesize;
+	int			namelen;		/* length of the name, or -1 at end of scan */
+} ScannedFile;
+
+#define SCANNED_FILE_SIZE(namelen) \
+	MAXALIGN(sizeof(ScannedFile) + (namelen) + 1)
+
+/*
+ * Shared between a scanner and its worker. The worker bumps scans_requested
+ * and sets the scanner's latch to start a scan; the scanner counts the scans
+ * it has done itself, and starts another whenever it's behind.
+ */
+typedef struct
+{
+	pg_atomic_uint32 scans_requested;
+} ScannerControl;
+
+/*
+ * A scanner, from the point of view of the worker that launched it. These
+ * live in TopMemoryContext, in the scanners list, for as long as the scanner
+ * runs.
+ */
+struct FsScanner
+{
+	FsScanner  *next;
+	char	   *dirpath;		/* directory this scanner scans */
+	dsm_segment *seg;
+	shm_mq	   *mq;
+	shm_mq_handle *mqh;
+	ScannerControl *control;
+	BackgroundWorkerHandle *handle;
+	bool		active;			/* scan requested, end marker not seen yet */
+	bool		detached;		/* has the scanner exited? */
+	bool		requested;		/* asked to scan in this full scan? */
+	int			idle_scans;		/* full scans since it was last needed */
+};
+
+static FsScanner *scanners = NULL;
+static int	nscanners = 0;
+
+/* entries the worker has scanned itself since the last poll */
+static int	entries_since_poll = 0;
+
+static volatile sig_atomic_t scanner_got_sighup = false;
+
+void		pg_quota_scanner_main(Datum) pg_attribute_noreturn();
+
+static FsScanner *start_fs_scanner(const char *dirpath);
+static void stop_fs_scanner(FsScanner *scanner);
+static void stop_fs_scanners_at_exit(int code, Datum arg);
+static bool drain_fs_scanner(FsScanner *scanner);
+static void scanner_flush(shm_mq_handle *mqh, char *buf, Size *len);
+static void pg_quota_scanner_sighup(SIGNAL_ARGS);
+
+/*
+ * Launch a scanner for the given directory, and add it to the list.
+ *
+ * Returns NULL, if the scanner could not be launched.
+ */
+static FsScanner *
+start_fs_scanner(const char *dirpath)
+{
+	static bool exit_callback_registered = false;
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle;
+	shm_toc_estimator e;
+	shm_toc    *toc;
+	dsm_segment *seg;
+	shm_mq	   *mq;
+	ScannerControl *control;
+	char	   *dirpath_copy;
+	FsScanner  *scanner;
+	MemoryContext oldcontext;
+
+	shm_toc_initialize_estimator(&e);
+	shm_toc_estimate_chunk(&e, MAXPGPATH);
+	shm_toc_estimate_chunk(&e, PG_QUOTA_SCANNER_QUEUE_SIZE);
+	shm_toc_estimate_chunk(&e, sizeof(ScannerControl));
+	shm_toc_estimate_keys(&e, 3);
+
+	seg = dsm_create(shm_toc_estimate(&e), DSM_CREATE_NULL_IF_MAXSEGMENTS);
+	if (seg == NULL)
+		return NULL;
+	/* the scanner outlives the current full scan, and any resource owner */
+	dsm_pin_mapping(seg);
+
+	toc = shm_toc_create(PG_QUOTA_SCANNER_MAGIC, dsm_segment_address(seg),
+						 shm_toc_estimate(&e));
+
+	dirpath_copy = shm_toc_allocate(toc, MAXPGPATH);
+	strlcpy(dirpath_copy, dirpath, MAXPGPATH);
+	shm_toc_insert(toc, PG_QUOTA_SCANNER_KEY_DIRPATH, dirpath_copy);
+
+	mq = shm_mq_create(shm_toc_allocate(toc, PG_QUOTA_SCANNER_QUEUE_SIZE),
+					   PG_QUOTA_SCANNER_QUEUE_SIZE);
+	shm_toc_insert(toc, PG_QUOTA_SCANNER_KEY_QUEUE, mq);
+	shm_mq_set_receiver(mq, MyProc);
+
+	control = shm_toc_allocate(toc, sizeof(ScannerControl));
+	pg_atomic_init_u32(&control->scans_requested, 0);
+	shm_toc_insert(toc, PG_QUOTA_SCANNER_KEY_CONTROL, control);
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	sprintf(worker.bgw_library_name, "pg_quota");
+	sprintf(worker.bgw_function_name, "pg_quota_scanner_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_quota scanner for \"%s\"", dirpath);
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_quota scanner");
+	worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+	/* so that our latch is set, if the scanner fails to start or exits */
+	worker.bgw_notify_pid = MyProcPid;
+
+	/* The handles and the queue's buffer must last as long as the scanner */
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+	{
+		MemoryContextSwitchTo(oldcontext);
+		ereport(DEBUG1,
+				(errmsg("could not launch pg_quota scanner for \"%s\", scanning it in the worker instead",
+						dirpath),
+				 errhint("You might need to increase max_worker_processes.")));
+		dsm_detach(seg);
+		return NULL;
+	}
+
+	if (!exit_callback_registered)
+	{
+		before_shmem_exit(stop_fs_scanners_at_exit, (Datum) 0);
+		exit_callback_registered = true;
+	}
+
+	scanner = (FsScanner *) palloc0(sizeof(FsScanner));
+	scanner->dirpath = pstrdup(dirpath);
+	scanner->seg = seg;
+	scanner->mq = mq;
+	scanner->mqh = shm_mq_attach(mq, seg, handle);
+	scanner->control = control;
+	scanner->handle = handle;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	scanner->next = scanners;
+	scanners = scanner;
+	nscanners++;
+
+	return scanner;
+}
+
+/*
+ * Stop a scanner, and remove it from the list.
+ */
+static void
+stop_fs_scanner(FsScanner *scanner)
+{
+	FsScanner **prev;
+
+	for (prev = &scanners; *prev != scanner; prev = &(*prev)->next)
+		;
+	*prev = scanner->next;
+	nscanners--;
+
+	if (!scanner->detached)
+		TerminateBackgroundWorker(scanner->handle);
+	shm_mq_detach(scanner->mqh);
+	dsm_detach(scanner->seg);
+	pfree(scanner->handle);
+	pfree(scanner->dirpath);
+	pfree(scanner);
+}
+
+/*
+ * Stop the scanners when the worker exits. They would otherwise wait for
+ * their next scan forever, as they don't notice the worker going away until
+ * they try to send something.
+ */
+static void
+stop_fs_scanners_at_exit(int code, Datum arg)
+{
+	FsScanner  *scanner;
+
+	for (scanner = scanners; scanner != NULL; scanner = scanner->next)
+	{
+		if (!scanner->detached)
+			TerminateBackgroundWorker(scanner->handle);
+	}
+}
+
+/*
+ * Ask a scanner to scan the given directory, launching one if there isn't
+ * one for it already.
+ *
+ * Returns false, if no scanner is available. The caller should then scan the
+ * directory itself.
+ */
+bool
+request_fs_scan(const char *dirpath)
+{
+	FsScanner  *scanner;
+	PGPROC	   *sender;
+
+	for (scanner = scanners; scanner != NULL; scanner = scanner->next)
+	{
+		if (!scanner->detached && strcmp(scanner->dirpath, dirpath) == 0)
+			break;
+	}
+
+	if (scanner == NULL)
+	{
+		if (nscanners >= pg_quota_max_parallel_scanners)
+			return false;
+		scanner = start_fs_scanner(dirpath);
+		if (scanner == NULL)
+			return false;
+	}
+
+	Assert(!scanner->active);
+	scanner->active = true;
+	scanner->requested = true;
+	scanner->idle_scans = 0;
+
+	/*
+	 * The atomic op is a full barrier, so either we see the scanner attached
+	 * to the queue, and wake it up, or it sees the new request when it
+	 * starts.
+	 */
+	pg_atomic_fetch_add_u32(&scanner->control->scans_requested, 1);
+	sender = shm_mq_get_sender(scanner->mq);
+	if (sender)
+		SetLatch(&sender->procLatch);
+
+	return true;
+}
+
+/*
+ * Apply whatever a scanner has sent us so far, without waiting for more.
+ *
+ * Returns true, if anything was received.
+ */
+static bool
+drain_fs_scanner(FsScanner *scanner)
+{
+	bool		progress = false;
+
+	while (scanner->active)
+	{
+		shm_mq_result res;
+		Size		nbytes;
+		void	   *data;
+		char	   *p;
+
+		res = shm_mq_receive(scanner->mqh, &nbytes, &data, true);
+		if (res == SHM_MQ_WOULD_BLOCK)
+			break;
+		progress = true;
+
+		if (res == SHM_MQ_DETACHED)
+		{
+			scanner->detached = true;
+			break;
+		}
+
+		/* Apply the batch */
+		for (p = (char *) data; p < (char *) data + nbytes;)
+		{
+			ScannedFile *sf = (ScannedFile *) p;
+
+			if (sf->namelen < 0)
+			{
+				scanner->active = false;
+				break;
+			}
+			refresh_fs_model_file_size(scanner->dirpath,
+									   p + sizeof(ScannedFile),
+									   sf->filesize);
+			p += SCANNED_FILE_SIZE(sf->namelen);
+		}
+	}
+
+	return progress;
+}
+
+/*
+ * Apply the results the scanners have sent so far, without waiting. Called
+ * periodically while the worker scans a directory itself, so that the
+ * scanners can keep going, instead of blocking on a full queue until we get
+ * to finish_fs_scanners().
+ */
+void
+poll_fs_scanners(void)
+{
+	FsScanner  *scanner;
+
+	if (++entries_since_poll < SCANNER_POLL_INTERVAL)
+		return;
+	entries_since_poll = 0;
+
+	for (scanner = scanners; scanner != NULL; scanner = scanner->next)
+	{
+		if (scanner->active && !scanner->detached)
+			(void) drain_fs_scanner(scanner);
+	}
+}
+
+/*
+ * Wait for all the requested scans to finish, and apply their results to the
+ * model.
+ *
+ * Returns a list of the directories whose scanner died before finishing.
+ * Those need to be scanned by the caller. Also stops the scanners that have
+ * been idle for too long, or that are over pg_quota.max_parallel_scanners.
+ */
+List *
+finish_fs_scanners(void)
+{
+	List	   *failed = NIL;
+	FsScanner  *scanner;
+	FsScanner  *next;
+
+	for (;;)
+	{
+		bool		progress = false;
+		bool		waiting = false;
+
+		/*
+		 * If we're shutting down, don't wait for the scanners. They're
+		 * stopped when we exit.
+		 */
+		if (quota_worker_terminating())
+			break;
+
+		/*
+		 * Poll each scanner in turn, so that a slow one doesn't hold up the
+		 * others by leaving their queues full.
+		 */
+		for (scanner = scanners; scanner != NULL; scanner = scanner->next)
+		{
+			if (!scanner->active || scanner->detached)
+				continue;
+			if (drain_fs_scanner(scanner))
+				progress = true;
+			if (scanner->active && !scanner->detached)
+				waiting = true;
+		}
+
+		if (!waiting)
+			break;
+
+		if (!progress)
+		{
+			int			rc;
+
+			rc = WaitLatch(MyLatch,
+						   WL_LATCH_SET | WL_POSTMASTER_DEATH,
+						   0,
+						   PG_WAIT_EXTENSION);
+			ResetLatch(MyLatch);
+
+			/* emergency bailout if postmaster has died */
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+	entries_since_poll = 0;
+
+	if (quota_worker_terminating())
+		return NIL;
+
+	for (scanner = scanners; scanner != NULL; scanner = next)
+	{
+		next = scanner->next;
+
+		if (scanner->detached)
+		{
+			if (scanner->active)
+			{
+				ereport(LOG,
+						(errmsg("pg_quota scanner for \"%s\" exited before finishing, scanning it in the worker instead",
+								scanner->dirpath)));
+				failed = lappend(failed, pstrdup(scanner->dirpath));
+			}
+			stop_fs_scanner(scanner);
+			continue;
+		}
+
+		if (!scanner->requested)
+			scanner->idle_scans++;
+		scanner->requested = false;
+
+		if (scanner->idle_scans > SCANNER_MAX_IDLE_SCANS ||
+			nscanners > pg_quota_max_parallel_scanners)
+			stop_fs_scanner(scanner);
+	}
+
+	return failed;
+}
+
+/*
+ * Send the current batch to the worker.
+ */
+static void
+scanner_flush(shm_mq_handle *mqh, char *buf, Size *len)
+{
+	shm_mq_result res;
+
+	if (*len == 0)
+		return;
+
+	res = shm_mq_send(mqh, *len, buf, false);
+	if (res != SHM_MQ_SUCCESS)
+	{
+		/* The worker has gone away. Nothing more to do. */
+		proc_exit(0);
+	}
+	*len = 0;
+}
+
+/*
+ * Signal handler for SIGHUP in a scanner. It may run many scans, so it needs
+ * to pick up changes to pg_quota.scan_cost_limit etc.
+ */
+static void
+pg_quota_scanner_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	scanner_got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Main entry point for a scanner.
+ */
+void
+pg_quota_scanner_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	shm_toc    *toc;
+	char	   *dirpath;
+	shm_mq	   *mq;
+	shm_mq_handle *mqh;
+	ScannerControl *control;
+	uint32		scans_done = 0;
+	union
+	{
+		ScannedFile align;		/* to make the records properly aligned */
+		char		data[SCANNER_BATCH_SIZE];
+	}			buf;
+	char	   *bufp = buf.data;
+
+	/* The default SIGTERM handler is fine. We just die. */
+	pqsignal(SIGHUP, pg_quota_scanner_sighup);
+	BackgroundWorkerUnblockSignals();
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "pg_quota scanner");
+
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map dynamic shared memory segment")));
+	toc = shm_toc_attach(PG_QUOTA_SCANNER_MAGIC, dsm_segment_address(seg));
+	if (toc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("invalid magic number in dynamic shared memory segment")));
+
+	dirpath = shm_toc_lookup(toc, PG_QUOTA_SCANNER_KEY_DIRPATH, false);
+	mq = shm_toc_lookup(toc, PG_QUOTA_SCANNER_KEY_QUEUE, false);
+	control = shm_toc_lookup(toc, PG_QUOTA_SCANNER_KEY_CONTROL, false);
+	shm_mq_set_sender(mq, MyProc);
+	mqh = shm_mq_attach(mq, seg, NULL);
+
+	for (;;)
+	{
+		DIR		   *dirdesc;
+		struct dirent *dirent;
+		Size		len = 0;
+		ScannedFile *sf;
+
+		/* Wait for the worker to ask for the next scan */
+		if (pg_atomic_read_u32(&control->scans_requested) == scans_done)
+		{
+			int			rc;
+
+			pgstat_report_activity(STATE_IDLE, NULL);
+
+			rc = WaitLatch(MyLatch,
+						   WL_LATCH_SET | WL_POSTMASTER_DEATH,
+						   0,
+						   PG_WAIT_EXTENSION);
+			ResetLatch(MyLatch);
+
+			/* emergency bailout if postmaster has died */
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+
+			CHECK_FOR_INTERRUPTS();
+			continue;
+		}
+		scans_done++;
+
+		if (scanner_got_sighup)
+		{
+			scanner_got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		pgstat_report_activity(STATE_RUNNING, dirpath);
+
+		dirdesc = AllocateDir(dirpath);
+		while ((dirent = ReadDirExtended(dirdesc, dirpath, DEBUG1)) != NULL)
+		{
+			char		path[MAXPGPATH];
+			struct stat statbuf;
+			int			namelen;
+
+			(void) scan_delay_point();
+
+			/*
+			 * Relation files are named by their relfilenode, so skip anything
+			 * that doesn't start with a digit, without bothering to stat()
+			 * it. The worker parses the rest of the name. Temporary
+			 * relations' files start with 't', and are wanted if we're
+			 * tracking them.
+			 */
+			if ((dirent->d_name[0] < '0' || dirent->d_name[0] > '9') &&
+				!(pg_quota_track_temp && dirent->d_name[0] == 't'))
+				continue;
+
+			snprintf(path, MAXPGPATH, "%s/%s", dirpath, dirent->d_name);
+			if (stat(path, &statbuf) != 0)
+			{
+				/*
+				 * The file was removed concurrently, or we cannot read it.
+				 * Either way, leave it out, like the worker would.
+				 */
+				continue;
+			}
+
+			namelen = strlen(dirent->d_name);
+			if (len + SCANNED_FILE_SIZE(namelen) > SCANNER_BATCH_SIZE)
+				scanner_flush(mqh, bufp, &len);
+
+			sf = (ScannedFile *) &bufp[len];
+			sf->filesize = statbuf.st_size;
+			sf->namelen = namelen;
+			memcpy(&bufp[len + sizeof(ScannedFile)], dirent->d_name, namelen + 1);
+			len += SCANNED_FILE_SIZE(namelen);
+		}
+		FreeDir(dirdesc);
+
+		/* Send the end-of-scan marker */
+		if (len + SCANNED_FILE_SIZE(0) > SCANNER_BATCH_SIZE)
+			scanner_flush(mqh, bufp, &len);
+		sf = (ScannedFile *) &bufp[len];
+		sf->filesize = 0;
+		sf->namelen = -1;
+		len += SCANNED_FILE_SIZE(0);
+		scanner_flush(mqh, bufp, &len);
+	}
+}
@@ -0,0 +1,308 @@
+/* -------------------------------------------------------------------------
+ *
+ * fs_watch.c
+ *		Track changes to relation files using Linux inotify.
+ *
+ * Instead of stat()ing every file in the data directory on every refresh,
+ * the background worker can ask the kernel to tell it which files were
+ * created, modified or removed since the last refresh. Only those files are
+ * then re-examined, so the cost of a refresh is proportional to the write
+ * activity, rather than the total number of files.
+ *
+ * Every directory that is scanned by refresh_fs_model() is added to the
+ * watch list. The full scan is still performed periodically, as a fallback
+ * and consistency check, and whenever the kernel's event queue overflows.
+ *
+ * On platforms without inotify, all the functions in this file are no-ops,
+ * and init_fs_watch() returns false, so that the worker falls back to
+ * scanning the whole data directory on every refresh.
+ *
+ * Copyright (c) 2013-2018, PostgreSQL Global Development Group
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#define USE_INOTIFY
+#endif
+
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+#include "pg_quota.h"
+
+#ifdef USE_INOTIFY
+
+/* Events we're interested in, for each watched directory */
+#define FS_WATCH_EVENTS \
+	(IN_CREATE | IN_MODIFY | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+	 IN_DELETE_SELF | IN_ONLYDIR)
+
+/*
+ * Directory being watched. Keyed by the inotify watch descriptor.
+ */
+typedef struct
+{
+	int			wd;				/* inotify watch descriptor (hash key) */
+	char		dirpath[MAXPGPATH];
+} WatchedDirEntry;
+
+/*
+ * A file that had some activity, since the last call to
+ * fs_watch_process_events(). Used to process each file only once, even if
+ * we received many events on it.
+ */
+typedef struct
+{
+	char		path[MAXPGPATH];	/* hash key */
+	int			nameoff;		/* offset of the file name within 'path' */
+} DirtyFileEntry;
+
+/* inotify file descriptor, or -1 if not initialized */
+static int	inotify_fd = -1;
+
+/* Set, if we have lost events and the caller must do a full rescan */
+static bool events_lost = false;
+
+static HTAB *watched_dirs_map;
+
+/* Memory context for the per-refresh working state */
+static MemoryContext FsWatchContext;
+
+/*
+ * Initialize watching. Returns false if inotify is not available.
+ */
+bool
+init_fs_watch(void)
+{
+	HASHCTL		hash_ctl;
+
+	if (inotify_fd != -1)
+		close(inotify_fd);
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not initialize inotify, falling back to periodic scans: %m")));
+		return false;
+	}
+
+	if (FsWatchContext)
+		MemoryContextDelete(FsWatchContext);
+	FsWatchContext = AllocSetContextCreate(TopMemoryContext,
+										   "Disk quotas FS watch context",
+										   ALLOCSET_DEFAULT_SIZES);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(int);
+	hash_ctl.entrysize = sizeof(WatchedDirEntry);
+	hash_ctl.hcxt = TopMemoryContext;
+
+	watched_dirs_map = hash_create("watched directories map",
+								   64,
+								   &hash_ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	events_lost = false;
+
+	return true;
+}
+
+/*
+ * Start watching a directory, if we're not watching it already.
+ */
+void
+fs_watch_add_dir(const char *dirpath)
+{
+	WatchedDirEntry *entry;
+	int			wd;
+	bool		found;
+
+	if (inotify_fd == -1)
+		return;
+
+	/*
+	 * Adding a watch for a directory that is already watched just returns
+	 * the existing watch descriptor, so we don't need to check for that
+	 * separately.
+	 */
+	wd = inotify_add_watch(inotify_fd, dirpath, FS_WATCH_EVENTS);
+	if (wd < 0)
+	{
+		/*
+		 * Most likely, we ran out fs.inotify.max_user_watches. We cannot
+		 * track changes in this directory, so the caller must do full scans
+		 * from now on.
+		 */
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not add inotify watch for directory \"%s\": %m",
+						dirpath)));
+		events_lost = true;
+		return;
+	}
+
+	entry = (WatchedDirEntry *) hash_search(watched_dirs_map,
+											(void *) &wd,
+											HASH_ENTER, &found);
+	strlcpy(entry->dirpath, dirpath, MAXPGPATH);
+}
+
+/*
+ * Process all events that have been queued since the last call.
+ *
+ * Each changed file is passed to refresh_fs_model_file(). If 'apply' is
+ * false, the events are just discarded. (That's used when the caller is
+ * about to perform a full scan anyway.)
+ *
+ * Returns false if some events were lost, because the kernel's event queue
+ * overflowed, or a directory could not be watched. The caller needs to
+ * perform a full scan to get back in sync, in that case.
+ */
+bool
+fs_watch_process_events(bool apply)
+{
+	union
+	{
+		struct inotify_event ev;
+		char		buf[8192];
+	}			evbuf;
+	HTAB	   *dirty_files_map = NULL;
+	HASHCTL		hash_ctl;
+	HASH_SEQ_STATUS iter;
+	DirtyFileEntry *dirty;
+	bool		result;
+
+	if (inotify_fd == -1)
+		return false;
+
+	if (apply)
+	{
+		memset(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = MAXPGPATH;
+		hash_ctl.entrysize = sizeof(DirtyFileEntry);
+		hash_ctl.hcxt = FsWatchContext;
+
+		dirty_files_map = hash_create("dirty files map",
+									  256,
+									  &hash_ctl,
+									  HASH_ELEM | HASH_CONTEXT);
+	}
+
+	/*
+	 * Drain the event queue. The same file is usually reported many times, so
+	 * collect the file names into a hash table first, so that we only stat()
+	 * each file once.
+	 */
+	for (;;)
+	{
+		ssize_t		len;
+		char	   *p;
+
+		len = read(inotify_fd, evbuf.buf, sizeof(evbuf.buf));
+		if (len < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read inotify events: %m")));
+			events_lost = true;
+			break;
+		}
+		if (len == 0)
+			break;
+
+		for (p = evbuf.buf; p < evbuf.buf + len;)
+		{
+			struct inotify_event *ev = (struct inotify_event *) p;
+
+			p += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				events_lost = true;
+				continue;
+			}
+
+			if (ev->mask & IN_IGNORED)
+			{
+				/* The directory was removed, or the watch was otherwise lost */
+				(void) hash_search(watched_dirs_map, (void *) &ev->wd,
+								   HASH_REMOVE, NULL);
+				continue;
+			}
+
+			if (ev->len == 0 || (ev->mask & IN_ISDIR) != 0)
+				continue;
+
+			if (apply)
+			{
+				WatchedDirEntry *dir;
+				char		path[MAXPGPATH];
+				bool		found;
+
+				dir = (WatchedDirEntry *) hash_search(watched_dirs_map,
+													  (void *) &ev->wd,
+													  HASH_FIND, NULL);
+				if (!dir)
+					continue;
+
+				snprintf(path, MAXPGPATH, "%s/%s", dir->dirpath, ev->name);
+				dirty = (DirtyFileEntry *) hash_search(dirty_files_map,
+													   (void *) path,
+													   HASH_ENTER, &found);
+				if (!found)
+					dirty->nameoff = strlen(dir->dirpath) + 1;
+			}
+		}
+	}
+
+	/* Now re-examine each file that had some activity. */
+	if (apply)
+	{
+		hash_seq_init(&iter, dirty_files_map);
+		while ((dirty = hash_seq_search(&iter)) != NULL)
+		{
+			char		dirpath[MAXPGPATH];
+
+			/* Split the path back into directory and file name */
+			strlcpy(dirpath, dirty->path, dirty->nameoff);
+			refresh_fs_model_file(dirpath, &dirty->path[dirty->nameoff]);
+		}
+	}
+
+	MemoryContextReset(FsWatchContext);
+
+	result = !events_lost;
+	events_lost = false;
+
+	return result;
+}
+
+#else							/* !USE_INOTIFY */
+
+bool
+init_fs_watch(void)
+{
+	return false;
+}
+
+void
+fs_watch_add_dir(const char *dirpath)
+{
+}
+
+bool
+fs_watch_process_events(bool apply)
+{
+	return false;
+}
+
+#endif							/* USE_INOTIFY */
@@ -0,0 +1,529 @@
+/* -------------------------------------------------------------------------
+ *
+ * launcher.c
+ *		Launch a worker for each database that uses quotas.
+ *
+ * A single launcher process is registered at postmaster startup. Like the
+ * autovacuum launcher, it periodically reads pg_database, and starts a
+ * dynamic background worker for each database that doesn't have one yet.
+ * The worker checks whether the extension is installed in its database, and
+ * exits right away if it isn't. The launcher then leaves the database alone
+ * for a while, before checking again, so installing the extension in a new
+ * database is noticed within pg_quota.launcher_naptime, without a restart.
+ *
+ * At most pg_quota.max_workers workers run at a time. If there are more
+ * databases than that, the databases take turns: once a worker has run for
+ * pg_quota.rotation_interval, and another database is waiting, the launcher
+ * asks the worker to exit. The worker writes a snapshot of its model on the
+ * way out, so that when its turn comes again, the next worker can pick up
+ * where it left off. The totals and quotas of a database without a running
+ * worker stay in shared memory, and are still enforced, but they are not
+ * updated until a worker for the database runs again.
+ *
+ * If the launcher is restarted, the workers started by its predecessor keep
+ * running. The launcher finds them in shared memory, when it first sees their
+ * databases, and counts them against pg_quota.max_workers, but it has no
+ * handle to them, so it doesn't ask them to make room for other databases,
+ * and it only notices when one of them exits on its next pass.
+ *
+ * If pg_quota.databases is set, only the listed databases are considered.
+ *
+ * Copyright (c) 2013-2018, PostgreSQL Global Development Group
+ * -------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/pg_database.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "utils/varlena.h"
+
+#include "pg_quota.h"
+
+/* GUC variables */
+int			pg_quota_max_workers = 8;
+int			pg_quota_launcher_naptime = 60;
+int			pg_quota_rotation_interval = 600;
+
+void		pg_quota_launcher_main(Datum) pg_attribute_noreturn();
+
+/*
+ * A database known to the launcher.
+ */
+typedef struct
+{
+	Oid			dboid;			/* hash key */
+	NameData	dbname;
+	bool		seen;			/* still in pg_database? */
+
+	BackgroundWorkerHandle *handle; /* running worker, or NULL */
+	bool		adopted;		/* worker started by a previous launcher? */
+	TimestampTz started_at;		/* when the last worker was launched */
+	bool		rotated;		/* did we ask the worker to exit? */
+
+	TimestampTz next_start;		/* don't launch a worker before this */
+} LauncherDbEntry;
+
+static HTAB *launcher_dbs;
+static int	num_running = 0;
+
+/* flags set by signal handlers */
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+static void
+launcher_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+launcher_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Register the launcher. Called from _PG_init().
+ */
+void
+register_quota_launcher(void)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = pg_quota_restart_interval;
+	sprintf(worker.bgw_library_name, "pg_quota");
+	sprintf(worker.bgw_function_name, "pg_quota_launcher_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_quota launcher");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_quota launcher");
+	worker.bgw_notify_pid = 0;
+
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Is the database listed in pg_quota.databases? An empty list means all
+ * databases.
+ */
+static bool
+database_is_listed(List *dblist, const char *dbname)
+{
+	ListCell   *lc;
+
+	if (dblist == NIL)
+		return true;
+
+	foreach(lc, dblist)
+	{
+		if (strcmp((char *) lfirst(lc), dbname) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Is the database in launcher_dbs? For ForgetOtherDbStates().
+ */
+static bool
+launcher_knows_database(Oid dboid)
+{
+	return hash_search(launcher_dbs, (void *) &dboid, HASH_FIND, NULL) != NULL;
+}
+
+/*
+ * Re-read pg_database, to add new databases to launcher_dbs, and to forget
+ * the ones that have been dropped.
+ */
+static void
+update_database_list(void)
+{
+	char	   *dbstr;
+	List	   *dblist = NIL;
+	Relation	rel;
+	HeapScanDesc scan;
+	HeapTuple	tup;
+	HASH_SEQ_STATUS iter;
+	LauncherDbEntry *entry;
+
+	/* Need a modifiable copy of the setting */
+	dbstr = pstrdup(pg_quota_databases);
+	if (!SplitIdentifierString(dbstr, ',', &dblist))
+	{
+		ereport(LOG,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid list syntax in pg_quota.databases setting")));
+		list_free(dblist);
+		pfree(dbstr);
+		return;
+	}
+
+	hash_seq_init(&iter, launcher_dbs);
+	while ((entry = hash_seq_search(&iter)) != NULL)
+		entry->seen = false;
+
+	/* Like get_database_list() in the autovacuum launcher */
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	(void) GetTransactionSnapshot();
+
+	rel = heap_open(DatabaseRelationId, AccessShareLock);
+	scan = heap_beginscan_catalog(rel, 0, NULL);
+
+	while ((tup = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		Form_pg_database pgdatabase = (Form_pg_database) GETSTRUCT(tup);
+		Oid			dboid = HeapTupleGetOid(tup);
+		bool		found;
+
+		if (pgdatabase->datistemplate || !pgdatabase->datallowconn)
+			continue;
+		if (!database_is_listed(dblist, NameStr(pgdatabase->datname)))
+			continue;
+
+		entry = (LauncherDbEntry *) hash_search(launcher_dbs, (void *) &dboid,
+												HASH_ENTER, &found);
+		if (!found)
+		{
+			entry->handle = NULL;
+			entry->started_at = 0;
+			entry->rotated = false;
+			entry->next_start = 0;
+
+			/* Don't launch a second worker, if a previous launcher left one */
+			entry->adopted = IsWorkerRunning(dboid);
+			if (entry->adopted)
+				num_running++;
+		}
+		entry->dbname = pgdatabase->datname;
+		entry->seen = true;
+	}
+
+	heap_endscan(scan);
+	heap_close(rel, AccessShareLock);
+
+	CommitTransactionCommand();
+
+	/*
+	 * Forget the databases that are gone. (If one still has a worker, we
+	 * forget it once the worker has exited. DROP DATABASE doesn't terminate
+	 * it, but the worker exits by itself when it sees that someone is
+	 * waiting to drop the database.) Also drop their state in shared
+	 * memory, and that of any databases we never knew about, e.g. because
+	 * they were known to the previous launcher.
+	 */
+	hash_seq_init(&iter, launcher_dbs);
+	while ((entry = hash_seq_search(&iter)) != NULL)
+	{
+		if (!entry->seen && entry->handle == NULL && !entry->adopted)
+			(void) hash_search(launcher_dbs, (void *) &entry->dboid,
+							   HASH_REMOVE, NULL);
+	}
+	ForgetOtherDbStates(launcher_knows_database);
+
+	list_free(dblist);
+	pfree(dbstr);
+}
+
+/*
+ * Notice workers that have exited, and decide when to launch them again.
+ */
+static void
+reap_workers(TimestampTz now)
+{
+	HASH_SEQ_STATUS iter;
+	LauncherDbEntry *entry;
+
+	hash_seq_init(&iter, launcher_dbs);
+	while ((entry = hash_seq_search(&iter)) != NULL)
+	{
+		pid_t		pid;
+
+		if (entry->adopted)
+		{
+			if (IsWorkerRunning(entry->dboid))
+				continue;
+			entry->adopted = false;
+			num_running--;
+			entry->next_start = now;
+			continue;
+		}
+
+		if (entry->handle == NULL ||
+			GetBackgroundWorkerPid(entry->handle, &pid) != BGWH_STOPPED)
+			continue;
+
+		pfree(entry->handle);
+		entry->handle = NULL;
+		num_running--;
+
+		if (entry->rotated)
+		{
+			/* Our own doing. Get back in line right away. */
+			entry->next_start = now;
+		}
+		else if (IsExtensionMissing(entry->dboid))
+		{
+			/* we remember that here, no need to keep the shared state */
+			ForgetDbState(entry->dboid);
+			entry->next_start = TimestampTzPlusMilliseconds(now,
+															pg_quota_launcher_naptime * 1000);
+		}
+		else
+		{
+			/* The worker failed, or exited for some other reason. */
+			entry->next_start = TimestampTzPlusMilliseconds(now,
+															pg_quota_restart_interval * 1000);
+		}
+		entry->rotated = false;
+	}
+}
+
+/*
+ * Launch a worker for a database.
+ */
+static bool
+launch_worker(LauncherDbEntry *entry, TimestampTz now)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	sprintf(worker.bgw_library_name, "pg_quota");
+	sprintf(worker.bgw_function_name, "pg_quota_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_quota worker for \"%s\"",
+			 NameStr(entry->dbname));
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_quota worker");
+	worker.bgw_main_arg = ObjectIdGetDatum(entry->dboid);
+	/* so that our latch is set, when the worker exits */
+	worker.bgw_notify_pid = MyProcPid;
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &entry->handle))
+	{
+		ereport(LOG,
+				(errmsg("could not launch pg_quota worker for database \"%s\"",
+						NameStr(entry->dbname)),
+				 errhint("You might need to increase max_worker_processes.")));
+		entry->handle = NULL;
+		entry->next_start = TimestampTzPlusMilliseconds(now,
+														pg_quota_restart_interval * 1000);
+		return false;
+	}
+
+	/* The handle was allocated in the current memory context */
+	entry->started_at = now;
+	entry->rotated = false;
+	num_running++;
+	return true;
+}
+
+/*
+ * Launch workers for waiting databases, as long as there are free slots.
+ * The database that has waited the longest since its last turn goes first.
+ */
+static void
+launch_workers(TimestampTz now)
+{
+	for (;;)
+	{
+		HASH_SEQ_STATUS iter;
+		LauncherDbEntry *entry;
+		LauncherDbEntry *next = NULL;
+		LauncherDbEntry *oldest = NULL;
+
+		hash_seq_init(&iter, launcher_dbs);
+		while ((entry = hash_seq_search(&iter)) != NULL)
+		{
+			if (entry->adopted)
+				continue;
+			if (entry->handle != NULL)
+			{
+				if (!entry->rotated &&
+					(oldest == NULL || entry->started_at < oldest->started_at))
+					oldest = entry;
+				continue;
+			}
+			if (!entry->seen || entry->next_start > now)
+				continue;
+			if (next == NULL || entry->started_at < next->started_at)
+				next = entry;
+		}
+
+		if (next == NULL)
+			break;
+
+		if (num_running < pg_quota_max_workers)
+		{
+			if (!launch_worker(next, now))
+				break;
+			continue;
+		}
+
+		/*
+		 * All slots are in use. If the longest-running worker has had its
+		 * turn, ask it to exit, to make room. We'll launch the waiting
+		 * database once it has exited.
+		 */
+		if (oldest != NULL &&
+			TimestampDifferenceExceeds(oldest->started_at, now,
+									   pg_quota_rotation_interval * 1000))
+		{
+			elog(DEBUG1, "stopping pg_quota worker for database \"%s\", to let other databases have a turn",
+				 NameStr(oldest->dbname));
+			TerminateBackgroundWorker(oldest->handle);
+			oldest->rotated = true;
+		}
+		break;
+	}
+}
+
+/*
+ * How long to sleep, in milliseconds, before something needs to be done.
+ *
+ * Besides re-reading pg_database every pg_quota.launcher_naptime, we need
+ * to wake up when a database's restart delay runs out, and, if databases
+ * are waiting for a slot, when the longest-running worker's turn is over.
+ */
+static long
+launcher_sleep_time(TimestampTz now)
+{
+	HASH_SEQ_STATUS iter;
+	LauncherDbEntry *entry;
+	TimestampTz wakeup;
+	TimestampTz oldest_start = 0;
+	bool		waiting = false;
+	long		secs;
+	int			usecs;
+
+	wakeup = TimestampTzPlusMilliseconds(now, pg_quota_launcher_naptime * 1000);
+
+	hash_seq_init(&iter, launcher_dbs);
+	while ((entry = hash_seq_search(&iter)) != NULL)
+	{
+		if (entry->handle != NULL)
+		{
+			if (!entry->rotated &&
+				(oldest_start == 0 || entry->started_at < oldest_start))
+				oldest_start = entry->started_at;
+		}
+		else if (entry->seen && !entry->adopted)
+		{
+			if (entry->next_start <= now)
+				waiting = true;
+			else if (entry->next_start < wakeup)
+				wakeup = entry->next_start;
+		}
+	}
+
+	if (waiting && oldest_start != 0)
+	{
+		TimestampTz turn_over;
+
+		turn_over = TimestampTzPlusMilliseconds(oldest_start,
+												pg_quota_rotation_interval * 1000);
+		if (turn_over < wakeup)
+			wakeup = turn_over;
+	}
+
+	TimestampDifference(now, wakeup, &secs, &usecs);
+	return secs * 1000L + usecs / 1000 + 1;
+}
+
+/*
+ * Main entry point of the launcher.
+ */
+void
+pg_quota_launcher_main(Datum main_arg)
+{
+	HASHCTL		hash_ctl;
+
+	/* Establish signal handlers before unblocking signals. */
+	pqsignal(SIGHUP, launcher_sighup);
+	pqsignal(SIGTERM, launcher_sigterm);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	/* Connect to no database in particular; we only read pg_database */
+	BackgroundWorkerInitializeConnection(NULL, NULL, 0);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(Oid);
+	hash_ctl.entrysize = sizeof(LauncherDbEntry);
+	hash_ctl.hcxt = TopMemoryContext;
+
+	launcher_dbs = hash_create("pg_quota launcher databases",
+							   64,
+							   &hash_ctl,
+							   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	elog(LOG, "pg_quota launcher started");
+
+	while (!got_sigterm)
+	{
+		TimestampTz now;
+		int			rc;
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		now = GetCurrentTimestamp();
+		reap_workers(now);
+		update_database_list();
+
+		/* The worker handles must outlive the transaction */
+		MemoryContextSwitchTo(TopMemoryContext);
+		launch_workers(now);
+
+		pgstat_report_activity(STATE_IDLE, NULL);
+
+		/*
+		 * Sleep until there's something to do. Our latch is also set whenever
+		 * one of our workers exits, so that we can fill its slot.
+		 */
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   launcher_sleep_time(GetCurrentTimestamp()),
+					   PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		/* emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	proc_exit(0);
+}
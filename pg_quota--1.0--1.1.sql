@@ -0,0 +1,113 @@
+/* pg_quota--1.0--1.1.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_quota UPDATE TO '1.1'" to load this file. \quit
+
+set search_path='quota';
+
+-- get_quota_status() now returns per-tablespace rows, the growth projection,
+-- and temporary relations. Its result type changes, so recreate it, and the
+-- view on it.
+DROP VIEW quota.status;
+DROP FUNCTION get_quota_status();
+
+CREATE FUNCTION get_quota_status(rolid OUT oid, spcid OUT oid,
+                                 space_used OUT int8, quota OUT int8,
+                                 growth_rate OUT float8,
+                                 exceed_at OUT timestamptz,
+                                 temp_size OUT int8)
+RETURNS SETOF record STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW quota.status AS
+SELECT rolid::regrole AS rolname, space_used, temp_size, quota,
+       growth_rate, exceed_at
+FROM get_quota_status()
+WHERE spcid = 0;
+
+CREATE VIEW quota.tablespace_status AS
+SELECT rolid::regrole AS rolname, spc.spcname, space_used, temp_size, quota,
+       growth_rate, exceed_at
+FROM get_quota_status() s
+LEFT JOIN pg_catalog.pg_tablespace spc ON spc.oid = s.spcid
+WHERE s.spcid <> 0;
+
+CREATE FUNCTION get_quota_usage(rolid OUT oid, spcid OUT oid,
+                                main_size OUT int8, fsm_size OUT int8,
+                                vm_size OUT int8, init_size OUT int8)
+RETURNS SETOF record STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW quota.usage AS
+SELECT rolid::regrole AS rolname, spc.spcname,
+       main_size, fsm_size, vm_size, init_size,
+       main_size + fsm_size + vm_size + init_size AS space_used
+FROM get_quota_usage() u
+LEFT JOIN pg_catalog.pg_tablespace spc ON spc.oid = u.spcid;
+
+CREATE FUNCTION get_shmem_usage(used_entries OUT int8, max_entries OUT int8,
+                                overflow_count OUT int8)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE FUNCTION get_worker_stats(dbid OUT oid, pid OUT int4,
+                                 last_refresh OUT timestamptz,
+                                 refreshes OUT int8, full_scans OUT int8,
+                                 last_scan_time OUT float8,
+                                 avg_scan_time OUT float8,
+                                 last_orphans_time OUT float8,
+                                 avg_orphans_time OUT float8,
+                                 last_load_quotas_time OUT float8,
+                                 avg_load_quotas_time OUT float8,
+                                 files_stated OUT int8, files_added OUT int8,
+                                 files_removed OUT int8, orphans OUT int8,
+                                 model_memory OUT int8,
+                                 lock_wait_time OUT float8,
+                                 quota_checks OUT int8,
+                                 quota_rejections OUT int8)
+RETURNS SETOF record STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW quota.worker_stats AS
+SELECT d.datname, s.*
+FROM get_worker_stats() s
+LEFT JOIN pg_catalog.pg_database d ON d.oid = s.dbid;
+
+CREATE FUNCTION get_relation_sizes(relid OUT oid, spcid OUT oid,
+                                   relfilenode OUT oid, owner OUT oid,
+                                   main_size OUT int8, fsm_size OUT int8,
+                                   vm_size OUT int8, init_size OUT int8,
+                                   total_size OUT int8,
+                                   snapshot_time OUT timestamptz)
+RETURNS SETOF record STRICT
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE VIEW quota.relation_sizes AS
+SELECT r.relid::regclass AS relation, r.owner::regrole AS rolname,
+       spc.spcname, r.relfilenode,
+       r.main_size, r.fsm_size, r.vm_size, r.init_size, r.total_size,
+       r.snapshot_time
+FROM get_relation_sizes() r
+LEFT JOIN pg_catalog.pg_tablespace spc ON spc.oid = r.spcid;
+
+-- Tablespace quotas.
+-- spcid is the tablespace the quota applies to, or 0 for a database-wide quota
+ALTER TABLE quota.config ADD COLUMN spcid oid NOT NULL DEFAULT 0;
+ALTER TABLE quota.config DROP CONSTRAINT config_pkey;
+ALTER TABLE quota.config ADD PRIMARY KEY (roleid, spcid);
+
+-- Notify the worker whenever the configuration changes
+CREATE FUNCTION config_changed() RETURNS trigger
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+CREATE TRIGGER config_changed
+AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON quota.config
+FOR EACH STATEMENT EXECUTE PROCEDURE config_changed();
+
+reset search_path;
@@ -4,8 +4,8 @@
  *		Background worker that tracks disk space usage.
  *
  * This file contains the code for initialization of the module, and
- * the background worker's main loop. We launch one background worker for
- * each database.
+ * the background worker's main loop. The launcher, see launcher.c, starts
+ * one background worker for each database that uses quotas.
  *
  * Copyright (c) 2013-2018, PostgreSQL Global Development Group
  * -------------------------------------------------------------------------
@@ -17,41 +17,91 @@
 #include "postmaster/bgworker.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
+#include "storage/lock.h"
 #include "storage/lwlock.h"
 #include "storage/proc.h"
 #include "storage/shmem.h"
 
 /* these headers are used by this particular worker's code */
+#include "access/heapam.h"
 #include "access/htup_details.h"
+#include "access/transam.h"
 #include "access/xact.h"
+#include "catalog/pg_auth_members.h"
 #include "catalog/pg_authid_d.h"
 #include "catalog/pg_class.h"
+#include "catalog/pg_database.h"
 #include "catalog/pg_type_d.h"
 #include "commands/dbcommands.h"
+#include "commands/extension.h"
+#include "commands/trigger.h"
 #include "executor/spi.h"
 #include "nodes/makefuncs.h"
 #include "pgstat.h"
+#include "portability/instr_time.h"
+#include "postmaster/postmaster.h"
 #include "utils/guc.h"
+#include "utils/catcache.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
 #include "utils/relfilenodemap.h"
 #include "utils/snapmgr.h"
 #include "utils/syscache.h"
-#include "utils/varlena.h"
+#include "utils/timestamp.h"
 
 #include "pg_quota.h"
 
 PG_MODULE_MAGIC;
 
+PG_FUNCTION_INFO_V1(config_changed);
+
 void		_PG_init(void);
 void		pg_quota_worker_main(Datum) pg_attribute_noreturn();
 
+/*
+ * How often, in ms, to check whether someone wants us out of the database,
+ * see database_lock_requested(). DROP DATABASE waits for 5 seconds.
+ */
+#define DATABASE_LOCK_CHECK_INTERVAL	1000
+
 /* flags set by signal handlers */
 static volatile sig_atomic_t got_sighup = false;
 static volatile sig_atomic_t got_sigterm = false;
 
 /* GUC variables */
 static int	pg_quota_refresh_naptime = 10;
-static int	pg_quota_restart_interval = 5;
-static char	*pg_quota_databases = "postgres";
+static int	pg_quota_hot_refresh_naptime = 1000;
+int			pg_quota_restart_interval = 5;
+char	   *pg_quota_databases = "";
+static bool pg_quota_use_inotify = true;
+static int	pg_quota_full_scan_interval = 300;
+static int	pg_quota_snapshot_interval = 300;
+static bool pg_quota_log_refresh_stats = false;
+
+/*
+ * Quotas currently loaded from the configuration table, in the worker. Used
+ * to only apply the rows that have changed, when the table is reloaded.
+ */
+typedef struct
+{
+	Oid			roleid;			/* hash key: role and tablespace */
+	Oid			spcid;
+	int64		quota;
+	bool		seen;			/* still present in the table? */
+} LoadedQuotaEntry;
+
+static HTAB *loaded_quotas_map = NULL;
+static uint64 loaded_config_version;
+
+/*
+ * Does quota.config have the spcid column? It doesn't, if the extension
+ * hasn't been updated from version 1.0 yet. Then it has no trigger either.
+ */
+static bool config_has_spcid = true;
+
+/* Has the current transaction modified the configuration table? */
+static bool config_changed_in_xact = false;
+static bool config_xact_callback_registered = false;
 
 /*
  * Signal handler for SIGTERM
@@ -85,17 +135,52 @@ pg_quota_sighup(SIGNAL_ARGS)
 	errno = save_errno;
 }
 
+/*
+ * Has this worker been asked to shut down? Long-running loops, like a
+ * throttled full scan, check this to stop early.
+ */
+bool
+quota_worker_terminating(void)
+{
+	return got_sigterm;
+}
+
+/*
+ * Does this database have any quotas configured?
+ */
+static bool
+have_quotas(void)
+{
+	return loaded_quotas_map != NULL &&
+		hash_get_num_entries(loaded_quotas_map) > 0;
+}
+
 /*
  * Load quotas from configuration table.
+ *
+ * 'config_version' is the value of GetQuotaConfigVersion(), read before the
+ * active snapshot was taken. This is a no-op, if the table hasn't been
+ * modified since the last call. Otherwise the whole table is re-read, but
+ * only the quotas that have actually changed are applied to the model.
+ *
+ * Version 1.0 of the extension has no trigger on the table to bump the
+ * counter, so until it's updated, the table is re-read on every call.
  */
 static void
-load_quotas(void)
+load_quotas(uint64 config_version)
 {
 	int			ret;
 	TupleDesc	tupdesc;
 	int			i;
 	RangeVar   *rv;
 	Relation	rel;
+	HASH_SEQ_STATUS iter;
+	LoadedQuotaEntry *entry;
+	bool		retry = false;
+
+	if (loaded_quotas_map != NULL && config_version == loaded_config_version &&
+		config_has_spcid)
+		return;
 
 	rv = makeRangeVar("quota", "config", -1);
 	rel = heap_openrv_extended(rv, AccessShareLock, true);
@@ -107,41 +192,165 @@ load_quotas(void)
 		return;
 	}
 
-	ret = SPI_execute("select roleid, quota int8 from quota.config", true, 0);
+	if (loaded_quotas_map == NULL)
+	{
+		HASHCTL		hash_ctl;
+
+		memset(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = 2 * sizeof(Oid);
+		hash_ctl.entrysize = sizeof(LoadedQuotaEntry);
+
+		loaded_quotas_map = hash_create("loaded quotas map",
+										1024,
+										&hash_ctl,
+										HASH_ELEM | HASH_BLOBS);
+	}
+
+	/* Version 1.0 only has database-wide quotas */
+	config_has_spcid = (get_attnum(RelationGetRelid(rel), "spcid") !=
+						InvalidAttrNumber);
+	if (config_has_spcid)
+		ret = SPI_execute("select roleid, spcid, quota int8 from quota.config", true, 0);
+	else
+		ret = SPI_execute("select roleid, 0::oid, quota int8 from quota.config", true, 0);
 	if (ret != SPI_OK_SELECT)
 		elog(FATAL, "SPI_execute failed: error code %d", ret);
 
 	tupdesc = SPI_tuptable->tupdesc;
-	if (tupdesc->natts != 2 ||
+	if (tupdesc->natts != 3 ||
 		TupleDescAttr(tupdesc, 0)->atttypid != OIDOID ||
-		TupleDescAttr(tupdesc, 1)->atttypid != INT8OID)
-		elog(ERROR, "query must yield two columns, oid and int8");
+		TupleDescAttr(tupdesc, 1)->atttypid != OIDOID ||
+		TupleDescAttr(tupdesc, 2)->atttypid != INT8OID)
+		elog(ERROR, "query must yield three columns, oid, oid and int8");
+
+	hash_seq_init(&iter, loaded_quotas_map);
+	while ((entry = hash_seq_search(&iter)) != NULL)
+		entry->seen = false;
 
 	for (i = 0; i < SPI_processed; i++)
 	{
 		HeapTuple	tup = SPI_tuptable->vals[i];
 		Datum		dat;
-		Oid			roleid;
+		Oid			key[2];
 		int64		quota;
 		bool		isnull;
+		bool		found;
 
 		dat = SPI_getbinval(tup, tupdesc, 1, &isnull);
 		if (isnull)
 			continue;
-		roleid = DatumGetObjectId(dat);
+		key[0] = DatumGetObjectId(dat);
 
 		dat = SPI_getbinval(tup, tupdesc, 2, &isnull);
+		if (isnull)
+			continue;
+		key[1] = DatumGetObjectId(dat);
+
+		dat = SPI_getbinval(tup, tupdesc, 3, &isnull);
 		if (isnull)
 			continue;
 		quota = DatumGetInt64(dat);
 
-		/* Update the model with this */
-		UpdateQuota(roleid, quota);
+		entry = (LoadedQuotaEntry *) hash_search(loaded_quotas_map,
+												 (void *) key,
+												 HASH_ENTER, &found);
+		entry->seen = true;
+
+		/* Update the model with this, if it changed */
+		if (!found || entry->quota != quota)
+		{
+			entry->quota = quota;
+			if (!UpdateQuota(entry->roleid, entry->spcid, quota))
+			{
+				/*
+				 * No room in shared memory. Forget about it, and make sure we
+				 * try again on the next call.
+				 */
+				(void) hash_search(loaded_quotas_map, (void *) key,
+								   HASH_REMOVE, NULL);
+				retry = true;
+			}
+		}
 	}
 
+	/* Remove the quotas of roles that are no longer in the table */
+	hash_seq_init(&iter, loaded_quotas_map);
+	while ((entry = hash_seq_search(&iter)) != NULL)
+	{
+		if (!entry->seen)
+		{
+			UpdateQuota(entry->roleid, entry->spcid, -1);
+			(void) hash_search(loaded_quotas_map,
+							   (void *) &entry->roleid,
+							   HASH_REMOVE, NULL);
+		}
+	}
+
+	if (!retry)
+		loaded_config_version = config_version;
+
 	heap_close(rel, NoLock);
 }
 
+/*
+ * Transaction callback, to notify the worker after a transaction that
+ * modified the configuration table commits. (If we did it in the trigger
+ * already, the worker might reload the table before the changes are visible
+ * to it.)
+ *
+ * A prepared transaction is committed later by COMMIT PREPARED, possibly in
+ * another backend, and there is no callback for that, so refuse to prepare
+ * one that has modified the table.
+ */
+static void
+config_changed_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+			if (config_changed_in_xact)
+				QuotaConfigChanged();
+			config_changed_in_xact = false;
+			break;
+
+		case XACT_EVENT_PRE_PREPARE:
+			if (config_changed_in_xact)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot PREPARE a transaction that has modified the quota configuration")));
+			break;
+
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			config_changed_in_xact = false;
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * Trigger on the configuration table.
+ */
+Datum
+config_changed(PG_FUNCTION_ARGS)
+{
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "config_changed: not called by trigger manager");
+
+	if (!config_xact_callback_registered)
+	{
+		RegisterXactCallback(config_changed_xact_callback, NULL);
+		config_xact_callback_registered = true;
+	}
+	config_changed_in_xact = true;
+
+	return PointerGetDatum(NULL);
+}
+
 /*
  * get_relfilenode_owner
  *
@@ -179,13 +388,227 @@ get_relfilenode_owner(RelFileNode *rnode)
 	}
 }
 
+/*
+ * get_role_ancestors
+ *
+ *		Returns the OIDs of all the roles that 'roleid' is a member of,
+ *		directly or indirectly, not including 'roleid' itself. Membership
+ *		counts regardless of the INHERIT attribute.
+ */
+List *
+get_role_ancestors(Oid roleid)
+{
+	List	   *roles_list;
+	ListCell   *l;
+
+	/*
+	 * Breadth-first walk of pg_auth_members, like roles_is_member_of() in
+	 * acl.c. The list is extended while we iterate it.
+	 */
+	roles_list = list_make1_oid(roleid);
+	foreach(l, roles_list)
+	{
+		Oid			memberid = lfirst_oid(l);
+		CatCList   *memlist;
+		int			i;
+
+		memlist = SearchSysCacheList1(AUTHMEMMEMROLE,
+									  ObjectIdGetDatum(memberid));
+		for (i = 0; i < memlist->n_members; i++)
+		{
+			HeapTuple	tup = &memlist->members[i]->tuple;
+			Oid			otherid = ((Form_pg_auth_members) GETSTRUCT(tup))->roleid;
+
+			roles_list = list_append_unique_oid(roles_list, otherid);
+		}
+		ReleaseSysCacheList(memlist);
+	}
+
+	return list_delete_first(roles_list);
+}
+
+/*
+ * Get the relfilenode of a pg_class row, as the worker sees it in the data
+ * directory. Returns false for relations that the worker doesn't track:
+ * system relations, mapped relations, which have relfilenode 0, and
+ * temporary relations, whose files are named differently.
+ */
+static bool
+pg_class_get_rnode(Form_pg_class classform, RelFileNode *rnode)
+{
+	if (classform->relfilenode < FirstNormalObjectId ||
+		classform->relpersistence == RELPERSISTENCE_TEMP)
+		return false;
+
+	/* reltablespace is 0 for the database's default tablespace */
+	rnode->spcNode = OidIsValid(classform->reltablespace) ?
+		classform->reltablespace : MyDatabaseTableSpace;
+	rnode->dbNode = MyDatabaseId;
+	rnode->relNode = classform->relfilenode;
+
+	return true;
+}
+
+/*
+ * get_relid_rnode_owner
+ *
+ *		Looks up the relfilenode and owner of a relation by OID. Returns
+ *		false if the relation doesn't exist, or isn't tracked by the worker.
+ */
+bool
+get_relid_rnode_owner(Oid relid, RelFileNode *rnode, Oid *owner)
+{
+	HeapTuple	tp;
+	bool		result;
+
+	tp = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tp))
+		return false;
+
+	result = pg_class_get_rnode((Form_pg_class) GETSTRUCT(tp), rnode);
+	*owner = ((Form_pg_class) GETSTRUCT(tp))->relowner;
+	ReleaseSysCache(tp);
+
+	return result;
+}
+
+/*
+ * scan_relation_owners
+ *
+ *		Calls 'callback' with the relfilenode and owner of every relation in
+ *		pg_class that could be tracked by the worker, using a single
+ *		sequential scan.
+ */
+void
+scan_relation_owners(relation_owner_callback callback)
+{
+	Relation	rel;
+	HeapScanDesc scan;
+	HeapTuple	tuple;
+
+	rel = heap_open(RelationRelationId, AccessShareLock);
+	scan = heap_beginscan_catalog(rel, 0, NULL);
+
+	while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		Form_pg_class classform = (Form_pg_class) GETSTRUCT(tuple);
+		RelFileNode rnode;
+
+		if (pg_class_get_rnode(classform, &rnode))
+			callback(&rnode, classform->relowner);
+	}
+
+	heap_endscan(scan);
+	heap_close(rel, AccessShareLock);
+}
+
+/*
+ * Look up the owners of new relations, and reload the quota configuration if
+ * it has changed.
+ */
+static void
+process_catalogs(void)
+{
+	instr_time	start_time;
+	instr_time	duration;
+	uint64		config_version;
+
+	/*
+	 * Start a transaction on which we can run queries.  Note that each
+	 * StartTransactionCommand() call should be preceded by a
+	 * SetCurrentStatementStartTimestamp() call, which sets both the time
+	 * for the statement we're about the run, and also the transaction
+	 * start time.  Also, each other query sent to SPI should probably be
+	 * preceded by SetCurrentStatementStartTimestamp(), so that statement
+	 * start time is always up to date.
+	 *
+	 * The SPI_connect() call lets us run queries through the SPI manager,
+	 * and the PushActiveSnapshot() call creates an "active" snapshot
+	 * which is necessary for queries to have MVCC data to work on.
+	 *
+	 * The pgstat_report_activity() call makes our activity visible
+	 * through the pgstat views.
+	 */
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+
+	/*
+	 * Read the configuration version counter before taking the snapshot.
+	 * The counter is bumped after a modification of quota.config has
+	 * committed, so the snapshot is sure to see every modification counted
+	 * so far. If the table is modified again after this, we will notice on
+	 * the next call.
+	 */
+	config_version = GetQuotaConfigVersion();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	pgstat_report_activity(STATE_RUNNING, "scanning pg_class");
+
+	/*
+	 * If there are any relfilenodes for which we don't know the owner, look
+	 * them up.
+	 */
+	INSTR_TIME_SET_CURRENT(start_time);
+	UpdateOrphans();
+	UpdateRoleRollups();
+	UpdateTempUsage();
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start_time);
+	RecordRefreshPhase(QUOTA_PHASE_ORPHANS, INSTR_TIME_GET_MILLISEC(duration));
+
+	pgstat_report_activity(STATE_RUNNING, "loading quota configuration");
+	INSTR_TIME_SET_CURRENT(start_time);
+	load_quotas(config_version);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start_time);
+	RecordRefreshPhase(QUOTA_PHASE_LOAD_QUOTAS, INSTR_TIME_GET_MILLISEC(duration));
+
+	/*
+	 * And finish our transaction.
+	 */
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_stat(false);
+}
+
+/*
+ * Is someone waiting for us to leave the database? DROP DATABASE, ALTER
+ * DATABASE RENAME or SET TABLESPACE, and CREATE DATABASE using this database
+ * as the template, all wait a few seconds for the other backends to exit,
+ * and fail if they don't. They only signal autovacuum workers, though, so we
+ * have to notice ourselves. While waiting, they hold a lock on the database
+ * object that conflicts with the RowExclusiveLock that backends take when
+ * they connect, so probe for that.
+ */
+static bool
+database_lock_requested(void)
+{
+	LOCKTAG		tag;
+
+	SET_LOCKTAG_OBJECT(tag, InvalidOid, DatabaseRelationId, MyDatabaseId, 0);
+	if (LockAcquire(&tag, RowExclusiveLock, true, true) == LOCKACQUIRE_NOT_AVAIL)
+		return true;
+	LockRelease(&tag, RowExclusiveLock, true);
+	return false;
+}
+
 /*
  * Main entry point for the background worker.
  */
 void
 pg_quota_worker_main(Datum main_arg)
 {
-	char	   *dbname = MyBgworkerEntry->bgw_extra;
+	Oid			dboid = DatumGetObjectId(main_arg);
+	bool		installed;
+	bool		watching;
+	bool		need_full_scan = true;
+	TimestampTz last_full_scan = 0;
+	TimestampTz last_refresh = 0;
+	TimestampTz last_hot_refresh = 0;
+	long		full_scan_delay;
+	TimestampTz last_snapshot;
 
 	/* Establish signal handlers before unblocking signals. */
 	pqsignal(SIGHUP, pg_quota_sighup);
@@ -195,7 +618,22 @@ pg_quota_worker_main(Datum main_arg)
 	BackgroundWorkerUnblockSignals();
 
 	/* Connect to our database */
-	BackgroundWorkerInitializeConnection(dbname, NULL, 0);
+	BackgroundWorkerInitializeConnectionByOid(dboid, InvalidOid, 0);
+
+	/*
+	 * The launcher starts a worker for every database, so check that the
+	 * extension is actually installed in this one.
+	 */
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	installed = OidIsValid(get_extension_oid("pg_quota", true));
+	CommitTransactionCommand();
+	if (!installed)
+	{
+		elog(DEBUG1, "pg_quota is not installed in database %u, exiting", dboid);
+		ReportMissingExtension();
+		proc_exit(0);
+	}
 
 	elog(LOG, "%s initialized",
 		 MyBgworkerEntry->bgw_name);
@@ -204,7 +642,20 @@ pg_quota_worker_main(Datum main_arg)
 	 * Initialize the model and set the latch to refresh the model for the first
 	 * time without waiting.
 	 */
-	init_fs_model();
+	if (!init_fs_model())
+		proc_exit(0);
+	watching = pg_quota_use_inotify && init_fs_watch();
+	full_scan_delay = pg_quota_refresh_naptime * 1000L;
+
+	/*
+	 * If an earlier worker left a snapshot of the model behind, start from
+	 * that, and load the quotas right away, so that they are enforced while
+	 * we do the first full scan.
+	 */
+	if (load_fs_model_snapshot())
+		process_catalogs();
+	last_snapshot = GetCurrentTimestamp();
+
 	SetLatch(MyLatch);
 
 	/*
@@ -213,6 +664,28 @@ pg_quota_worker_main(Datum main_arg)
 	while (!got_sigterm)
 	{
 		int			rc;
+		bool		full_scan;
+		long		timeout;
+		long		secs;
+		int			usecs;
+		TimestampTz now;
+		instr_time	start_time;
+		instr_time	scan_time;
+		instr_time	catalog_time;
+
+		/*
+		 * Sleep until the next regular refresh. If some relations are
+		 * growing, wake up more often in between, to refresh just those.
+		 */
+		TimestampDifference(GetCurrentTimestamp(),
+							TimestampTzPlusMilliseconds(last_refresh,
+														pg_quota_refresh_naptime * 1000),
+							&secs, &usecs);
+		timeout = secs * 1000 + usecs / 1000;
+		if (HaveHotRelations())
+			timeout = Min(timeout, pg_quota_hot_refresh_naptime);
+		/* and check for DROP DATABASE often enough to get out of its way */
+		timeout = Min(timeout, DATABASE_LOCK_CHECK_INTERVAL);
 
 		/*
 		 * Background workers mustn't call usleep() or any direct equivalent:
@@ -222,7 +695,7 @@ pg_quota_worker_main(Datum main_arg)
 		 */
 		rc = WaitLatch(MyLatch,
 					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   pg_quota_refresh_naptime * 1000L,
+					   timeout,
 					   PG_WAIT_EXTENSION);
 		ResetLatch(MyLatch);
 
@@ -237,82 +710,176 @@ pg_quota_worker_main(Datum main_arg)
 		 */
 		if (got_sighup)
 		{
+			bool		temp_counted = pg_quota_temp_counts_toward_quota;
+
 			got_sighup = false;
 			ProcessConfigFile(PGC_SIGHUP);
+			if (pg_quota_temp_counts_toward_quota != temp_counted)
+				RecheckQuotas();
+		}
+
+		if (database_lock_requested())
+		{
+			ereport(LOG,
+					(errmsg("%s exiting, because another backend is waiting to drop, move or copy the database",
+							MyBgworkerEntry->bgw_name)));
+			break;
 		}
 
 		/*
-		 * Rescan the data directory.
+		 * Between the regular refreshes, only look at the hot relations. If
+		 * we're following the changes incrementally, that's the same as a
+		 * regular refresh, just without the catalog lookups.
 		 */
-		pgstat_report_activity(STATE_RUNNING, "scanning datadir");
-		refresh_fs_model();
+		now = GetCurrentTimestamp();
+		if (!(rc & WL_LATCH_SET) &&
+			!TimestampDifferenceExceeds(last_refresh, now,
+										pg_quota_refresh_naptime * 1000))
+		{
+			if (HaveHotRelations() &&
+				TimestampDifferenceExceeds(last_hot_refresh, now,
+										   pg_quota_hot_refresh_naptime))
+			{
+				last_hot_refresh = now;
+				pgstat_report_activity(STATE_RUNNING, "refreshing hot relations");
+				if (!watching)
+					refresh_fs_model_hot();
+				else if (!refresh_fs_model_changes())
+					need_full_scan = true;
+				pgstat_report_activity(STATE_IDLE, NULL);
+			}
+			continue;
+		}
+		last_refresh = now;
 
 		/*
-		 * Start a transaction on which we can run queries.  Note that each
-		 * StartTransactionCommand() call should be preceded by a
-		 * SetCurrentStatementStartTimestamp() call, which sets both the time
-		 * for the statement we're about the run, and also the transaction
-		 * start time.  Also, each other query sent to SPI should probably be
-		 * preceded by SetCurrentStatementStartTimestamp(), so that statement
-		 * start time is always up to date.
+		 * Bring the model up-to-date with the data directory. If we're
+		 * watching the data directory for changes, it's enough to process the
+		 * files that have changed since last time. Even then, do a full scan
+		 * every once in a while, just in case.
 		 *
-		 * The SPI_connect() call lets us run queries through the SPI manager,
-		 * and the PushActiveSnapshot() call creates an "active" snapshot
-		 * which is necessary for queries to have MVCC data to work on.
-		 *
-		 * The pgstat_report_activity() call makes our activity visible
-		 * through the pgstat views.
+		 * Otherwise, rescan everything, but back off if the scans don't find
+		 * anything new, and no role is near its quota. In between, refresh
+		 * the hot relations.
 		 */
-		SetCurrentStatementStartTimestamp();
-		StartTransactionCommand();
-		SPI_connect();
-		PushActiveSnapshot(GetTransactionSnapshot());
+		INSTR_TIME_SET_CURRENT(start_time);
+		if (!need_full_scan &&
+			!TimestampDifferenceExceeds(last_full_scan, now,
+										watching ?
+										pg_quota_full_scan_interval * 1000 :
+										full_scan_delay))
+		{
+			if (watching)
+			{
+				pgstat_report_activity(STATE_RUNNING, "processing datadir changes");
+				if (!refresh_fs_model_changes())
+					need_full_scan = true;
+			}
+			else
+			{
+				pgstat_report_activity(STATE_RUNNING, "refreshing hot relations");
+				refresh_fs_model_hot();
+			}
+		}
+		else
+			need_full_scan = true;
 
-		pgstat_report_activity(STATE_RUNNING, "scanning pg_class");
+		if (need_full_scan)
+		{
+			pgstat_report_activity(STATE_RUNNING, "scanning datadir");
 
-		/*
-		 * If there are any relfilenodes for which we don't know the owner, look
-		 * them up.
-		 */
-		UpdateOrphans();
+			/* The full scan will see all the changes, no need to process them */
+			if (watching)
+				(void) fs_watch_process_events(false);
 
-		pgstat_report_activity(STATE_RUNNING, "loading quota configuration");
-		load_quotas();
+			/*
+			 * Only back off if there are no quotas to enforce. Without
+			 * inotify, a new relation, or one that starts growing again after
+			 * a quiet period, is only noticed by a full scan, so backing off
+			 * would let a role run far past its quota unseen.
+			 */
+			last_full_scan = GetCurrentTimestamp();
+			if (refresh_fs_model() || have_quotas())
+				full_scan_delay = pg_quota_refresh_naptime * 1000L;
+			else
+				full_scan_delay = Min(full_scan_delay * 2,
+									  pg_quota_full_scan_interval * 1000L);
+			need_full_scan = false;
+			full_scan = true;
+		}
+		else
+			full_scan = false;
+		INSTR_TIME_SET_CURRENT(scan_time);
+
+		process_catalogs();
+
+		INSTR_TIME_SET_CURRENT(catalog_time);
+		INSTR_TIME_SUBTRACT(catalog_time, scan_time);
+		INSTR_TIME_SUBTRACT(scan_time, start_time);
+		RecordRefreshPhase(QUOTA_PHASE_SCAN, INSTR_TIME_GET_MILLISEC(scan_time));
+		PublishWorkerStats(full_scan);
+		PublishRelationSizes();
 
 		/*
-		 * And finish our transaction.
+		 * Log how long the refresh took, if asked to. bench/run_bench.sh
+		 * greps for these lines, so keep the format stable.
 		 */
-		SPI_finish();
-		PopActiveSnapshot();
-		CommitTransactionCommand();
-		pgstat_report_stat(false);
+		if (pg_quota_log_refresh_stats)
+			elog(LOG, "pg_quota refresh: %s scan %.3f ms, catalogs %.3f ms",
+				 full_scan ? "full" : "incremental",
+				 INSTR_TIME_GET_MILLISEC(scan_time),
+				 INSTR_TIME_GET_MILLISEC(catalog_time));
+
+		/* Save the model every once in a while, for a fast restart. */
+		if (pg_quota_snapshot_interval > 0 &&
+			TimestampDifferenceExceeds(last_snapshot, GetCurrentTimestamp(),
+									   pg_quota_snapshot_interval * 1000))
+		{
+			pgstat_report_activity(STATE_RUNNING, "writing snapshot");
+			write_fs_model_snapshot();
+			last_snapshot = GetCurrentTimestamp();
+		}
+
 		pgstat_report_activity(STATE_IDLE, NULL);
 	}
 
+	/*
+	 * Save the model for the next worker, unless we were asked to exit
+	 * before the first full scan completed.
+	 */
+	if (last_full_scan != 0)
+		write_fs_model_snapshot();
+
 	proc_exit(1);
 }
 
 /*
  * Entrypoint of this module.
  *
- * Register the background workers for each database that uses quotas.
+ * Register the launcher, which starts the workers for each database that
+ * uses quotas.
  */
 void
 _PG_init(void)
 {
-	BackgroundWorker worker;
-	ListCell   *lc;
-	char	   *dbstr;
-	List	   *dblist;
-
 	/* This initialization must happen at postmaster startup. */
 	if (!process_shared_preload_libraries_in_progress)
 		return;
 
-	init_fs_model_shmem();
-	init_quota_enforcement();
-
 	/* Get the configuration */
+	DefineCustomIntVariable("pg_quota.max_entries",
+							"Maximum number of roles and databases tracked in shared memory.",
+							NULL,
+							&pg_quota_max_entries,
+							8192,
+							64,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomIntVariable("pg_quota.refresh_naptime",
 							"Duration between each full scan of datadir (in seconds).",
 							NULL,
@@ -339,54 +906,240 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomBoolVariable("pg_quota.use_inotify",
+							 "Use inotify to track changes to the data directory between full scans.",
+							 NULL,
+							 &pg_quota_use_inotify,
+							 true,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_quota.full_scan_interval",
+							"Maximum duration between full scans of datadir (in seconds).",
+							"Without inotify, the full scans back off up to this, while they find no changes.",
+							&pg_quota_full_scan_interval,
+							300,
+							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_quota.hot_refresh_naptime",
+							"Duration between refreshes of recently grown relations (in milliseconds).",
+							"Only relations whose owner has a quota are refreshed this often.",
+							&pg_quota_hot_refresh_naptime,
+							1000,
+							10,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_quota.growth_projection",
+							"How far ahead to project each role's growth rate, when enforcing quotas (in seconds).",
+							"Zero disables the projection.",
+							&pg_quota_growth_projection,
+							30,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_quota.publish_relation_sizes",
+							 "Publish the size of every relation, for quota.relation_sizes.",
+							 NULL,
+							 &pg_quota_publish_relation_sizes,
+							 true,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_quota.track_temp",
+							 "Track the temporary files and relations of each role.",
+							 NULL,
+							 &pg_quota_track_temp,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_quota.temp_counts_toward_quota",
+							 "Count temporary space usage toward the quotas.",
+							 "Only has an effect if pg_quota.track_temp is on.",
+							 &pg_quota_temp_counts_toward_quota,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_quota.skip_static_segments",
+							 "Skip stat() for full segments in directories that haven't changed.",
+							 NULL,
+							 &pg_quota_skip_static_segments,
+							 true,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_quota.scan_cost_limit",
+							"The amount of work a full scan does before napping.",
+							"Each directory entry read, or file stat()ed, costs one.",
+							&pg_quota_scan_cost_limit,
+							200,
+							1,
+							10000,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_quota.scan_cost_delay",
+							"Duration of the naps a full scan takes, to limit its I/O rate (in milliseconds).",
+							"Zero disables the cost-based delay.",
+							&pg_quota_scan_cost_delay,
+							0,
+							0,
+							100,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_quota.snapshot_interval",
+							"Duration between writing snapshots of the disk usage model (in seconds).",
+							"Zero disables periodic snapshots; one is still written at shutdown.",
+							&pg_quota_snapshot_interval,
+							300,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_quota.log_refresh_stats",
+							 "Log how long each refresh of the disk usage model takes.",
+							 NULL,
+							 &pg_quota_log_refresh_stats,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_quota.enforce",
+							 "Reject INSERTs and COPYs into relations whose owner is over quota.",
+							 "Disk space usage is still tracked when this is off.",
+							 &pg_quota_enforce,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_quota.check_all_partitions",
+							 "Check the owners of all partitions on INSERTs and COPYs into a partitioned table.",
+							 "When off, only partitions owned by the partitioned table's owner or the current user are checked.",
+							 &pg_quota_check_all_partitions,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_quota.max_parallel_scanners",
+							"Maximum number of helper processes used to scan tablespaces in parallel.",
+							"Zero disables parallel scanning.",
+							&pg_quota_max_parallel_scanners,
+							4,
+							0,
+							64,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_quota.max_workers",
+							"Maximum number of per-database workers running at a time.",
+							NULL,
+							&pg_quota_max_workers,
+							8,
+							1,
+							MAX_BACKENDS,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_quota.launcher_naptime",
+							"Duration between checks for new databases (in seconds).",
+							NULL,
+							&pg_quota_launcher_naptime,
+							60,
+							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_quota.rotation_interval",
+							"How long a worker runs before making room for other databases (in seconds).",
+							"Only matters if there are more databases than pg_quota.max_workers.",
+							&pg_quota_rotation_interval,
+							600,
+							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
 	/*
 	 * we'd really want this to be GUC_LIST_QUOTE, but alas, an extension cannot
 	 * use that.
 	 */
 	DefineCustomStringVariable("pg_quota.databases",
 							   "List of databases to enforce quotas for.",
-							   NULL,
+							   "Empty means all databases where the extension is installed.",
 							   &pg_quota_databases,
-							   "postgres",
-							   PGC_POSTMASTER, GUC_LIST_INPUT,
+							   "",
+							   PGC_SIGHUP, GUC_LIST_INPUT,
 							   NULL,
 							   NULL,
 							   NULL);
 
-	/* set up common data for all our workers */
-	memset(&worker, 0, sizeof(worker));
-	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
-		BGWORKER_BACKEND_DATABASE_CONNECTION;
-	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
-	worker.bgw_restart_time = pg_quota_restart_interval;
-	sprintf(worker.bgw_library_name, "pg_quota");
-	sprintf(worker.bgw_function_name, "pg_quota_worker_main");
-	worker.bgw_notify_pid = 0;
-
-	/*
-	 * Now register a background worker for each database listed in
-	 * pg_quota.databases.
-	 */
-
-	/* Need a modifiable copy of namespace_search_path string */
-	dbstr = pstrdup(pg_quota_databases);
-
-	/* Parse string into list of identifiers */
-	if (!SplitIdentifierString(dbstr, ',', &dblist))
-	{
-		/* syntax error in database name list */
-		/* XXX ereport */
-		elog(ERROR, "invalid list syntax in pg_quota.databases setting");
-	}
-
-	foreach(lc, dblist)
-	{
-		char	   *dbname = (char *) lfirst(lc);
-
-		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_quota worker for \"%s\"", dbname);
-		snprintf(worker.bgw_type, BGW_MAXLEN, "pg_quota worker");
-		snprintf(worker.bgw_extra, BGW_EXTRALEN, "%s", dbname);
+	init_fs_model_shmem();
+	init_quota_enforcement();
 
-		RegisterBackgroundWorker(&worker);
-	}
+	register_quota_launcher();
 }
@@ -5,23 +5,100 @@
 #ifndef PG_QUOTA_H
 #define PG_QUOTA_H
 
+#include "datatype/timestamp.h"
+#include "nodes/pg_list.h"
 #include "storage/relfilenode.h"
 
 /* prototypes for pg_quota.c */
+extern char *pg_quota_databases;
+extern int	pg_quota_restart_interval;
+
+typedef void (*relation_owner_callback) (RelFileNode *rnode, Oid owner);
+
 extern Oid get_relfilenode_owner(RelFileNode *rnode);
+extern bool get_relid_rnode_owner(Oid relid, RelFileNode *rnode, Oid *owner);
+extern void scan_relation_owners(relation_owner_callback callback);
+extern List *get_role_ancestors(Oid roleid);
+extern bool quota_worker_terminating(void);
 
 /* prototypes for fs_model.c */
-extern void init_fs_model(void);
+extern int	pg_quota_max_entries;
+extern int	pg_quota_growth_projection;
+extern bool pg_quota_publish_relation_sizes;
+extern bool pg_quota_track_temp;
+extern bool pg_quota_temp_counts_toward_quota;
+extern bool pg_quota_skip_static_segments;
+extern int	pg_quota_scan_cost_limit;
+extern int	pg_quota_scan_cost_delay;
+
+/* Phases of a refresh, timed separately in quota.worker_stats */
+typedef enum QuotaRefreshPhase
+{
+	QUOTA_PHASE_SCAN,			/* data directory scan, full or incremental */
+	QUOTA_PHASE_ORPHANS,		/* UpdateOrphans() */
+	QUOTA_PHASE_LOAD_QUOTAS,	/* loading quota.config */
+	QUOTA_NUM_PHASES
+} QuotaRefreshPhase;
+
+extern bool init_fs_model(void);
 extern void init_fs_model_shmem(void);
-extern void refresh_fs_model(void);
+extern bool refresh_fs_model(void);
+extern bool refresh_fs_model_changes(void);
+extern void refresh_fs_model_hot(void);
+extern bool HaveHotRelations(void);
+extern void refresh_fs_model_file(const char *dirpath, const char *filename);
+extern void refresh_fs_model_file_size(const char *dirpath,
+						   const char *filename, off_t filesize);
+extern bool scan_delay_point(void);
 
 extern void UpdateRelOwner(RelFileNode *rnode, Oid owner);
 extern void UpdateOrphans(void);
+extern void UpdateRoleRollups(void);
+extern void UpdateTempUsage(void);
+extern void RecheckQuotas(void);
+extern void write_fs_model_snapshot(void);
+extern bool load_fs_model_snapshot(void);
 
-extern bool CheckQuota(Oid owner);
-extern void UpdateQuota(Oid owner, int64 newquota);
+extern bool CheckQuota(Oid owner, Oid spcid, TimestampTz *recheck_at);
+extern uint64 GetQuotaGeneration(void);
+extern bool UpdateQuota(Oid owner, Oid spcid, int64 newquota);
+extern uint64 GetQuotaConfigVersion(void);
+extern void QuotaConfigChanged(void);
+extern void ReportMissingExtension(void);
+extern bool IsExtensionMissing(Oid dbid);
+extern bool IsWorkerRunning(Oid dbid);
+extern void ForgetDbState(Oid dbid);
+extern void ForgetOtherDbStates(bool (*keep) (Oid dbid));
+extern void RecordRefreshPhase(QuotaRefreshPhase phase, double elapsed);
+extern void PublishWorkerStats(bool full_scan);
+extern void PublishRelationSizes(void);
+extern void CountQuotaCheck(bool rejected);
 
 /* prototypes for enforcement.c */
+extern bool pg_quota_enforce;
+extern bool pg_quota_check_all_partitions;
+
 extern void init_quota_enforcement(void);
 
+/* prototypes for fs_watch.c */
+extern bool init_fs_watch(void);
+extern void fs_watch_add_dir(const char *dirpath);
+extern bool fs_watch_process_events(bool apply);
+
+/* prototypes for fs_scanner.c */
+typedef struct FsScanner FsScanner;
+
+extern int	pg_quota_max_parallel_scanners;
+
+extern bool request_fs_scan(const char *dirpath);
+extern void poll_fs_scanners(void);
+extern List *finish_fs_scanners(void);
+
+/* prototypes for launcher.c */
+extern int	pg_quota_max_workers;
+extern int	pg_quota_launcher_naptime;
+extern int	pg_quota_rotation_interval;
+
+extern void register_quota_launcher(void);
+
 #endif							/* PG_QUOTA_H */
@@ -63,3 +63,171 @@ FROM quota.status
 WHERE rolname::text like 'quotatest%';
 
 INSERT INTO qt SELECT repeat('x', 100) FROM generate_series(1, 100000);
+
+-- Partitioned tables. The rows are routed to partitions, which can belong to
+-- other roles. The owners of all the partitions are checked, unless
+-- pg_quota.check_all_partitions is turned off, in which case only the
+-- partitions owned by the partitioned table's owner, or by the inserting
+-- role, are.
+CREATE USER quotapart_user NOLOGIN;
+CREATE TABLE qt_parted (i int, t text) PARTITION BY RANGE (i);
+CREATE TABLE qt_part1 PARTITION OF qt_parted FOR VALUES FROM (0) TO (1000);
+CREATE TABLE qt_part2 PARTITION OF qt_parted FOR VALUES FROM (1000) TO (2000);
+ALTER TABLE qt_part2 OWNER TO quotapart_user;
+GRANT INSERT ON qt_parted TO quotapart_user;
+INSERT INTO qt_part2 VALUES (1000, 'x');
+INSERT INTO quota.config VALUES ('quotapart_user'::regrole, 0);
+
+select pg_sleep(5);
+
+-- quotapart_user is over quota, which blocks inserts into the whole tree
+INSERT INTO qt_parted VALUES (1, 'x');
+
+-- unless only the table owner's and the current user's partitions count
+SET pg_quota.check_all_partitions = off;
+INSERT INTO qt_parted VALUES (1, 'x');
+RESET pg_quota.check_all_partitions;
+
+-- quotapart_user itself cannot insert into the tree
+SET ROLE quotapart_user;
+INSERT INTO qt_parted VALUES (1, 'x');
+RESET ROLE;
+
+-- CREATE INDEX on the partitioned table checks the partitions' owners too
+CREATE INDEX ON qt_parted (i);
+
+DELETE FROM quota.config WHERE roleid = 'quotapart_user'::regrole;
+DROP TABLE qt_parted;
+
+-- Changes to quota.config are picked up by the worker, through the trigger
+-- on the table.
+CREATE USER quotacfg_user NOLOGIN;
+CREATE TABLE qt_cfg (t text);
+ALTER TABLE qt_cfg OWNER TO quotacfg_user;
+INSERT INTO qt_cfg SELECT repeat('x', 100) FROM generate_series(1, 20000);
+INSERT INTO quota.config VALUES ('quotacfg_user'::regrole, pg_size_bytes('1 MB'));
+
+select pg_sleep(5);
+
+SELECT rolname, quota FROM quota.status WHERE rolname::text = 'quotacfg_user';
+INSERT INTO qt_cfg VALUES ('x');
+
+UPDATE quota.config SET quota = pg_size_bytes('100 MB')
+WHERE roleid = 'quotacfg_user'::regrole;
+
+select pg_sleep(5);
+
+SELECT rolname, quota FROM quota.status WHERE rolname::text = 'quotacfg_user';
+INSERT INTO qt_cfg VALUES ('x');
+
+-- TRUNCATE fires the trigger, too
+TRUNCATE quota.config;
+INSERT INTO quota.config VALUES ('quotacfg_user'::regrole, 0);
+
+select pg_sleep(5);
+
+INSERT INTO qt_cfg VALUES ('x');
+
+TRUNCATE quota.config;
+
+select pg_sleep(5);
+
+SELECT rolname, quota FROM quota.status WHERE rolname::text = 'quotacfg_user';
+INSERT INTO qt_cfg VALUES ('x');
+DROP TABLE qt_cfg;
+
+-- A transaction that modified the configuration cannot be prepared, as the
+-- worker wouldn't be notified when it's committed
+BEGIN;
+INSERT INTO quota.config VALUES ('quotacfg_user'::regrole, 0);
+PREPARE TRANSACTION 'quotacfg';
+
+-- quota.usage breaks each role's usage down by tablespace and fork
+SELECT u.rolname, u.spcname, u.main_size > 0 AS has_main,
+       u.space_used = s.space_used AS adds_up
+FROM quota.usage u JOIN quota.status s USING (rolname)
+WHERE u.rolname::text = 'quotatest_user';
+
+-- A quota on a tablespace only limits the space used in that tablespace
+CREATE USER quotaspc_user NOLOGIN;
+CREATE TABLE qt_spc (t text);
+ALTER TABLE qt_spc OWNER TO quotaspc_user;
+INSERT INTO qt_spc SELECT repeat('x', 100) FROM generate_series(1, 20000);
+INSERT INTO quota.config
+VALUES ('quotaspc_user'::regrole, pg_size_bytes('1 MB'),
+        (SELECT oid FROM pg_tablespace WHERE spcname = 'pg_default'));
+
+select pg_sleep(5);
+
+SELECT rolname, spcname, quota, space_used > quota AS exceeded
+FROM quota.tablespace_status
+WHERE rolname::text = 'quotaspc_user';
+
+-- There's no database-wide quota
+SELECT rolname, quota FROM quota.status WHERE rolname::text = 'quotaspc_user';
+INSERT INTO qt_spc VALUES ('x');
+
+DELETE FROM quota.config WHERE roleid = 'quotaspc_user'::regrole;
+
+select pg_sleep(5);
+
+INSERT INTO qt_spc VALUES ('x');
+DROP TABLE qt_spc;
+
+-- The worker's statistics, and the quota checks done by backends
+SELECT pid > 0 AS running, refreshes > 0 AS refreshed,
+       full_scans > 0 AS scanned, files_stated > 0 AS stated,
+       quota_checks > 0 AS checked, quota_rejections > 0 AS rejected
+FROM quota.worker_stats
+WHERE datname = current_database();
+
+-- A quota on a group role covers its members' tables, too
+CREATE ROLE quotagroup NOLOGIN;
+CREATE USER quotamember_user NOLOGIN;
+GRANT quotagroup TO quotamember_user;
+CREATE TABLE qt_member (t text);
+ALTER TABLE qt_member OWNER TO quotamember_user;
+INSERT INTO qt_member SELECT repeat('x', 100) FROM generate_series(1, 20000);
+INSERT INTO quota.config VALUES ('quotagroup'::regrole, pg_size_bytes('1 MB'));
+
+select pg_sleep(5);
+
+-- The group's usage includes its member's
+SELECT g.space_used = m.space_used AS rolled_up,
+       g.space_used > g.quota AS exceeded
+FROM quota.status g, quota.status m
+WHERE g.rolname::text = 'quotagroup' AND m.rolname::text = 'quotamember_user';
+INSERT INTO qt_member VALUES ('x');
+
+-- The rollups follow membership changes
+REVOKE quotagroup FROM quotamember_user;
+
+select pg_sleep(5);
+
+SELECT coalesce((SELECT space_used FROM quota.status
+                 WHERE rolname::text = 'quotagroup'), 0) AS group_used;
+INSERT INTO qt_member VALUES ('x');
+
+DELETE FROM quota.config WHERE roleid = 'quotagroup'::regrole;
+DROP TABLE qt_member;
+
+-- Temporary relations are counted in temp_size, for the role of the session
+CREATE TEMP TABLE qt_temp AS SELECT repeat('x', 100) t FROM generate_series(1, 20000);
+
+select pg_sleep(5);
+
+SELECT temp_size > 0 AS has_temp FROM quota.status WHERE rolname::text = current_user;
+
+DROP TABLE qt_temp;
+
+select pg_sleep(5);
+
+SELECT temp_size > 0 AS has_temp FROM quota.status WHERE rolname::text = current_user;
+
+-- quota.relation_sizes serves the sizes from the worker's model
+SELECT relation, rolname, spcname,
+       main_size = pg_relation_size('qt') AS main_matches,
+       total_size = pg_relation_size('qt', 'main') + pg_relation_size('qt', 'fsm') +
+                    pg_relation_size('qt', 'vm') + pg_relation_size('qt', 'init') AS total_matches
+FROM quota.relation_sizes
+WHERE relation = 'qt'::regclass;
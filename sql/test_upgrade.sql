@@ -0,0 +1,44 @@
+-- Install version 1.0 of the extension, and update it to the current one.
+-- The worker and quota.status keep working with the 1.0 objects in between.
+DROP EXTENSION pg_quota;
+CREATE EXTENSION pg_quota VERSION '1.0';
+
+CREATE USER quotaupg_user NOLOGIN;
+CREATE TABLE qt_upg (t text);
+ALTER TABLE qt_upg OWNER TO quotaupg_user;
+INSERT INTO qt_upg SELECT repeat('x', 100) FROM generate_series(1, 20000);
+
+select pg_sleep(5);
+
+-- 1.0's quota.status has three columns
+SELECT * FROM quota.status WHERE false;
+SELECT space_used > 0 AS has_usage, quota IS NULL AS no_quota
+FROM quota.status
+WHERE rolname::text = 'quotaupg_user';
+
+-- 1.0 has no trigger on quota.config, so the worker rereads it on every pass
+INSERT INTO quota.config VALUES ('quotaupg_user'::regrole, pg_size_bytes('1 MB'));
+
+select pg_sleep(5);
+
+SELECT space_used > quota AS exceeded
+FROM quota.status
+WHERE rolname::text = 'quotaupg_user';
+INSERT INTO qt_upg VALUES ('x');
+
+-- After the update, the quota is a database-wide one, and changes are picked
+-- up through the trigger
+ALTER EXTENSION pg_quota UPDATE;
+UPDATE quota.config SET quota = pg_size_bytes('100 MB')
+WHERE roleid = 'quotaupg_user'::regrole AND spcid = 0;
+
+select pg_sleep(5);
+
+SELECT space_used > quota AS exceeded, temp_size
+FROM quota.status
+WHERE rolname::text = 'quotaupg_user';
+INSERT INTO qt_upg VALUES ('x');
+
+DELETE FROM quota.config WHERE roleid = 'quotaupg_user'::regrole;
+DROP TABLE qt_upg;
+DROP USER quotaupg_user;